@@ -0,0 +1,103 @@
+/*
+  Large file write check.
+
+  Writes a file many times the size of the block cache into a mounted
+  sfs a chunk at a time, the way cp would, then reads it back and
+  compares.  The pattern has NUL bytes in it and the chunks don't line
+  up with blocks.  With the filesystem mounted at /tmp/laf224/mountdir,
+  build and run with:
+
+      gcc -o bigWrite bigWrite.c
+      ./bigWrite [megabytes] [file]
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define CHUNK 3000 //odd-sized on purpose, so writes straddle blocks
+
+static double now()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static char pattern(off_t i)
+{
+	return i % 251 == 0 ? 0 : (char)(i * 7 + i / 4096);
+}
+
+int main(int argc, char *argv[])
+{
+	off_t total = (off_t)(argc > 1 ? atoi(argv[1]) : 16) * 1024 * 1024;
+	const char *file = argc > 2 ? argv[2] : "/tmp/laf224/mountdir/bigWrite.dat";
+	char buf[CHUNK], back[CHUNK];
+	struct stat st;
+	off_t off;
+	double start;
+	int fd, i, n;
+
+	if((fd = open(file, O_CREAT | O_TRUNC | O_WRONLY, 0644)) < 0)
+	{
+		perror(file);
+		return 1;
+	}
+
+	start = now();
+	for(off = 0; off < total; off += n)
+	{
+		n = total - off < CHUNK ? total - off : CHUNK;
+		for(i = 0; i < n; i++)
+		{
+			buf[i] = pattern(off + i);
+		}
+		if(write(fd, buf, n) != n)
+		{
+			perror("write");
+			return 1;
+		}
+	}
+	close(fd);
+	printf("wrote %lld bytes in %.2fs\n", (long long)total, now() - start);
+
+	if(stat(file, &st) < 0 || st.st_size != total)
+	{
+		printf("FAIL: size is %lld, expected %lld\n", (long long)st.st_size, (long long)total);
+		return 1;
+	}
+
+	if((fd = open(file, O_RDONLY)) < 0)
+	{
+		perror(file);
+		return 1;
+	}
+
+	for(off = 0; off < total; off += n)
+	{
+		n = total - off < CHUNK ? total - off : CHUNK;
+		if(read(fd, back, n) != n)
+		{
+			printf("FAIL: short read at %lld\n", (long long)off);
+			return 1;
+		}
+		for(i = 0; i < n; i++)
+		{
+			if(back[i] != pattern(off + i))
+			{
+				printf("FAIL: byte %lld differs\n", (long long)(off + i));
+				return 1;
+			}
+		}
+	}
+	close(fd);
+
+	unlink(file);
+	printf("OK\n");
+	return 0;
+}
@@ -5,71 +5,2691 @@
   See the file COPYING.
 */
 
+#define _GNU_SOURCE //O_DIRECT
+
+#include <endian.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <linux/io_uring.h>
+#undef BLOCK_SIZE //linux/fs.h's, by way of io_uring.h; ours is in block.h
+
+#include "block.h"
+#include "crc32c.h"
+#include "log.h"
+
+int diskfile = -1;
+int block_size = BLOCK_SIZE_DEFAULT;
+
+/*
+ * Write-back block cache
+ *
+ * Every block that goes through block_read/block_write lands in a fixed
+ * pool of cache_size entries.  Entries are found through a small hash on
+ * the block number and kept on an LRU list; a miss takes the least
+ * recently used entry, writing it back first if it is dirty.  Writes only
+ * touch the cache, so the disk is brought up to date by block_flush()
+ * (also called from disk_close()), or in the background by the flusher
+ * thread (see "Background writeback" below).
+ *
+ * A cache size of 0 turns the cache off and every call goes straight to
+ * pread/pwrite like it used to.
+ */
+typedef struct cache_entry
+{
+    int block_num;
+    int len; //what pread gave back when the block was loaded (0 = never touched)
+    int dirty;
+    long long dirtied; //ms clock when the block last went from clean to dirty
+    unsigned long gen; //cache_gen of the last write, so the flusher can tell if it changed
+    struct cache_entry *hash_next;
+    struct cache_entry *lru_prev;
+    struct cache_entry *lru_next;
+    char *data;
+} cache_entry;
+
+static int cache_size = BLOCK_CACHE_DEFAULT;
+static int cache_used = 0;
+static int hash_size = 0;
+static cache_entry *cache_pool = NULL;
+static cache_entry **cache_hash = NULL;
+static cache_entry lru; //sentinel: lru.lru_next is the most recently used entry
+static unsigned long cache_gen = 0; //bumped by every block_write, see ra_fetch()
+static int cache_dirty = 0; //dirty entries
+
+/*
+ * Locking
+ *
+ * block_lock covers the cache and is taken by every public call (it is
+ * recursive so those calls can use each other).  io_lock serialises
+ * disk_submit(), since the io_uring ring and the O_DIRECT pool are single
+ * user.  The readahead thread takes them one at a time, never nested; the
+ * other paths take block_lock before io_lock.
+ */
+static pthread_mutex_t block_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+static pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Device backends
+ *
+ * All disk traffic funnels through disk_submit(), which takes a batch of
+ * requests.  Each request covers a run of contiguous blocks, with one
+ * iovec per block, so a run costs a single preadv/pwritev no matter how
+ * many blocks are in it.  The pread backend works through the batch one
+ * syscall per run; the io_uring backend queues as much of the batch as
+ * fits in the submission ring, hands it to the kernel with a single
+ * io_uring_enter() and reaps completions in whatever order they finish.
+ * If the ring cannot be set up (old kernel, seccomp) we fall back to pread.
+ */
+typedef struct block_req
+{
+    int block_num; //first block of the run
+    int count; //contiguous blocks in the run
+    struct iovec *iov; //one BLOCK_SIZE buffer per block (one big one for O_DIRECT bounce buffers)
+    int nr_iov;
+    int write;
+    int result; //bytes transferred, or negative on failure
+    int member; //which image file of a striped set block_num is in (see below)
+} block_req;
+
+static int io_backend = BLOCK_IO_PREAD;
+
+/*
+ * Striping
+ *
+ * The disk can be spread over several image files, RAID-0 style: block b
+ * is in stripe unit b / stripe_width, units go round the members in turn,
+ * and inside a member they are packed one after another.  Runs are split
+ * at unit boundaries in stripe_submit() into per-member requests, which
+ * the io_uring backend submits together and the pread backend hands to
+ * one thread per member, so the members are busy at the same time.  With
+ * a single member (the usual case) none of this is in the way.
+ */
+static int stripe_fds[BLOCK_STRIPE_MAX];
+static int stripe_members = 0; //image files open
+static int stripe_width = BLOCK_STRIPE_WIDTH; //blocks per stripe unit
+
+typedef struct stripe_worker
+{
+    pthread_t thread;
+    block_req **reqs; //this member's share of the batch being run
+    int count;
+    unsigned long seen; //last batch this worker ran
+} stripe_worker;
+
+static pthread_mutex_t stripe_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stripe_cond = PTHREAD_COND_INITIALIZER;
+static stripe_worker stripe_workers[BLOCK_STRIPE_MAX];
+static unsigned long stripe_batch = 0; //bumped for every batch handed to the workers
+static int stripe_pending = 0; //workers still busy with the current batch
+static int stripe_stop = 0;
+static int stripe_threads = 0; //workers running (members 1..stripe_threads)
+
+/* Where block block_num lives: sets *member and returns the block within it. */
+static int stripe_map(int block_num, int *member)
+{
+    int unit = block_num / stripe_width;
+
+    *member = unit % stripe_members;
+    return (unit / stripe_members) * stripe_width + block_num % stripe_width;
+}
+
+static void pread_one(block_req *req)
+{
+    if(req->write)
+    {
+	req->result = pwritev(stripe_fds[req->member], req->iov, req->nr_iov, (off_t)req->block_num*BLOCK_SIZE);
+    }
+    else
+    {
+	req->result = preadv(stripe_fds[req->member], req->iov, req->nr_iov, (off_t)req->block_num*BLOCK_SIZE);
+    }
+    if(req->result < 0)
+    {
+	req->result = -errno;
+    }
+}
+
+static void *stripe_worker_main(void *arg)
+{
+    stripe_worker *w = arg;
+    int i;
+
+    pthread_mutex_lock(&stripe_lock);
+    for(;;)
+    {
+	while(!stripe_stop && stripe_batch == w->seen)
+	{
+	    pthread_cond_wait(&stripe_cond, &stripe_lock);
+	}
+	if(stripe_stop)
+	{
+	    break;
+	}
+	w->seen = stripe_batch;
+	pthread_mutex_unlock(&stripe_lock);
+
+	for(i = 0; i < w->count; i++)
+	{
+	    pread_one(w->reqs[i]);
+	}
+
+	pthread_mutex_lock(&stripe_lock);
+	if(--stripe_pending == 0)
+	{
+	    pthread_cond_broadcast(&stripe_cond);
+	}
+    }
+    pthread_mutex_unlock(&stripe_lock);
+
+    return NULL;
+}
+
+/* Run a batch with pread/pwrite, each member's requests on its own
+ * thread (member 0's on the calling one). */
+static void stripe_pread(block_req *reqs, int count)
+{
+    int i, m;
+    block_req **lists;
+
+    if(stripe_threads == 0)
+    {
+	for(i = 0; i < count; i++)
+	{
+	    pread_one(&reqs[i]);
+	}
+	return;
+    }
+
+    lists = malloc(stripe_members * count * sizeof(block_req*));
+    if(lists == NULL)
+    {
+	for(i = 0; i < count; i++)
+	{
+	    pread_one(&reqs[i]);
+	}
+	return;
+    }
+
+    for(m = 0; m < stripe_members; m++)
+    {
+	stripe_workers[m].reqs = lists + m * count;
+	stripe_workers[m].count = 0;
+    }
+    for(i = 0; i < count; i++)
+    {
+	stripe_worker *w = &stripe_workers[reqs[i].member];
+	w->reqs[w->count++] = &reqs[i];
+    }
+
+    pthread_mutex_lock(&stripe_lock);
+    stripe_pending = stripe_threads;
+    stripe_batch++;
+    pthread_cond_broadcast(&stripe_cond);
+    pthread_mutex_unlock(&stripe_lock);
+
+    for(i = 0; i < stripe_workers[0].count; i++)
+    {
+	pread_one(stripe_workers[0].reqs[i]);
+    }
+
+    pthread_mutex_lock(&stripe_lock);
+    while(stripe_pending > 0)
+    {
+	pthread_cond_wait(&stripe_cond, &stripe_lock);
+    }
+    pthread_mutex_unlock(&stripe_lock);
+
+    free(lists);
+}
+
+static void stripe_start_workers()
+{
+    int m;
+
+    stripe_stop = 0;
+    for(m = 1; m < stripe_members; m++)
+    {
+	stripe_workers[m].seen = stripe_batch;
+	if(pthread_create(&stripe_workers[m].thread, NULL, stripe_worker_main, &stripe_workers[m]) != 0)
+	{
+	    break;
+	}
+	stripe_threads++;
+    }
+
+    if(stripe_threads != stripe_members - 1)
+    {
+	//all or nothing: stripe_pread() expects a worker for every member
+	pthread_mutex_lock(&stripe_lock);
+	stripe_stop = 1;
+	pthread_cond_broadcast(&stripe_cond);
+	pthread_mutex_unlock(&stripe_lock);
+	for(m = 1; m <= stripe_threads; m++)
+	{
+	    pthread_join(stripe_workers[m].thread, NULL);
+	}
+	stripe_threads = 0;
+    }
+}
+
+static void stripe_stop_workers()
+{
+    int m;
+
+    pthread_mutex_lock(&stripe_lock);
+    stripe_stop = 1;
+    pthread_cond_broadcast(&stripe_cond);
+    pthread_mutex_unlock(&stripe_lock);
+    for(m = 1; m <= stripe_threads; m++)
+    {
+	pthread_join(stripe_workers[m].thread, NULL);
+    }
+    stripe_threads = 0;
+}
+
+/* Open every image file in a comma separated list. */
+static int stripe_open(const char *paths, int flags)
+{
+    char *copy = strdup(paths), *save = NULL, *path;
+
+    stripe_members = 0;
+    for(path = strtok_r(copy, ",", &save); path != NULL; path = strtok_r(NULL, ",", &save))
+    {
+	if(stripe_members == BLOCK_STRIPE_MAX)
+	{
+	    errno = E2BIG;
+	    break;
+	}
+	stripe_fds[stripe_members] = open(path, O_CREAT|O_RDWR|flags, S_IRUSR|S_IWUSR);
+	if(stripe_fds[stripe_members] < 0)
+	{
+	    break;
+	}
+	stripe_members++;
+    }
+
+    if(path != NULL || stripe_members == 0)
+    {
+	while(stripe_members > 0)
+	{
+	    close(stripe_fds[--stripe_members]);
+	}
+	free(copy);
+	return -1;
+    }
+
+    free(copy);
+    diskfile = stripe_fds[0];
+    return 0;
+}
+
+static void stripe_close()
+{
+    while(stripe_members > 0)
+    {
+	close(stripe_fds[--stripe_members]);
+    }
+    diskfile = -1;
+}
+
+typedef struct uring
+{
+    int fd;
+    unsigned entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len, sqes_len;
+} uring;
+
+static uring ring = { .fd = -1 };
+
+static void uring_close()
+{
+    if(ring.fd < 0)
+    {
+	return;
+    }
+
+    munmap(ring.sqes, ring.sqes_len);
+    if(ring.cq_ptr != ring.sq_ptr)
+    {
+	munmap(ring.cq_ptr, ring.cq_len);
+    }
+    munmap(ring.sq_ptr, ring.sq_len);
+    close(ring.fd);
+    ring.fd = -1;
+}
+
+static int uring_open(unsigned depth)
+{
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    ring.fd = syscall(__NR_io_uring_setup, depth, &p);
+    if(ring.fd < 0)
+    {
+	return -1;
+    }
+
+    ring.entries = p.sq_entries;
+    ring.sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring.cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+	if(ring.cq_len > ring.sq_len)
+	{
+	    ring.sq_len = ring.cq_len;
+	}
+	ring.cq_len = ring.sq_len;
+    }
+
+    ring.sq_ptr = mmap(NULL, ring.sq_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    if(ring.sq_ptr == MAP_FAILED)
+    {
+	close(ring.fd);
+	ring.fd = -1;
+	return -1;
+    }
+
+    if(p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+	ring.cq_ptr = ring.sq_ptr;
+    }
+    else
+    {
+	ring.cq_ptr = mmap(NULL, ring.cq_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+	if(ring.cq_ptr == MAP_FAILED)
+	{
+	    munmap(ring.sq_ptr, ring.sq_len);
+	    close(ring.fd);
+	    ring.fd = -1;
+	    return -1;
+	}
+    }
+
+    ring.sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring.sqes = mmap(NULL, ring.sqes_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if(ring.sqes == MAP_FAILED)
+    {
+	ring.sqes_len = 0;
+	ring.sqes = NULL;
+	if(ring.cq_ptr != ring.sq_ptr)
+	{
+	    munmap(ring.cq_ptr, ring.cq_len);
+	}
+	munmap(ring.sq_ptr, ring.sq_len);
+	close(ring.fd);
+	ring.fd = -1;
+	return -1;
+    }
+
+    ring.sq_head = (unsigned*)((char*)ring.sq_ptr + p.sq_off.head);
+    ring.sq_tail = (unsigned*)((char*)ring.sq_ptr + p.sq_off.tail);
+    ring.sq_mask = (unsigned*)((char*)ring.sq_ptr + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned*)((char*)ring.sq_ptr + p.sq_off.array);
+    ring.cq_head = (unsigned*)((char*)ring.cq_ptr + p.cq_off.head);
+    ring.cq_tail = (unsigned*)((char*)ring.cq_ptr + p.cq_off.tail);
+    ring.cq_mask = (unsigned*)((char*)ring.cq_ptr + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe*)((char*)ring.cq_ptr + p.cq_off.cqes);
+
+    return 0;
+}
+
+//io_uring_enter() handing over submit entries and waiting for a completion
+static int uring_enter(unsigned submit)
+{
+    int ret;
+
+    do
+    {
+	ret = syscall(__NR_io_uring_enter, ring.fd, submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+    } while(ret < 0 && errno == EINTR);
+    return ret;
+}
+
+//take every completion off the ring into reqs; returns how many there were
+static unsigned uring_reap(block_req *reqs)
+{
+    unsigned head = *ring.cq_head, n = 0;
+    struct io_uring_cqe *cqe;
+
+    while(head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE))
+    {
+	cqe = &ring.cqes[head & *ring.cq_mask];
+	reqs[cqe->user_data].result = cqe->res;
+	head++;
+	n++;
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    return n;
+}
+
+static int uring_submit(block_req *reqs, int count)
+{
+    int i, next = 0, ret = 0;
+    unsigned tail, idx;
+    unsigned queued = 0; //in the submission ring, not yet taken by the kernel
+    unsigned inflight = 0; //taken, not yet completed
+    struct io_uring_sqe *sqe;
+
+    for(i = 0; i < count; i++)
+    {
+	reqs[i].result = -EIO; //anything never reaped counts as failed
+    }
+
+    while(next < count || queued + inflight > 0)
+    {
+	//fill the submission ring with as much of the batch as fits
+	tail = *ring.sq_tail;
+	while(next < count && queued + inflight < ring.entries)
+	{
+	    idx = tail & *ring.sq_mask;
+	    sqe = &ring.sqes[idx];
+	    memset(sqe, 0, sizeof(*sqe));
+	    sqe->opcode = reqs[next].write ? IORING_OP_WRITEV : IORING_OP_READV;
+	    sqe->fd = stripe_fds[reqs[next].member];
+	    sqe->addr = (unsigned long)reqs[next].iov;
+	    sqe->len = reqs[next].nr_iov;
+	    sqe->off = (off_t)reqs[next].block_num * BLOCK_SIZE;
+	    sqe->user_data = next;
+	    ring.sq_array[idx] = idx;
+	    tail++;
+	    next++;
+	    queued++;
+	}
+	__atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+
+	//the kernel may take only some of them; the rest go again next time round
+	ret = uring_enter(queued);
+	if(ret < 0 && inflight > 0 && (errno == EAGAIN || errno == EBUSY))
+	{
+	    ret = uring_enter(0); //no room for more just now: wait for some to finish
+	}
+	if(ret < 0)
+	{
+	    break;
+	}
+	queued -= ret;
+	inflight += ret;
+
+	//reap whatever has completed, in any order
+	inflight -= uring_reap(reqs);
+    }
+
+    if(ret < 0)
+    {
+	perror("io_uring_enter failed");
+
+	//the caller's buffers go away once this returns: take back what the
+	//kernel never saw and wait out the rest
+	__atomic_store_n(ring.sq_tail, *ring.sq_tail - queued, __ATOMIC_RELEASE);
+	while(inflight > 0)
+	{
+	    inflight -= uring_reap(reqs);
+	    if(inflight > 0 && uring_enter(0) < 0)
+	    {
+		//can't tell when they finish, so don't use the ring again
+		perror("io_uring_enter failed, falling back to pread");
+		uring_close();
+		break;
+	    }
+	}
+	return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * mmap backend
+ *
+ * The image is mapped MAP_SHARED into a fixed reservation of address
+ * space, so the mapping can grow in place as blocks past the end are
+ * written and pointers handed out by block_map() never move.  The file is
+ * extended in BLOCK_MMAP_CHUNK steps to keep the mapping backed; disk_end
+ * remembers where the image really ends so never-touched blocks still
+ * read back as 0 like they do with pread, and the padding is cut off
+ * again in disk_close().  Data reaches the file through msync() at
+ * block_sync() (fsync) and unmount.
+ */
+static char *map_base = NULL;
+static off_t map_len = 0; //bytes of the file currently mapped
+static off_t disk_end = 0;
+
+static int map_grow(off_t need)
+{
+    off_t newlen;
+    struct stat st;
+
+    if(need <= map_len)
+    {
+	return 0;
+    }
+
+    newlen = ((need + BLOCK_MMAP_CHUNK - 1) / BLOCK_MMAP_CHUNK) * BLOCK_MMAP_CHUNK;
+    if(newlen > (off_t)BLOCK_MMAP_RESERVE)
+    {
+	errno = EFBIG;
+	return -1;
+    }
+
+    if(fstat(diskfile, &st) < 0)
+    {
+	return -1;
+    }
+    if(st.st_size < newlen && ftruncate(diskfile, newlen) < 0)
+    {
+	return -1;
+    }
+
+    if(mmap(map_base + map_len, newlen - map_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED, diskfile, map_len) == MAP_FAILED)
+    {
+	return -1;
+    }
+
+    map_len = newlen;
+    return 0;
+}
+
+static int map_open()
+{
+    struct stat st;
+
+    if(fstat(diskfile, &st) < 0)
+    {
+	return -1;
+    }
+
+    map_base = mmap(NULL, BLOCK_MMAP_RESERVE, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    if(map_base == MAP_FAILED)
+    {
+	map_base = NULL;
+	return -1;
+    }
+
+    map_len = 0;
+    disk_end = st.st_size;
+    if(map_grow(disk_end > 0 ? disk_end : BLOCK_MMAP_CHUNK) < 0)
+    {
+	munmap(map_base, BLOCK_MMAP_RESERVE);
+	map_base = NULL;
+	return -1;
+    }
+
+    return 0;
+}
+
+static void map_close()
+{
+    if(map_base == NULL)
+    {
+	return;
+    }
+
+    msync(map_base, map_len, MS_SYNC);
+    munmap(map_base, BLOCK_MMAP_RESERVE);
+    map_base = NULL;
+    map_len = 0;
+
+    //drop the chunk padding so the image is exactly as long as what was written
+    if(ftruncate(diskfile, disk_end) < 0)
+    {
+	perror("disk_close truncate failed");
+    }
+}
+
+static int map_submit(block_req *req)
+{
+    int j, n;
+    off_t off = (off_t)req->block_num * BLOCK_SIZE;
+
+    if(req->write)
+    {
+	if(map_grow(off + (off_t)req->count * BLOCK_SIZE) < 0)
+	{
+	    return -errno;
+	}
+	for(j = 0; j < req->count; j++)
+	{
+	    memcpy(map_base + off + (off_t)j * BLOCK_SIZE, req->iov[j].iov_base, BLOCK_SIZE);
+	}
+	if(off + (off_t)req->count * BLOCK_SIZE > disk_end)
+	{
+	    disk_end = off + (off_t)req->count * BLOCK_SIZE;
+	}
+	return req->count * BLOCK_SIZE;
+    }
+
+    //reads stop at the end of the image, exactly like preadv would
+    if(off >= disk_end)
+    {
+	return 0;
+    }
+    n = req->count;
+    if(off + (off_t)n * BLOCK_SIZE > disk_end)
+    {
+	n = (disk_end - off + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    }
+    for(j = 0; j < n; j++)
+    {
+	memcpy(req->iov[j].iov_base, map_base + off + (off_t)j * BLOCK_SIZE, BLOCK_SIZE);
+    }
+    return (disk_end - off) < (off_t)n * BLOCK_SIZE ? (int)(disk_end - off) : n * BLOCK_SIZE;
+}
+
+/* Hand a batch straight to the backend.  Results are raw byte counts, or
+ * -errno on failure. */
+static int backend_submit(block_req *reqs, int count)
+{
+    int i;
+
+    if(io_backend == BLOCK_IO_URING && ring.fd >= 0)
+    {
+	return uring_submit(reqs, count);
+    }
+
+    if(io_backend == BLOCK_IO_MMAP)
+    {
+	for(i = 0; i < count; i++)
+	{
+	    reqs[i].result = map_submit(&reqs[i]);
+	}
+	return 0;
+    }
+
+    stripe_pread(reqs, count);
+    return 0;
+}
+
+/*
+ * O_DIRECT
+ *
+ * With --direct the image is opened O_DIRECT so the host page cache stays
+ * out of the way and our own block cache is the only copy in memory.
+ * The kernel then wants every transfer aligned to DIRECT_ALIGN in offset,
+ * length and buffer address, which 512 byte blocks aren't.  So each batch
+ * is widened: requests whose aligned ranges touch are coalesced into one
+ * aligned transfer through a buffer from a small pool of aligned bounce
+ * buffers.  Writes that don't cover their aligned range completely read
+ * the range first (read-modify-write); those reads all go down as one
+ * batch, and so do the writes that follow.
+ */
+static int direct_io = 0;
+static char *pool_bufs[DIRECT_POOL_BUFS];
+static int pool_free[DIRECT_POOL_BUFS];
+
+static int pool_setup()
+{
+    int i;
+
+    for(i = 0; i < DIRECT_POOL_BUFS; i++)
+    {
+	if(posix_memalign((void**)&pool_bufs[i], DIRECT_ALIGN, DIRECT_MAX) != 0)
+	{
+	    pool_bufs[i] = NULL;
+	    return -1;
+	}
+	pool_free[i] = 1;
+    }
+
+    return 0;
+}
+
+static void pool_release()
+{
+    int i;
+
+    for(i = 0; i < DIRECT_POOL_BUFS; i++)
+    {
+	free(pool_bufs[i]);
+	pool_bufs[i] = NULL;
+    }
+}
+
+static char *pool_get()
+{
+    int i;
+
+    for(i = 0; i < DIRECT_POOL_BUFS; i++)
+    {
+	if(pool_free[i])
+	{
+	    pool_free[i] = 0;
+	    return pool_bufs[i];
+	}
+    }
+
+    return NULL;
+}
+
+static void pool_put(char *buf)
+{
+    int i;
+
+    for(i = 0; i < DIRECT_POOL_BUFS; i++)
+    {
+	if(pool_bufs[i] == buf)
+	{
+	    pool_free[i] = 1;
+	}
+    }
+}
+
+#define ALIGN_DOWN(x) ((x) / DIRECT_ALIGN * DIRECT_ALIGN)
+#define ALIGN_UP(x) (((x) + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN)
+
+typedef struct direct_group
+{
+    off_t start; //aligned byte range covered by the group
+    off_t end;
+    int first; //requests first..last (inclusive) of the batch
+    int last;
+    int partial; //some part of the range isn't covered by a write
+    int member;
+    char *buf;
+    struct iovec iov;
+} direct_group;
+
+//does the aligned range around [start, end) share anything with the first n groups
+static int group_overlap(direct_group *grp, int n, int member, off_t start, off_t end)
+{
+    int k;
+
+    for(k = 0; k < n; k++)
+    {
+	if(grp[k].member == member && ALIGN_DOWN(start) < grp[k].end && ALIGN_UP(end) > grp[k].start)
+	{
+	    return 1;
+	}
+    }
+
+    return 0;
+}
+
+static int direct_submit(block_req *reqs, int count)
+{
+    int i, j, k, r, groups, ngroups, retstat = 0;
+    off_t rs, re, covered;
+    direct_group grp[DIRECT_POOL_BUFS];
+    block_req io[DIRECT_POOL_BUFS];
+
+    for(i = 0; i < count; )
+    {
+	//coalesce as many requests as fit in the pool, one aligned transfer per group
+	ngroups = 0;
+	while(i < count && ngroups < DIRECT_POOL_BUFS)
+	{
+	    direct_group *g = &grp[ngroups];
+	    rs = (off_t)reqs[i].block_num * BLOCK_SIZE;
+
+	    //two writes landing in the same aligned range would each read-modify-write
+	    //it from the same stale copy, so that has to wait for the next round
+	    if(reqs[i].write && group_overlap(grp, ngroups, reqs[i].member, rs, rs + (off_t)reqs[i].count * BLOCK_SIZE))
+	    {
+		break;
+	    }
+	    g->start = ALIGN_DOWN(rs);
+	    g->member = reqs[i].member;
+	    g->first = g->last = i;
+	    g->partial = (g->start != rs);
+	    covered = rs + (off_t)reqs[i].count * BLOCK_SIZE;
+	    g->end = ALIGN_UP(covered);
+	    i++;
+
+	    while(i < count && reqs[i].write == reqs[g->first].write && reqs[i].member == reqs[g->first].member)
+	    {
+		rs = (off_t)reqs[i].block_num * BLOCK_SIZE;
+		re = rs + (off_t)reqs[i].count * BLOCK_SIZE;
+		if(rs < covered || ALIGN_DOWN(rs) > g->end || ALIGN_UP(re) - g->start > DIRECT_MAX)
+		{
+		    break;
+		}
+		if(reqs[i].write && group_overlap(grp, ngroups, reqs[i].member, rs, re))
+		{
+		    break;
+		}
+		if(rs != covered)
+		{
+		    g->partial = 1; //hole between this run and the last one
+		}
+		covered = re;
+		g->end = ALIGN_UP(re);
+		g->last = i;
+		i++;
+	    }
+
+	    if(covered != g->end)
+	    {
+		g->partial = 1;
+	    }
+
+	    g->buf = pool_get();
+	    g->iov.iov_base = g->buf;
+	    g->iov.iov_len = g->end - g->start;
+	    ngroups++;
+	}
+
+	//reads, and the read half of partial writes
+	groups = 0;
+	for(k = 0; k < ngroups; k++)
+	{
+	    if(reqs[grp[k].first].write && !grp[k].partial)
+	    {
+		continue;
+	    }
+	    memset(grp[k].buf, 0, grp[k].end - grp[k].start);
+	    io[groups].block_num = grp[k].start / BLOCK_SIZE;
+	    io[groups].count = (grp[k].end - grp[k].start) / BLOCK_SIZE;
+	    io[groups].iov = &grp[k].iov;
+	    io[groups].nr_iov = 1;
+	    io[groups].member = grp[k].member;
+	    io[groups].write = 0;
+	    io[groups].result = 0;
+	    groups++;
+	}
+	if(groups > 0)
+	{
+	    backend_submit(io, groups);
+	}
+
+	for(k = 0, r = 0; k < ngroups; k++)
+	{
+	    int got = grp[k].end - grp[k].start;
+
+	    if(!reqs[grp[k].first].write || grp[k].partial)
+	    {
+		got = io[r++].result;
+	    }
+
+	    for(j = grp[k].first; j <= grp[k].last; j++)
+	    {
+		off_t at = (off_t)reqs[j].block_num * BLOCK_SIZE - grp[k].start;
+		int b;
+
+		if(reqs[j].write)
+		{
+		    reqs[j].result = got < 0 ? got : 0;
+		    for(b = 0; b < reqs[j].count; b++)
+		    {
+			memcpy(grp[k].buf + at + (off_t)b * BLOCK_SIZE, reqs[j].iov[b].iov_base, BLOCK_SIZE);
+		    }
+		    continue;
+		}
+
+		//what a plain preadv of just this run would have returned
+		if(got < 0)
+		{
+		    reqs[j].result = got;
+		}
+		else if(got <= at)
+		{
+		    reqs[j].result = 0;
+		}
+		else
+		{
+		    reqs[j].result = got - at < (off_t)reqs[j].count * BLOCK_SIZE ? got - at : reqs[j].count * BLOCK_SIZE;
+		}
+		for(b = 0; b < reqs[j].count; b++)
+		{
+		    memcpy(reqs[j].iov[b].iov_base, grp[k].buf + at + (off_t)b * BLOCK_SIZE, BLOCK_SIZE);
+		}
+	    }
+	}
+
+	//writes go back out as whole aligned ranges
+	groups = 0;
+	for(k = 0; k < ngroups; k++)
+	{
+	    if(!reqs[grp[k].first].write || reqs[grp[k].first].result < 0)
+	    {
+		continue;
+	    }
+	    io[groups].block_num = grp[k].start / BLOCK_SIZE;
+	    io[groups].count = (grp[k].end - grp[k].start) / BLOCK_SIZE;
+	    io[groups].iov = &grp[k].iov;
+	    io[groups].nr_iov = 1;
+	    io[groups].member = grp[k].member;
+	    io[groups].write = 1;
+	    io[groups].result = 0;
+	    groups++;
+	}
+	if(groups > 0)
+	{
+	    backend_submit(io, groups);
+	}
+
+	for(k = 0, r = 0; k < ngroups; k++)
+	{
+	    if(reqs[grp[k].first].write && reqs[grp[k].first].result >= 0)
+	    {
+		int wrote = io[r++].result;
+		for(j = grp[k].first; j <= grp[k].last; j++)
+		{
+		    reqs[j].result = wrote < 0 ? wrote : reqs[j].count * BLOCK_SIZE;
+		}
+	    }
+	    pool_put(grp[k].buf);
+	}
+    }
+
+    for(i = 0; i < count; i++)
+    {
+	if(reqs[i].result < 0)
+	{
+	    retstat = -1;
+	}
+    }
+
+    return retstat;
+}
+
+/*
+ * Block checksums
+ *
+ * When the filesystem has a checksum area (block_csum_init), every block
+ * outside it has a CRC32C there, kept in memory as a table of
+ * little-endian words so the area can be written straight from it.
+ * Checksums are filled in as blocks go to the disk and checked as they
+ * come off it, inside disk_submit(), so a cache hit costs nothing extra.
+ * Changed parts of the table go back to the disk with block_flush().
+ * All of this happens under io_lock.
+ */
+static uint32_t *csum_table = NULL;
+static int csum_start = 0; //first block of the checksum area
+static int csum_blocks = 0;
+static int csum_count = 0; //blocks covered
+static unsigned char *csum_dirty = NULL; //one flag per checksum area block
+
+static int csum_covers(int block_num)
+{
+    return csum_table != NULL && block_num < csum_count &&
+	   (block_num < csum_start || block_num >= csum_start + csum_blocks);
+}
+
+static void csum_store(int block_num, const void *data)
+{
+    csum_table[block_num] = htole32(crc32c(0, data, BLOCK_SIZE));
+    csum_dirty[block_num * sizeof(uint32_t) / BLOCK_SIZE] = 1;
+}
+
+/* Check every block of a finished read; a block that fails is zeroed and
+ * fails the whole request. */
+static void csum_verify(block_req *req)
+{
+    int j;
+
+    for(j = 0; j < req->count; j++)
+    {
+	const char *data = req->iov[j].iov_base;
+	int block_num = req->block_num + j;
+
+	if(csum_covers(block_num) && le32toh(csum_table[block_num]) != crc32c(0, data, BLOCK_SIZE))
+	{
+	    log_msg("Checksum mismatch in block %d\n", block_num);
+	    memset(req->iov[j].iov_base, 0, BLOCK_SIZE);
+	    req->result = -EIO;
+	}
+    }
+}
+
+/* Hand a batch to O_DIRECT or the backend as it is. */
+static int member_submit(block_req *reqs, int count)
+{
+    if(direct_io)
+    {
+	return direct_submit(reqs, count);
+    }
+    return backend_submit(reqs, count);
+}
+
+/* Split each run at stripe unit boundaries, submit the pieces to their
+ * members in one batch and work out what each run as a whole got.  The
+ * members are read like one sparse file: a short piece in the middle is a
+ * hole and reads as zeros, and the run ends after its last piece with
+ * any data in it. */
+static int stripe_submit(block_req *reqs, int count)
+{
+    int i, j, n, pieces = 0, retstat = 0;
+    block_req *sub;
+    int *owner;
+
+    for(i = 0; i < count; i++)
+    {
+	pieces += (reqs[i].block_num + reqs[i].count - 1) / stripe_width - reqs[i].block_num / stripe_width + 1;
+    }
+
+    sub = malloc(pieces * sizeof(block_req));
+    owner = malloc(pieces * sizeof(int));
+    if(sub == NULL || owner == NULL)
+    {
+	free(sub);
+	free(owner);
+	return -1;
+    }
+
+    for(i = 0, pieces = 0; i < count; i++)
+    {
+	for(j = 0; j < reqs[i].count; j += n)
+	{
+	    int b = reqs[i].block_num + j;
+
+	    n = stripe_width - b % stripe_width;
+	    if(n > reqs[i].count - j)
+	    {
+		n = reqs[i].count - j;
+	    }
+	    sub[pieces].block_num = stripe_map(b, &sub[pieces].member);
+	    sub[pieces].count = n;
+	    sub[pieces].iov = reqs[i].iov + j;
+	    sub[pieces].nr_iov = n;
+	    sub[pieces].write = reqs[i].write;
+	    sub[pieces].result = 0;
+	    owner[pieces] = i;
+	    pieces++;
+	}
+    }
+
+    if(member_submit(sub, pieces) < 0)
+    {
+	retstat = -1;
+    }
+
+    for(i = 0; i < count; i++)
+    {
+	reqs[i].result = 0;
+    }
+    for(i = 0, j = 0; i < pieces; i++)
+    {
+	block_req *r = &reqs[owner[i]];
+	int len = sub[i].count * BLOCK_SIZE;
+	int at;
+
+	if(i == 0 || owner[i] != owner[i-1])
+	{
+	    j = 0;
+	}
+	at = j; //byte offset of this piece in its run
+	j += len;
+
+	if(r->result < 0)
+	{
+	    continue;
+	}
+	if(sub[i].result < 0)
+	{
+	    r->result = sub[i].result;
+	    continue;
+	}
+	if(r->write)
+	{
+	    r->result += sub[i].result;
+	    continue;
+	}
+	if(sub[i].result > 0)
+	{
+	    r->result = at + sub[i].result;
+	}
+	if(sub[i].result < len)
+	{
+	    //a hole if a later piece has data; harmless otherwise
+	    int k, left = sub[i].result;
+	    for(k = 0; k < sub[i].count; k++, left -= BLOCK_SIZE)
+	    {
+		if(left < BLOCK_SIZE)
+		{
+		    memset((char*)sub[i].iov[k].iov_base + (left > 0 ? left : 0), 0, BLOCK_SIZE - (left > 0 ? left : 0));
+		}
+	    }
+	}
+    }
+
+    free(sub);
+    free(owner);
+    return retstat;
+}
+
+/* Run a batch of requests against the disk file.  Each request's result
+ * ends up with the same meaning pread/pwrite would have given it; the
+ * return value is negative if any of them failed. */
+static int disk_submit_locked(block_req *reqs, int count)
+{
+    int i, j, got, retstat = 0;
+
+    for(i = 0; i < count; i++)
+    {
+	for(j = 0; reqs[i].write && j < reqs[i].count; j++)
+	{
+	    if(csum_covers(reqs[i].block_num + j))
+	    {
+		csum_store(reqs[i].block_num + j, reqs[i].iov[j].iov_base);
+	    }
+	}
+    }
+
+    //anything the backend never gets to counts as failed; what it did do is
+    //still checked below like a batch that went through
+    for(i = 0; i < count; i++)
+    {
+	reqs[i].result = -EIO;
+    }
+
+    if(stripe_members > 1)
+    {
+	retstat = stripe_submit(reqs, count);
+    }
+    else if(direct_io)
+    {
+	retstat = direct_submit(reqs, count);
+    }
+    else
+    {
+	retstat = backend_submit(reqs, count);
+    }
+    retstat = retstat < 0 ? -1 : 0;
+
+    for(i = 0; i < count; i++)
+    {
+	if(reqs[i].result < 0)
+	{
+	    errno = -reqs[i].result;
+	    perror(reqs[i].write ? "block_write failed" : "block_read failed");
+	    reqs[i].result = -1;
+	    retstat = -1;
+	}
+
+	if(!reqs[i].write)
+	{
+	    //zero whatever the read didn't reach (never-touched blocks past EOF)
+	    got = reqs[i].result < 0 ? 0 : reqs[i].result;
+	    for(j = 0; j < reqs[i].count; j++, got -= BLOCK_SIZE)
+	    {
+		if(got < BLOCK_SIZE)
+		{
+		    memset((char*)reqs[i].iov[j].iov_base + (got > 0 ? got : 0), 0, BLOCK_SIZE - (got > 0 ? got : 0));
+		}
+	    }
+
+	    //never-touched blocks are checked too; the area starts out with the CRC of a zero block
+	    if(reqs[i].result >= 0 && csum_table != NULL)
+	    {
+		csum_verify(&reqs[i]);
+		if(reqs[i].result < 0)
+		{
+		    reqs[i].result = -1;
+		    retstat = -1;
+		}
+	    }
+	}
+    }
+
+    return retstat;
+}
+
+/* disk_submit_locked() for callers that don't hold io_lock */
+static int disk_submit(block_req *reqs, int count)
+{
+    int retstat;
+
+    pthread_mutex_lock(&io_lock);
+    retstat = disk_submit_locked(reqs, count);
+    pthread_mutex_unlock(&io_lock);
+    return retstat;
+}
+
+/* Bytes of block idx (0-based within the run) that a request actually
+ * transferred, in the same sense as a single-block pread return value. */
+static int req_block_len(const block_req *req, int idx)
+{
+    int got;
+
+    if(req->result < 0)
+    {
+	return -1;
+    }
+
+    got = req->result - idx * BLOCK_SIZE;
+    if(got < 0)
+    {
+	return 0;
+    }
+    return got > BLOCK_SIZE ? BLOCK_SIZE : got;
+}
+
+/* Turn a list of blocks into runs of contiguous block numbers, ready to
+ * hand to disk_submit().  reqs and iov must have room for count entries. */
+static int build_runs(const int *block_nums, char **bufs, int count, int write, block_req *reqs, struct iovec *iov)
+{
+    int i, runs = 0;
+
+    for(i = 0; i < count; i++)
+    {
+	iov[i].iov_base = bufs[i];
+	iov[i].iov_len = BLOCK_SIZE;
+
+	if(runs > 0 && reqs[runs-1].block_num + reqs[runs-1].count == block_nums[i] && reqs[runs-1].count < BLOCK_RUN_MAX)
+	{
+	    reqs[runs-1].count++;
+	    reqs[runs-1].nr_iov++;
+	    continue;
+	}
+
+	reqs[runs].block_num = block_nums[i];
+	reqs[runs].count = 1;
+	reqs[runs].iov = &iov[i];
+	reqs[runs].nr_iov = 1;
+	reqs[runs].write = write;
+	reqs[runs].result = 0;
+	reqs[runs].member = 0;
+	runs++;
+    }
+
+    return runs;
+}
+
+/* Write the changed blocks of the checksum area back to the disk. */
+static int csum_flush()
+{
+    int i, n = 0, runs, retstat = 0;
+    int *nums;
+    char **bufs;
+    block_req *reqs;
+    struct iovec *iov;
+
+    if(csum_table == NULL)
+    {
+	return 0;
+    }
+
+    nums = malloc(csum_blocks * sizeof(int));
+    bufs = malloc(csum_blocks * sizeof(char*));
+    reqs = malloc(csum_blocks * sizeof(block_req));
+    iov = malloc(csum_blocks * sizeof(struct iovec));
+    if(nums == NULL || bufs == NULL || reqs == NULL || iov == NULL)
+    {
+	free(nums);
+	free(bufs);
+	free(reqs);
+	free(iov);
+	return -1;
+    }
+
+    pthread_mutex_lock(&io_lock);
+    for(i = 0; i < csum_blocks; i++)
+    {
+	if(csum_dirty[i])
+	{
+	    csum_dirty[i] = 0;
+	    nums[n] = csum_start + i;
+	    bufs[n] = (char*)csum_table + (size_t)i * BLOCK_SIZE;
+	    n++;
+	}
+    }
+    pthread_mutex_unlock(&io_lock);
+
+    runs = build_runs(nums, bufs, n, 1, reqs, iov);
+    if(runs > 0 && disk_submit(reqs, runs) < 0)
+    {
+	//put the flags back so the next flush tries again
+	for(i = 0; i < n; i++)
+	{
+	    csum_dirty[nums[i] - csum_start] = 1;
+	}
+	retstat = -1;
+    }
+
+    free(nums);
+    free(bufs);
+    free(reqs);
+    free(iov);
+    return retstat;
+}
+
+static void csum_free()
+{
+    free(csum_table);
+    free(csum_dirty);
+    csum_table = NULL;
+    csum_dirty = NULL;
+    csum_start = csum_blocks = csum_count = 0;
+}
+
+static int disk_read(const int block_num, void *buf)
+{
+    struct iovec iov = { buf, BLOCK_SIZE };
+    block_req req = { .block_num = block_num, .count = 1, .iov = &iov, .nr_iov = 1, .write = 0 };
+
+    disk_submit(&req, 1);
+    return req.result;
+}
+
+static int disk_write(const int block_num, const void *buf)
+{
+    struct iovec iov = { (void*)buf, BLOCK_SIZE };
+    block_req req = { .block_num = block_num, .count = 1, .iov = &iov, .nr_iov = 1, .write = 1 };
+
+    disk_submit(&req, 1);
+    return req.result;
+}
+
+static void lru_unlink(cache_entry *e)
+{
+    e->lru_prev->lru_next = e->lru_next;
+    e->lru_next->lru_prev = e->lru_prev;
+}
+
+static void lru_push(cache_entry *e)
+{
+    e->lru_prev = &lru;
+    e->lru_next = lru.lru_next;
+    lru.lru_next->lru_prev = e;
+    lru.lru_next = e;
+}
+
+static cache_entry *cache_lookup(const int block_num)
+{
+    cache_entry *e = cache_hash[block_num % hash_size];
+
+    while(e != NULL && e->block_num != block_num)
+    {
+	e = e->hash_next;
+    }
+
+    return e;
+}
+
+static void hash_remove(cache_entry *e)
+{
+    cache_entry **slot = &cache_hash[e->block_num % hash_size];
+
+    while(*slot != e)
+    {
+	slot = &(*slot)->hash_next;
+    }
+    *slot = e->hash_next;
+}
+
+/* Hand back an entry for block_num that is not yet in the cache, evicting
+ * the least recently used block if the pool is full.  Returns NULL if a
+ * dirty victim could not be written back. */
+static cache_entry *cache_claim(const int block_num)
+{
+    cache_entry *e;
+
+    if(cache_used < cache_size)
+    {
+	e = &cache_pool[cache_used++];
+    }
+    else
+    {
+	e = lru.lru_prev;
+	if(e->dirty && disk_write(e->block_num, e->data) < 0)
+	{
+	    return NULL;
+	}
+	if(e->dirty)
+	{
+	    cache_dirty--;
+	}
+	hash_remove(e);
+	lru_unlink(e);
+    }
+
+    e->block_num = block_num;
+    e->dirty = 0;
+    e->len = 0;
+    e->hash_next = cache_hash[block_num % hash_size];
+    cache_hash[block_num % hash_size] = e;
+    lru_push(e);
+
+    return e;
+}
+
+static void cache_free()
+{
+    int i;
+
+    if(cache_pool != NULL)
+    {
+	for(i = 0; i < cache_used; i++)
+	{
+	    free(cache_pool[i].data);
+	}
+    }
+    free(cache_pool);
+    free(cache_hash);
+    cache_pool = NULL;
+    cache_hash = NULL;
+    cache_used = 0;
+    cache_dirty = 0;
+}
+
+/** Set the number of blocks the cache may hold
+ *
+ * Must be called before disk_open().  0 disables caching.
+ */
+void block_cache_init(int nblocks)
+{
+    if(nblocks < 0)
+    {
+	nblocks = 0;
+    }
+    cache_size = nblocks;
+}
+
+static int cache_setup()
+{
+    int i;
+
+    lru.lru_next = &lru;
+    lru.lru_prev = &lru;
+
+    if(cache_size == 0)
+    {
+	return 0;
+    }
+
+    hash_size = cache_size * 2 + 1;
+    cache_pool = calloc(cache_size, sizeof(cache_entry));
+    cache_hash = calloc(hash_size, sizeof(cache_entry*));
+    if(cache_pool == NULL || cache_hash == NULL)
+    {
+	cache_free();
+	return -1;
+    }
+
+    for(i = 0; i < cache_size; i++)
+    {
+	cache_pool[i].data = malloc(BLOCK_SIZE);
+	if(cache_pool[i].data == NULL)
+	{
+	    cache_used = i;
+	    cache_free();
+	    return -1;
+	}
+    }
+
+    return 0;
+}
+
+/*
+ * Readahead
+ *
+ * block_readahead() queues a list of blocks that are likely to be read
+ * soon and returns straight away.  A single worker thread reads the ones
+ * that are not cached yet (in runs, through the normal backend) and drops
+ * them into the cache, so the reader finds them there.  If anything was
+ * written while a prefetch was in flight its blocks are thrown away
+ * rather than risk caching stale data.
+ *
+ * Without a cache there is nowhere to keep prefetched blocks, so the
+ * kernel is asked to do the readahead instead (madvise for the mmap
+ * backend, posix_fadvise otherwise).
+ */
+typedef struct ra_req
+{
+    int *blocks;
+    int count;
+} ra_req;
+
+static pthread_mutex_t ra_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ra_cond = PTHREAD_COND_INITIALIZER; //work queued, or the worker went idle
+static ra_req ra_queue[BLOCK_RA_QUEUE];
+static int ra_head = 0, ra_tail = 0; //ra_queue[ra_head..ra_tail) is pending
+static int ra_busy = 0;
+static int ra_stop = 0;
+static int ra_started = 0;
+static pthread_t ra_thread;
+
+static void ra_fetch(const int *blocks, int count)
+{
+    int i, j, b, runs, misses = 0;
+    unsigned long gen;
+    int *miss_nums = malloc(count * sizeof(int));
+    char **miss_bufs = malloc(count * sizeof(char*));
+    block_req *reqs = malloc(count * sizeof(block_req));
+    struct iovec *iov = malloc(count * sizeof(struct iovec));
+    char *data = NULL;
+    cache_entry *e;
+
+    if(miss_nums == NULL || miss_bufs == NULL || reqs == NULL || iov == NULL)
+    {
+	goto out;
+    }
+
+    pthread_mutex_lock(&block_lock);
+    for(i = 0; i < count; i++)
+    {
+	if(cache_pool != NULL && cache_lookup(blocks[i]) == NULL)
+	{
+	    miss_nums[misses++] = blocks[i];
+	}
+    }
+    gen = cache_gen;
+    pthread_mutex_unlock(&block_lock);
+
+    if(misses == 0 || (data = malloc((size_t)misses * BLOCK_SIZE)) == NULL)
+    {
+	goto out;
+    }
+    for(i = 0; i < misses; i++)
+    {
+	miss_bufs[i] = data + (size_t)i * BLOCK_SIZE;
+    }
+
+    log_msg("Readahead: %d of %d blocks not cached\n", misses, count);
+
+    //the disk is read without block_lock, so readers are not held up
+    runs = build_runs(miss_nums, miss_bufs, misses, 0, reqs, iov);
+    disk_submit(reqs, runs);
+
+    pthread_mutex_lock(&block_lock);
+    for(i = 0, b = 0; i < runs && gen == cache_gen && cache_pool != NULL; i++)
+    {
+	for(j = 0; j < reqs[i].count; j++, b++)
+	{
+	    int len = req_block_len(&reqs[i], j);
+	    if(len >= 0 && cache_lookup(miss_nums[b]) == NULL && (e = cache_claim(miss_nums[b])) != NULL)
+	    {
+		memcpy(e->data, miss_bufs[b], BLOCK_SIZE);
+		e->len = len;
+	    }
+	}
+    }
+    pthread_mutex_unlock(&block_lock);
+
+out:
+    free(data);
+    free(miss_nums);
+    free(miss_bufs);
+    free(reqs);
+    free(iov);
+}
+
+static void *ra_worker(void *arg)
+{
+    ra_req req;
+
+    pthread_mutex_lock(&ra_lock);
+    for(;;)
+    {
+	while(!ra_stop && ra_head == ra_tail)
+	{
+	    pthread_cond_wait(&ra_cond, &ra_lock);
+	}
+	if(ra_stop)
+	{
+	    break;
+	}
+
+	req = ra_queue[ra_head % BLOCK_RA_QUEUE];
+	ra_head++;
+	ra_busy = 1;
+	pthread_mutex_unlock(&ra_lock);
+
+	ra_fetch(req.blocks, req.count);
+	free(req.blocks);
+
+	pthread_mutex_lock(&ra_lock);
+	ra_busy = 0;
+	pthread_cond_broadcast(&ra_cond);
+    }
+    pthread_mutex_unlock(&ra_lock);
+
+    return NULL;
+}
+
+/* Throw away queued readahead and wait for the one in flight, if any. */
+static void ra_drain()
+{
+    pthread_mutex_lock(&ra_lock);
+    while(ra_head != ra_tail)
+    {
+	free(ra_queue[ra_head % BLOCK_RA_QUEUE].blocks);
+	ra_head++;
+    }
+    while(ra_busy)
+    {
+	pthread_cond_wait(&ra_cond, &ra_lock);
+    }
+    pthread_mutex_unlock(&ra_lock);
+}
+
+static void ra_start()
+{
+    ra_stop = 0;
+    if(cache_pool != NULL && pthread_create(&ra_thread, NULL, ra_worker, NULL) == 0)
+    {
+	ra_started = 1;
+    }
+}
+
+static void ra_shutdown()
+{
+    if(!ra_started)
+    {
+	return;
+    }
+
+    ra_drain();
+    pthread_mutex_lock(&ra_lock);
+    ra_stop = 1;
+    pthread_cond_broadcast(&ra_cond);
+    pthread_mutex_unlock(&ra_lock);
+    pthread_join(ra_thread, NULL);
+    ra_started = 0;
+}
+
+/* Kernel readahead for the blocks, for when there is no cache to fill. */
+static void ra_hint(const int *blocks, int count)
+{
+    int i, start = 0;
+
+    if(direct_io)
+    {
+	return; //O_DIRECT reads never look at the page cache
+    }
+
+    for(i = 1; i <= count; i++)
+    {
+	if(i < count && blocks[i] == blocks[i-1] + 1)
+	{
+	    continue;
+	}
+
+	off_t off = (off_t)blocks[start] * BLOCK_SIZE;
+	off_t len = (off_t)(i - start) * BLOCK_SIZE;
+	if(map_base != NULL)
+	{
+	    if(off < map_len)
+	    {
+		off_t page = off & ~((off_t)sysconf(_SC_PAGESIZE) - 1);
+		madvise(map_base + page, (off + len < map_len ? off + len : map_len) - page, MADV_WILLNEED);
+	    }
+	}
+	else if(stripe_members > 1)
+	{
+	    int j, m;
+
+	    for(j = start; j < i; j++)
+	    {
+		off = (off_t)stripe_map(blocks[j], &m) * BLOCK_SIZE;
+		posix_fadvise(stripe_fds[m], off, BLOCK_SIZE, POSIX_FADV_WILLNEED);
+	    }
+	}
+	else
+	{
+	    posix_fadvise(diskfile, off, len, POSIX_FADV_WILLNEED);
+	}
+	start = i;
+    }
+}
+
+/** Start reading blocks in the background
+ *
+ * For callers that can tell what they are going to read next (sfs_read
+ * on a sequential stream).  Returns without waiting; the blocks turn up
+ * in the cache a little later.  If the queue is full the oldest request
+ * is dropped, as the reader has most likely moved past it already.
+ */
+void block_readahead(const int *block_nums, int count)
+{
+    int *copy;
+
+    if(count <= 0 || diskfile < 0)
+    {
+	return;
+    }
+
+    if(!ra_started)
+    {
+	ra_hint(block_nums, count);
+	return;
+    }
 
-#include "block.h"
+    //no point fetching more than the cache could hold on to
+    if(count > cache_size / 2)
+    {
+	count = cache_size / 2;
+    }
+    if(count <= 0 || (copy = malloc(count * sizeof(int))) == NULL)
+    {
+	return;
+    }
+    memcpy(copy, block_nums, count * sizeof(int));
 
-int diskfile = -1;
+    pthread_mutex_lock(&ra_lock);
+    if(ra_tail - ra_head == BLOCK_RA_QUEUE)
+    {
+	free(ra_queue[ra_head % BLOCK_RA_QUEUE].blocks);
+	ra_head++;
+    }
+    ra_queue[ra_tail % BLOCK_RA_QUEUE].blocks = copy;
+    ra_queue[ra_tail % BLOCK_RA_QUEUE].count = count;
+    ra_tail++;
+    pthread_cond_broadcast(&ra_cond);
+    pthread_mutex_unlock(&ra_lock);
+}
+
+static int entry_cmp(const void *a, const void *b)
+{
+    return (*(cache_entry**)a)->block_num - (*(cache_entry**)b)->block_num;
+}
+
+/*
+ * Background writeback
+ *
+ * A flusher thread wakes every flush_interval ms and writes back the
+ * dirty blocks that have been dirty for dirty_expire ms or more.  It is
+ * also woken early once more than dirty_ratio percent of the cache is
+ * dirty, and then writes back everything.  The blocks are copied out
+ * under block_lock, which is then dropped while they are written (so
+ * readers and writers carry on against the cache); io_lock is taken
+ * before block_lock is released, so an eviction or block_flush() of a
+ * newer copy of the same block always lands after this one.  A block
+ * written again in the meantime stays dirty.
+ *
+ * fsync (block_sync) and disk_close() still flush everything at once.
+ */
+static int flush_interval = BLOCK_FLUSH_INTERVAL;
+static int dirty_expire = BLOCK_DIRTY_EXPIRE;
+static int dirty_ratio = BLOCK_DIRTY_RATIO;
+
+static pthread_mutex_t wb_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wb_cond = PTHREAD_COND_INITIALIZER;
+static int wb_kicked = 0;
+static int wb_stop = 0;
+static int wb_started = 0;
+static pthread_t wb_thread;
+static void (*wb_hook)(int) = NULL; //run at the start of each pass, see block_writeback_hook()
+
+static long long now_ms()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void flusher_kick()
+{
+    if(!wb_started)
+    {
+	return;
+    }
+
+    pthread_mutex_lock(&wb_lock);
+    wb_kicked = 1;
+    pthread_cond_signal(&wb_cond);
+    pthread_mutex_unlock(&wb_lock);
+}
+
+/* One pass of the flusher: write back the expired dirty blocks, or all of
+ * them when all is set. */
+static void flusher_pass(int all)
+{
+    int i, j, b, runs, count = 0;
+    long long hooked = now_ms();
+    long long cutoff = hooked - dirty_expire;
+    cache_entry **dirty = NULL;
+    unsigned long *gens = NULL;
+    int *nums = NULL;
+    char **bufs = NULL;
+    char *data = NULL;
+    block_req *reqs = NULL;
+    struct iovec *iov = NULL;
+
+    if(wb_hook != NULL)
+    {
+	wb_hook(all ? 0 : dirty_expire);
+    }
+
+    pthread_mutex_lock(&block_lock);
+    if(cache_pool == NULL || cache_dirty == 0)
+    {
+	pthread_mutex_unlock(&block_lock);
+	return;
+    }
+
+    dirty = malloc(cache_used * sizeof(cache_entry*));
+    gens = malloc(cache_used * sizeof(unsigned long));
+    nums = malloc(cache_used * sizeof(int));
+    bufs = malloc(cache_used * sizeof(char*));
+    reqs = malloc(cache_used * sizeof(block_req));
+    iov = malloc(cache_used * sizeof(struct iovec));
+    if(dirty == NULL || gens == NULL || nums == NULL || bufs == NULL || reqs == NULL || iov == NULL)
+    {
+	pthread_mutex_unlock(&block_lock);
+	goto out;
+    }
+
+    for(i = 0; i < cache_used; i++)
+    {
+	//what the hook dirtied goes out with the blocks it points to, not dirty_expire later
+	if(cache_pool[i].dirty && (all || cache_pool[i].dirtied <= cutoff || (wb_hook != NULL && cache_pool[i].dirtied >= hooked)))
+	{
+	    dirty[count++] = &cache_pool[i];
+	}
+    }
+
+    if(count == 0 || (data = malloc((size_t)count * BLOCK_SIZE)) == NULL)
+    {
+	pthread_mutex_unlock(&block_lock);
+	goto out;
+    }
+
+    qsort(dirty, count, sizeof(cache_entry*), entry_cmp);
+    for(i = 0; i < count; i++)
+    {
+	nums[i] = dirty[i]->block_num;
+	gens[i] = dirty[i]->gen;
+	bufs[i] = data + (size_t)i * BLOCK_SIZE;
+	memcpy(bufs[i], dirty[i]->data, BLOCK_SIZE);
+    }
+
+    pthread_mutex_lock(&io_lock);
+    pthread_mutex_unlock(&block_lock);
+
+    runs = build_runs(nums, bufs, count, 1, reqs, iov);
+    disk_submit_locked(reqs, runs);
+    pthread_mutex_unlock(&io_lock);
+
+    //clean whatever went out and hasn't been written to (or evicted) since
+    pthread_mutex_lock(&block_lock);
+    for(i = 0, b = 0; i < runs; i++)
+    {
+	for(j = 0; j < reqs[i].count; j++, b++)
+	{
+	    if(req_block_len(&reqs[i], j) == BLOCK_SIZE && dirty[b]->dirty &&
+	       dirty[b]->block_num == nums[b] && dirty[b]->gen == gens[b])
+	    {
+		dirty[b]->dirty = 0;
+		cache_dirty--;
+	    }
+	}
+    }
+    pthread_mutex_unlock(&block_lock);
+
+    csum_flush();
+    log_msg("Flusher wrote back %d blocks\n", count);
+
+out:
+    free(data);
+    free(dirty);
+    free(gens);
+    free(nums);
+    free(bufs);
+    free(reqs);
+    free(iov);
+}
+
+static void *flusher_worker(void *arg)
+{
+    struct timespec until;
+    int all;
+
+    pthread_mutex_lock(&wb_lock);
+    while(!wb_stop)
+    {
+	clock_gettime(CLOCK_REALTIME, &until);
+	until.tv_sec += flush_interval / 1000;
+	until.tv_nsec += (long)(flush_interval % 1000) * 1000000;
+	if(until.tv_nsec >= 1000000000)
+	{
+	    until.tv_sec++;
+	    until.tv_nsec -= 1000000000;
+	}
+
+	while(!wb_stop && !wb_kicked && pthread_cond_timedwait(&wb_cond, &wb_lock, &until) == 0)
+	    ;
+	if(wb_stop)
+	{
+	    break;
+	}
+
+	all = wb_kicked;
+	wb_kicked = 0;
+	pthread_mutex_unlock(&wb_lock);
+
+	flusher_pass(all);
+
+	pthread_mutex_lock(&wb_lock);
+    }
+    pthread_mutex_unlock(&wb_lock);
+
+    return NULL;
+}
+
+static void flusher_start()
+{
+    wb_stop = 0;
+    wb_kicked = 0;
+    if(cache_pool != NULL && flush_interval > 0 && pthread_create(&wb_thread, NULL, flusher_worker, NULL) == 0)
+    {
+	wb_started = 1;
+    }
+}
+
+static void flusher_shutdown()
+{
+    if(!wb_started)
+    {
+	return;
+    }
+
+    pthread_mutex_lock(&wb_lock);
+    wb_stop = 1;
+    pthread_cond_signal(&wb_cond);
+    pthread_mutex_unlock(&wb_lock);
+    pthread_join(wb_thread, NULL);
+    wb_started = 0;
+}
+
+/** Set up background writeback
+ *
+ * The flusher writes back blocks that have been dirty for expire_ms every
+ * interval_ms, and everything once more than ratio percent of the cache
+ * is dirty.  An interval of 0 means no flusher: dirty blocks then only go
+ * out on eviction, fsync and unmount.  Must be called before disk_open().
+ */
+void block_writeback_init(int interval_ms, int expire_ms, int ratio)
+{
+    flush_interval = interval_ms < 0 ? 0 : interval_ms;
+    dirty_expire = expire_ms < 0 ? 0 : expire_ms;
+    dirty_ratio = ratio < 1 ? 1 : ratio > 100 ? 100 : ratio;
+}
+
+/** Have the flusher call fn at the start of every pass
+ *
+ * fn runs on the flusher thread with none of the block layer's locks
+ * held, and is passed the age in ms past which the pass writes a dirty
+ * block (0 when it writes them all).  It may read and write blocks, and
+ * whatever it dirties is written back in that same pass.  Lets the layer
+ * above push metadata it has been holding back into the cache on the
+ * flusher's schedule, so it lands no later than the blocks it refers to.
+ */
+void block_writeback_hook(void (*fn)(int))
+{
+    wb_hook = fn;
+}
+
+/** Pick the backend used for disk I/O, and whether to bypass the host
+ * page cache with O_DIRECT
+ *
+ * Must be called before disk_open().
+ */
+void block_backend_init(int backend, int direct)
+{
+    io_backend = backend;
+    direct_io = direct;
+}
+
+/** Set the stripe unit, in blocks, for a disk spread over several files
+ *
+ * disk_open() takes a comma separated list of image files and stripes the
+ * disk across them, width blocks at a time.  Call it before disk_open(),
+ * or after it only while nothing but block 0 has been touched (sfs does
+ * that to take the width from the superblock).  No effect with one file.
+ */
+void block_stripe_init(int width)
+{
+    if(width > 0)
+    {
+	stripe_width = width;
+    }
+}
+
+/** Number of image files the open disk is striped over */
+int block_stripe_members()
+{
+    return stripe_members;
+}
+
+/** Blocks per stripe unit */
+int block_stripe_width()
+{
+    return stripe_width;
+}
+
+/** Change the block size of an open disk
+ *
+ * Everything in the cache is written back and the cache (and the O_DIRECT
+ * pool) is rebuilt for the new size.  sfs calls this once at mount, after
+ * reading the superblock with the default size.  Sizes must be a power of
+ * two between BLOCK_SIZE_MIN and BLOCK_SIZE_MAX.
+ */
+int block_set_size(int size)
+{
+    if(size < BLOCK_SIZE_MIN || size > BLOCK_SIZE_MAX || (size & (size - 1)) != 0)
+    {
+	return -1;
+    }
+
+    if(size == block_size)
+    {
+	return 0;
+    }
+
+    if(diskfile < 0)
+    {
+	block_size = size;
+	return 0;
+    }
+
+    ra_shutdown();
+    flusher_shutdown();
+    pthread_mutex_lock(&block_lock);
+    block_flush();
+    cache_free();
+    pool_release();
+
+    block_size = size;
+
+    if(cache_setup() < 0 || (direct_io && pool_setup() < 0))
+    {
+	perror("block_set_size allocation failed");
+	exit(EXIT_FAILURE);
+    }
+    pthread_mutex_unlock(&block_lock);
+    ra_start();
+    flusher_start();
+
+    log_msg("Block size is now %d\n", block_size);
+    return 0;
+}
 
 void disk_open(const char* diskfile_path)
 {
     if(diskfile >= 0){
 	return;
     }
-    
-    diskfile = open(diskfile_path, O_CREAT|O_RDWR, S_IRUSR|S_IWUSR);
-    if (diskfile < 0) {
+
+    if (strchr(diskfile_path, ',') != NULL && io_backend == BLOCK_IO_MMAP) {
+	log_msg("A striped disk cannot be memory-mapped, using pread\n");
+	io_backend = BLOCK_IO_PREAD;
+    }
+
+    if (direct_io && io_backend == BLOCK_IO_MMAP) {
+	log_msg("O_DIRECT does not apply to a memory-mapped disk, ignoring it\n");
+	direct_io = 0;
+    }
+
+    if (direct_io) {
+	if (stripe_open(diskfile_path, O_DIRECT) < 0 || pool_setup() < 0) {
+	    perror("O_DIRECT open failed, using buffered I/O");
+	    stripe_close();
+	    pool_release();
+	    direct_io = 0;
+	}
+    }
+
+    if (diskfile < 0 && stripe_open(diskfile_path, 0) < 0) {
 	perror("disk_open failed");
 	exit(EXIT_FAILURE);
     }
 
-    log_msg("Opened disk\n");
+    if (io_backend == BLOCK_IO_URING && uring_open(BLOCK_URING_DEPTH) < 0) {
+	perror("io_uring setup failed, falling back to pread");
+	io_backend = BLOCK_IO_PREAD;
+    }
+
+    if (io_backend == BLOCK_IO_MMAP) {
+	if (map_open() < 0) {
+	    perror("mmap of disk failed, falling back to pread");
+	    io_backend = BLOCK_IO_PREAD;
+	} else {
+	    cache_size = 0; //the mapping already is the cache
+	}
+    }
+
+    if (cache_setup() < 0) {
+	perror("block cache allocation failed");
+	exit(EXIT_FAILURE);
+    }
+
+    if (stripe_members > 1 && io_backend == BLOCK_IO_PREAD)
+	stripe_start_workers();
+
+    ra_start();
+    flusher_start();
+
+    if (stripe_members > 1)
+	log_msg("Striped over %d files, %d blocks per unit\n", stripe_members, stripe_width);
+    log_msg("Opened disk (io: %s%s, cache: %d blocks)\n", io_backend == BLOCK_IO_URING ? "io_uring" : io_backend == BLOCK_IO_MMAP ? "mmap" : "pread", direct_io ? " O_DIRECT" : "", cache_size);
 }
 
 void disk_close()
 {
     if(diskfile >= 0){
-	close(diskfile);
+	ra_shutdown();
+	flusher_shutdown();
+	block_sync();
+	cache_free();
+	csum_free();
+	uring_close();
+	map_close();
+	pool_release();
+	stripe_stop_workers();
+	stripe_close();
     }
 
     log_msg("Closed disk\n");
 }
 
+/** Write every dirty cached block back to the disk file
+ *
+ * Blocks go out in ascending order so the image is written front to back,
+ * and are handed to the backend as a single batch.
+ * Returns 0, or a negative value if any block failed to write (those stay
+ * dirty so a later flush can retry them).
+ */
+static int block_flush_locked()
+{
+    int i, j, b, runs, count = 0, retstat = 0;
+    cache_entry **dirty;
+    int *nums;
+    char **bufs;
+    block_req *reqs;
+    struct iovec *iov;
+
+    if(cache_pool == NULL)
+    {
+	return csum_flush();
+    }
+
+    dirty = malloc(cache_used * sizeof(cache_entry*));
+    nums = malloc(cache_used * sizeof(int));
+    bufs = malloc(cache_used * sizeof(char*));
+    reqs = malloc(cache_used * sizeof(block_req));
+    iov = malloc(cache_used * sizeof(struct iovec));
+    if(dirty == NULL || nums == NULL || bufs == NULL || reqs == NULL || iov == NULL)
+    {
+	free(dirty);
+	free(nums);
+	free(bufs);
+	free(reqs);
+	free(iov);
+	return -1;
+    }
+
+    for(i = 0; i < cache_used; i++)
+    {
+	if(cache_pool[i].dirty)
+	{
+	    dirty[count++] = &cache_pool[i];
+	}
+    }
+
+    qsort(dirty, count, sizeof(cache_entry*), entry_cmp);
+
+    for(i = 0; i < count; i++)
+    {
+	nums[i] = dirty[i]->block_num;
+	bufs[i] = dirty[i]->data;
+    }
+
+    //neighbouring dirty blocks become one pwritev; the whole set goes down as one batch
+    runs = build_runs(nums, bufs, count, 1, reqs, iov);
+    if(runs > 0 && disk_submit(reqs, runs) < 0)
+    {
+	retstat = -1;
+    }
+
+    for(i = 0, b = 0; i < runs; i++)
+    {
+	for(j = 0; j < reqs[i].count; j++, b++)
+	{
+	    if(req_block_len(&reqs[i], j) == BLOCK_SIZE)
+	    {
+		dirty[b]->dirty = 0;
+		cache_dirty--;
+	    }
+	}
+    }
+
+    //the checksums of what just went out
+    if(csum_flush() < 0)
+    {
+	retstat = -1;
+    }
+
+    free(iov);
+    free(reqs);
+    free(bufs);
+    free(nums);
+    free(dirty);
+    return retstat;
+}
+
+int block_flush()
+{
+    int retstat;
+
+    pthread_mutex_lock(&block_lock);
+    retstat = block_flush_locked();
+    pthread_mutex_unlock(&block_lock);
+    return retstat;
+}
+
 /** Read a block from an open file
  *
- * Read should return (1) exactly @BLOCK_SIZE when succeeded, or (2) 0 when the requested block has never been touched before, or (3) a negtive value when failed. 
+ * Read should return (1) exactly @BLOCK_SIZE when succeeded, or (2) 0 when the requested block has never been touched before, or (3) a negtive value when failed.
  * In cases of error or return value equals to 0, the content of the @buf is set to 0.
  */
-int block_read(const int block_num, void *buf)
+static int block_read_locked(const int block_num, void *buf)
 {
     int retstat = 0;
-    retstat = pread(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
+    cache_entry *e;
+
+    if(cache_pool == NULL)
+    {
+	return disk_read(block_num, buf);
+    }
+
+    e = cache_lookup(block_num);
+    if(e != NULL)
+    {
+	lru_unlink(e);
+	lru_push(e);
+	memcpy(buf, e->data, BLOCK_SIZE);
+	return e->len;
+    }
 
-    if (retstat <= 0){
-	memset(buf, 0, BLOCK_SIZE);
-	if(retstat<0)
-	perror("block_read failed");
+    retstat = disk_read(block_num, buf);
+    if(retstat < 0)
+    {
+	return retstat;
     }
 
+    e = cache_claim(block_num);
+    if(e != NULL)
+    {
+	memcpy(e->data, buf, BLOCK_SIZE);
+	e->len = retstat;
+    }
+
+    return retstat;
+}
+
+int block_read(const int block_num, void *buf)
+{
+    int retstat;
+
+    pthread_mutex_lock(&block_lock);
+    retstat = block_read_locked(block_num, buf);
+    pthread_mutex_unlock(&block_lock);
     return retstat;
 }
 
 /** Write a block to an open file
  *
- * Write should return exactly @BLOCK_SIZE except on error. 
+ * Write should return exactly @BLOCK_SIZE except on error.
+ * With the cache enabled the block only reaches the disk on eviction or
+ * block_flush().
  */
+static int block_write_locked(const int block_num, const void *buf)
+{
+    cache_entry *e;
+
+    cache_gen++;
+
+    if(cache_pool == NULL)
+    {
+	return disk_write(block_num, buf);
+    }
+
+    e = cache_lookup(block_num);
+    if(e != NULL)
+    {
+	lru_unlink(e);
+	lru_push(e);
+    }
+    else
+    {
+	e = cache_claim(block_num);
+	if(e == NULL)
+	{
+	    //couldn't make room, so don't hold this one back either
+	    return disk_write(block_num, buf);
+	}
+    }
+
+    memcpy(e->data, buf, BLOCK_SIZE);
+    e->len = BLOCK_SIZE;
+    e->gen = cache_gen;
+    if(!e->dirty)
+    {
+	e->dirty = 1;
+	e->dirtied = now_ms();
+	cache_dirty++;
+	if(cache_dirty * 100 > cache_size * dirty_ratio)
+	{
+	    flusher_kick();
+	}
+    }
+
+    return BLOCK_SIZE;
+}
+
 int block_write(const int block_num, const void *buf)
 {
-    int retstat = 0;
-    retstat = pwrite(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
-    if (retstat < 0)
-	perror("qblock_write failed");
-    
+    int retstat;
+
+    pthread_mutex_lock(&block_lock);
+    retstat = block_write_locked(block_num, buf);
+    pthread_mutex_unlock(&block_lock);
+    return retstat;
+}
+
+/** Read several blocks at once
+ *
+ * Block block_nums[i] lands at buf + i*BLOCK_SIZE.  Blocks already in the
+ * cache are copied out of it; the rest are read with one preadv per run of
+ * contiguous block numbers, all submitted as a single batch.  Returns the
+ * number of bytes that came off the disk or out of the cache (blocks that
+ * were never touched count as 0 and are zero-filled), or a negative value
+ * on failure.
+ */
+static int block_readv_locked(const int *block_nums, int count, void *buf)
+{
+    int i, j, b, runs, misses = 0, retstat = 0;
+    int *miss_nums;
+    char **miss_bufs;
+    block_req *reqs;
+    struct iovec *iov;
+    cache_entry *e;
+
+    if(count <= 0)
+    {
+	return 0;
+    }
+
+    miss_nums = malloc(count * sizeof(int));
+    miss_bufs = malloc(count * sizeof(char*));
+    reqs = malloc(count * sizeof(block_req));
+    iov = malloc(count * sizeof(struct iovec));
+    if(miss_nums == NULL || miss_bufs == NULL || reqs == NULL || iov == NULL)
+    {
+	free(miss_nums);
+	free(miss_bufs);
+	free(reqs);
+	free(iov);
+	return -1;
+    }
+
+    for(i = 0; i < count; i++)
+    {
+	e = cache_pool != NULL ? cache_lookup(block_nums[i]) : NULL;
+	if(e != NULL)
+	{
+	    lru_unlink(e);
+	    lru_push(e);
+	    memcpy((char*)buf + i*BLOCK_SIZE, e->data, BLOCK_SIZE);
+	    retstat += e->len;
+	    continue;
+	}
+	miss_nums[misses] = block_nums[i];
+	miss_bufs[misses] = (char*)buf + i*BLOCK_SIZE;
+	misses++;
+    }
+
+    runs = build_runs(miss_nums, miss_bufs, misses, 0, reqs, iov);
+    if(runs > 0 && disk_submit(reqs, runs) < 0)
+    {
+	retstat = -1;
+    }
+
+    //after a failed batch nothing read is counted or cached, even what did come back
+    for(i = 0, b = 0; retstat >= 0 && i < runs; i++)
+    {
+	for(j = 0; j < reqs[i].count; j++, b++)
+	{
+	    int len = req_block_len(&reqs[i], j);
+	    if(len < 0)
+	    {
+		continue;
+	    }
+	    retstat += len;
+	    if(cache_pool != NULL && cache_lookup(miss_nums[b]) == NULL && (e = cache_claim(miss_nums[b])) != NULL)
+	    {
+		memcpy(e->data, miss_bufs[b], BLOCK_SIZE);
+		e->len = len;
+	    }
+	}
+    }
+
+    free(miss_nums);
+    free(miss_bufs);
+    free(reqs);
+    free(iov);
+    return retstat;
+}
+
+int block_readv(const int *block_nums, int count, void *buf)
+{
+    int retstat;
+
+    pthread_mutex_lock(&block_lock);
+    retstat = block_readv_locked(block_nums, count, buf);
+    pthread_mutex_unlock(&block_lock);
+    return retstat;
+}
+
+/** Write several blocks at once
+ *
+ * Block block_nums[i] is taken from buf + i*BLOCK_SIZE.  With the cache
+ * enabled the blocks are simply marked dirty (and block_flush() merges
+ * them back into runs); without it each run of contiguous block numbers
+ * goes out as one pwritev.  Returns count*BLOCK_SIZE, or a negative value
+ * on failure.
+ */
+static int block_writev_locked(const int *block_nums, int count, const void *buf)
+{
+    int i, runs, retstat = 0;
+    char **bufs;
+    block_req *reqs;
+    struct iovec *iov;
+
+    if(count <= 0)
+    {
+	return 0;
+    }
+
+    if(cache_pool != NULL)
+    {
+	for(i = 0; i < count; i++)
+	{
+	    if(block_write_locked(block_nums[i], (const char*)buf + i*BLOCK_SIZE) < 0)
+	    {
+		retstat = -1;
+	    }
+	}
+	return retstat < 0 ? retstat : count*BLOCK_SIZE;
+    }
+
+    bufs = malloc(count * sizeof(char*));
+    reqs = malloc(count * sizeof(block_req));
+    iov = malloc(count * sizeof(struct iovec));
+    if(bufs == NULL || reqs == NULL || iov == NULL)
+    {
+	free(bufs);
+	free(reqs);
+	free(iov);
+	return -1;
+    }
+
+    for(i = 0; i < count; i++)
+    {
+	bufs[i] = (char*)buf + i*BLOCK_SIZE;
+    }
+
+    runs = build_runs(block_nums, bufs, count, 1, reqs, iov);
+    retstat = disk_submit(reqs, runs);
+
+    free(bufs);
+    free(reqs);
+    free(iov);
+    return retstat < 0 ? retstat : count*BLOCK_SIZE;
+}
+
+int block_writev(const int *block_nums, int count, const void *buf)
+{
+    int retstat;
+
+    pthread_mutex_lock(&block_lock);
+    retstat = block_writev_locked(block_nums, count, buf);
+    pthread_mutex_unlock(&block_lock);
     return retstat;
 }
 
+/** Make everything written so far durable
+ *
+ * Writes back the cache, then fdatasync()s the image files (or msync()s it when
+ * it is memory-mapped).  Called for fsync and at unmount.
+ */
+int block_sync()
+{
+    int m, retstat = block_flush();
+
+    if(map_base != NULL)
+    {
+	if(msync(map_base, map_len, MS_SYNC) < 0)
+	{
+	    perror("block_sync msync failed");
+	    retstat = -1;
+	}
+    }
+    else
+    {
+	for(m = 0; m < stripe_members; m++)
+	{
+	    if(fdatasync(stripe_fds[m]) < 0)
+	    {
+		perror("block_sync fdatasync failed");
+		retstat = -1;
+	    }
+	}
+    }
+
+    return retstat;
+}
+
+/** Zero-copy access to a block
+ *
+ * With the mmap backend this returns a pointer to the block inside the
+ * mapping, valid until disk_close().  It is for reading only; changes
+ * still go through block_write.  Returns NULL when the backend is not
+ * mmap, the block lies past the end of the image (block_read would
+ * hand back zeros for it) or the block is checksummed.
+ */
+const char *block_map(const int block_num)
+{
+    off_t off = (off_t)block_num * BLOCK_SIZE;
+
+    //checksummed blocks have to be read through disk_submit() to be checked
+    if(map_base == NULL || off + BLOCK_SIZE > disk_end || csum_covers(block_num))
+    {
+	return NULL;
+    }
+
+    return map_base + off;
+}
+
+/** Turn on block checksums
+ *
+ * The checksum area is nblocks blocks from block start, one little-endian
+ * CRC32C per block of the image (the area's own blocks are not covered).
+ * With format set the area is being created, so every entry starts out
+ * as the CRC of a zero block; otherwise it is loaded from the disk.  Call
+ * after block_set_size().  Returns 0, or -1 if the area can't be read.
+ */
+int block_csum_init(int start, int nblocks, int format)
+{
+    int i, retstat = 0;
+    int *nums;
+    char **bufs;
+    block_req *reqs;
+    struct iovec *iov;
+    uint32_t zero;
+    char *zeros;
+
+    pthread_mutex_lock(&block_lock);
+    csum_free();
+
+    csum_table = malloc((size_t)nblocks * BLOCK_SIZE);
+    csum_dirty = calloc(nblocks, 1);
+    nums = malloc(nblocks * sizeof(int));
+    bufs = malloc(nblocks * sizeof(char*));
+    reqs = malloc(nblocks * sizeof(block_req));
+    iov = malloc(nblocks * sizeof(struct iovec));
+    zeros = calloc(1, BLOCK_SIZE);
+    if(csum_table == NULL || csum_dirty == NULL || nums == NULL || bufs == NULL || reqs == NULL || iov == NULL || zeros == NULL)
+    {
+	csum_free();
+	free(nums);
+	free(bufs);
+	free(reqs);
+	free(iov);
+	free(zeros);
+	pthread_mutex_unlock(&block_lock);
+	return -1;
+    }
+
+    if(format)
+    {
+	zero = htole32(crc32c(0, zeros, BLOCK_SIZE));
+	for(i = 0; i < nblocks * BLOCK_SIZE / (int)sizeof(uint32_t); i++)
+	{
+	    csum_table[i] = zero;
+	}
+	memset(csum_dirty, 1, nblocks);
+    }
+    else
+    {
+	//straight from the disk, bypassing the cache: csum_flush() writes
+	//the area directly, so cached copies would go stale
+	for(i = 0; i < nblocks; i++)
+	{
+	    nums[i] = start + i;
+	    bufs[i] = (char*)csum_table + (size_t)i * BLOCK_SIZE;
+	}
+	retstat = disk_submit(reqs, build_runs(nums, bufs, nblocks, 0, reqs, iov));
+    }
+
+    free(nums);
+    free(bufs);
+    free(reqs);
+    free(iov);
+    free(zeros);
+    if(retstat < 0)
+    {
+	csum_free();
+	pthread_mutex_unlock(&block_lock);
+	return -1;
+    }
+
+    //only now, so the loads above are not checked against a half-filled table
+    pthread_mutex_lock(&io_lock);
+    csum_start = start;
+    csum_blocks = nblocks;
+    csum_count = nblocks * BLOCK_SIZE / sizeof(uint32_t);
+    pthread_mutex_unlock(&io_lock);
+
+    log_msg("Block checksums on (%s), %d blocks at %d, crc32c kernel %d\n",
+	    format ? "new" : "loaded", nblocks, start, crc32c_best());
+    pthread_mutex_unlock(&block_lock);
+    return 0;
+}
@@ -8,11 +8,51 @@
 #ifndef _BLOCK_H_
 #define _BLOCK_H_
 
-#define BLOCK_SIZE 512
+//The block size is fixed when a filesystem is formatted and read back from
+//its superblock at mount (see block_set_size), so BLOCK_SIZE is a runtime value.
+extern int block_size;
+#define BLOCK_SIZE block_size
+#define BLOCK_SIZE_DEFAULT 512
+#define BLOCK_SIZE_MIN 512
+#define BLOCK_SIZE_MAX (64 * 1024)
+#define BLOCK_CACHE_DEFAULT 1024 //blocks held in memory by the write-back cache
+#define BLOCK_URING_DEPTH 64 //io_uring submission queue entries
+#define BLOCK_RUN_MAX 256 //most blocks merged into one preadv/pwritev
+#define BLOCK_RA_QUEUE 8 //readahead requests waiting for the worker thread
+#define BLOCK_FLUSH_INTERVAL 5000 //ms between flusher thread passes
+#define BLOCK_DIRTY_EXPIRE 30000 //ms a block may stay dirty before the flusher writes it
+#define BLOCK_DIRTY_RATIO 10 //percent of the cache dirty that wakes the flusher early
+#define BLOCK_MMAP_CHUNK (16 * 1024 * 1024) //mmap backend grows the image this much at a time
+#define BLOCK_MMAP_RESERVE (1ULL << 36) //address space set aside for the mapping
+#define DIRECT_ALIGN 4096 //O_DIRECT offset/length/buffer alignment
+#define DIRECT_MAX (BLOCK_RUN_MAX * BLOCK_SIZE + 2 * DIRECT_ALIGN) //largest aligned transfer
+#define DIRECT_POOL_BUFS 16 //aligned bounce buffers kept for O_DIRECT
+#define BLOCK_STRIPE_MAX 16 //most image files one disk can be striped over
+#define BLOCK_STRIPE_WIDTH 16 //blocks per stripe unit
 
+//I/O backends, chosen at mount time
+#define BLOCK_IO_PREAD 0
+#define BLOCK_IO_URING 1
+#define BLOCK_IO_MMAP 2
+
+void block_backend_init(int backend, int direct);
+void block_cache_init(int nblocks);
+void block_writeback_init(int interval_ms, int expire_ms, int ratio);
+void block_writeback_hook(void (*fn)(int));
+void block_stripe_init(int width);
+int block_stripe_members();
+int block_stripe_width();
+int block_set_size(int size);
 void disk_open(const char* diskfile_path);
 void disk_close();
 int block_read(const int block_num, void *buf);
 int block_write(const int block_num, const void *buf);
+int block_readv(const int *block_nums, int count, void *buf);
+int block_writev(const int *block_nums, int count, const void *buf);
+int block_flush();
+int block_sync();
+const char *block_map(const int block_num);
+void block_readahead(const int *block_nums, int count);
+int block_csum_init(int start, int nblocks, int format);
 
 #endif
@@ -0,0 +1,222 @@
+/*
+  CRC32C (Castagnoli) checksums for sfs blocks.
+
+  The hardware path runs the SSE4.2 crc32 instruction.  On its own it is
+  limited by the instruction's 3 cycle latency, so longer buffers are cut
+  into three equal streams that are checksummed side by side and then
+  merged: moving a partial CRC past n bytes is a multiply by x^(8n) mod P,
+  which PCLMULQDQ does in one instruction, and a final crc32 reduces the
+  64-bit product back to 32 bits.  The per-stream constants are worked out
+  once at startup.
+*/
+
+#include "crc32c.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+#define CRC32C_X86 1
+#endif
+
+#define POLY 0x82f63b78 //CRC32C polynomial, bit-reflected
+
+#define STREAM_LONG 1024 //bytes per stream in a three stream round
+#define STREAM_SHORT 128
+
+static uint32_t table[8][256];
+static int best = CRC32C_SW;
+static uint32_t k_long, k_short; //x^(8*STREAM_*-33) mod P, for crc_shift()
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+/* x^n mod P, reflected */
+static uint32_t xnmodp(unsigned n)
+{
+    uint32_t p = 0x80000000; //x^0
+
+    while(n--)
+    {
+	p = p & 1 ? (p >> 1) ^ POLY : p >> 1;
+    }
+    return p;
+}
+
+static void crc32c_setup()
+{
+    uint32_t c;
+    int n, k;
+
+    for(n = 0; n < 256; n++)
+    {
+	c = n;
+	for(k = 0; k < 8; k++)
+	{
+	    c = c & 1 ? (c >> 1) ^ POLY : c >> 1;
+	}
+	table[0][n] = c;
+    }
+    for(n = 0; n < 256; n++)
+    {
+	for(k = 1; k < 8; k++)
+	{
+	    table[k][n] = (table[k-1][n] >> 8) ^ table[0][table[k-1][n] & 0xff];
+	}
+    }
+
+    k_long = xnmodp(8 * STREAM_LONG - 33);
+    k_short = xnmodp(8 * STREAM_SHORT - 33);
+
+#ifdef CRC32C_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse4.2"))
+    {
+	best = __builtin_cpu_supports("pclmul") ? CRC32C_PCLMUL : CRC32C_SSE42;
+    }
+#endif
+}
+
+/* Slicing-by-8: eight table lookups per 8 bytes. */
+static uint32_t crc_sw(uint32_t crc, const unsigned char *p, size_t len)
+{
+    uint64_t w;
+
+    while(len && ((uintptr_t)p & 7))
+    {
+	crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xff];
+	len--;
+    }
+
+    while(len >= 8)
+    {
+	memcpy(&w, p, 8);
+	w ^= crc; //little-endian: the crc lines up with the first four bytes
+	crc = table[7][w & 0xff] ^ table[6][(w >> 8) & 0xff] ^
+	      table[5][(w >> 16) & 0xff] ^ table[4][(w >> 24) & 0xff] ^
+	      table[3][(w >> 32) & 0xff] ^ table[2][(w >> 40) & 0xff] ^
+	      table[1][(w >> 48) & 0xff] ^ table[0][w >> 56];
+	p += 8;
+	len -= 8;
+    }
+
+    while(len--)
+    {
+	crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xff];
+    }
+
+    return crc;
+}
+
+#ifdef CRC32C_X86
+__attribute__((target("sse4.2")))
+static uint32_t crc_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+    uint64_t c = crc, w;
+
+    while(len && ((uintptr_t)p & 7))
+    {
+	c = _mm_crc32_u8(c, *p++);
+	len--;
+    }
+
+    while(len >= 8)
+    {
+	memcpy(&w, p, 8);
+	c = _mm_crc32_u64(c, w);
+	p += 8;
+	len -= 8;
+    }
+
+    while(len--)
+    {
+	c = _mm_crc32_u8(c, *p++);
+    }
+
+    return (uint32_t)c;
+}
+
+/* Move crc past STREAM_* bytes: clmul by x^(8n-33), then reduce with crc32. */
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t crc_shift(uint32_t crc, uint32_t k)
+{
+    __m128i prod = _mm_clmulepi64_si128(_mm_cvtsi32_si128(crc), _mm_cvtsi32_si128(k), 0);
+
+    return (uint32_t)_mm_crc32_u64(0, _mm_cvtsi128_si64(prod));
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t crc_hw3(uint32_t crc, const unsigned char *p, size_t len)
+{
+    uint64_t a, b, c, w;
+    size_t i, n;
+    uint32_t k;
+
+    while(len >= 3 * STREAM_SHORT)
+    {
+	n = len >= 3 * STREAM_LONG ? STREAM_LONG : STREAM_SHORT;
+	k = n == STREAM_LONG ? k_long : k_short;
+
+	a = crc;
+	b = 0;
+	c = 0;
+	for(i = 0; i < n; i += 8)
+	{
+	    memcpy(&w, p + i, 8);
+	    a = _mm_crc32_u64(a, w);
+	    memcpy(&w, p + n + i, 8);
+	    b = _mm_crc32_u64(b, w);
+	    memcpy(&w, p + 2*n + i, 8);
+	    c = _mm_crc32_u64(c, w);
+	}
+
+	crc = crc_shift(crc_shift((uint32_t)a, k) ^ (uint32_t)b, k) ^ (uint32_t)c;
+	p += 3 * n;
+	len -= 3 * n;
+    }
+
+    return crc_hw(crc, p, len);
+}
+#endif
+
+/** Checksum with a particular implementation
+ *
+ * For the benchmark and for checking the implementations against each
+ * other.  Falls back to the table version if impl is not supported.
+ */
+uint32_t crc32c_impl(int impl, uint32_t crc, const void *buf, size_t len)
+{
+    pthread_once(&once, crc32c_setup);
+
+    if(impl > best)
+    {
+	impl = CRC32C_SW;
+    }
+
+    crc = ~crc;
+#ifdef CRC32C_X86
+    if(impl == CRC32C_PCLMUL)
+    {
+	return ~crc_hw3(crc, buf, len);
+    }
+    if(impl == CRC32C_SSE42)
+    {
+	return ~crc_hw(crc, buf, len);
+    }
+#endif
+    return ~crc_sw(crc, buf, len);
+}
+
+/** CRC32C of len bytes, continuing from crc (0 to start) */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    pthread_once(&once, crc32c_setup);
+    return crc32c_impl(best, crc, buf, len);
+}
+
+/** The implementation crc32c() uses on this CPU (CRC32C_*) */
+int crc32c_best()
+{
+    pthread_once(&once, crc32c_setup);
+    return best;
+}
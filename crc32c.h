@@ -0,0 +1,25 @@
+/*
+  CRC32C (Castagnoli) checksums for sfs blocks.
+
+  crc32c() picks the fastest implementation the CPU supports the first
+  time it is called: the SSE4.2 crc32 instruction over three interleaved
+  streams merged with PCLMULQDQ, the crc32 instruction on its own, or a
+  slicing-by-8 table loop everywhere else.  All of them give the same
+  result.
+*/
+
+#ifndef _CRC32C_H_
+#define _CRC32C_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CRC32C_SW 0 //table driven, any CPU
+#define CRC32C_SSE42 1 //crc32 instruction, one stream
+#define CRC32C_PCLMUL 2 //crc32 instruction, three streams merged with carry-less multiply
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+uint32_t crc32c_impl(int impl, uint32_t crc, const void *buf, size_t len);
+int crc32c_best();
+
+#endif
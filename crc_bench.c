@@ -0,0 +1,67 @@
+/*
+  Checksum overhead benchmark.
+
+  Runs every CRC32C implementation the CPU supports over 1 GB of data,
+  one block at a time, and prints the time it adds per GB read or
+  written.  Build and run with:
+
+      gcc -O2 -o crc_bench crc_bench.c crc32c.c -lpthread
+      ./crc_bench [block size]
+*/
+
+#include "crc32c.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#define BENCH_BYTES (1024LL * 1024 * 1024)
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+	int blockSize = argc > 1 ? atoi(argv[1]) : 4096;
+	int poolBlocks = 256; //1 MB at 4K, so it stays in L2/L3 like a hot cache
+	const char *names[] = {"table", "sse4.2", "sse4.2+pclmul"};
+	unsigned char *buf;
+	long long i, blocks;
+	int impl;
+
+	if(blockSize <= 0)
+	{
+		fprintf(stderr, "usage: crc_bench [block size]\n");
+		return 1;
+	}
+
+	buf = malloc((size_t)blockSize * poolBlocks);
+	for(i = 0; i < (long long)blockSize * poolBlocks; i++)
+	{
+		buf[i] = rand();
+	}
+	blocks = BENCH_BYTES / blockSize;
+
+	printf("block size %d, %lld blocks per GB\n", blockSize, blocks);
+	for(impl = CRC32C_SW; impl <= crc32c_best(); impl++)
+	{
+		uint32_t sum = 0;
+		double start = now(), secs;
+
+		for(i = 0; i < blocks; i++)
+		{
+			sum += crc32c_impl(impl, 0, buf + (i % poolBlocks) * blockSize, blockSize);
+		}
+		secs = now() - start;
+
+		printf("%-14s %8.1f ms/GB  %6.2f GB/s  %6.1f ns/block  (%08x)\n",
+		       names[impl], secs * 1000, 1 / secs, secs * 1e9 / blocks, sum);
+	}
+
+	free(buf);
+	return 0;
+}
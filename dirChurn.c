@@ -0,0 +1,90 @@
+/*
+  Directory churn check.
+
+  Creates a batch of files of assorted name lengths in a directory of a
+  mounted sfs, removes them again in an interleaved order, and repeats
+  with different names.  Space freed in the middle of the directory's
+  blocks should be used again, so its size after the first round should
+  stay where it is.  With the filesystem mounted at /tmp/laf224/mountdir,
+  build and run with:
+
+      gcc -o dirChurn dirChurn.c
+      ./dirChurn [files] [rounds] [directory]
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static void entry(char *path, const char *dir, int i, int round)
+{
+	int len = 1 + (i * 37 + round * 11) % 60; //name lengths move around each round
+
+	sprintf(path, "%s/%0*d", dir, len, i);
+}
+
+int main(int argc, char *argv[])
+{
+	int files = argc > 1 ? atoi(argv[1]) : 500;
+	int rounds = argc > 2 ? atoi(argv[2]) : 50;
+	const char *dir = argc > 3 ? argv[3] : "/tmp/laf224/mountdir/dirChurn";
+	char path[4096];
+	struct stat st;
+	off_t first = 0;
+	int round, i, fd;
+
+	if(mkdir(dir, 0755) < 0)
+	{
+		perror(dir);
+		return 1;
+	}
+
+	for(round = 0; round < rounds; round++)
+	{
+		for(i = 0; i < files; i++)
+		{
+			entry(path, dir, i, round);
+			if((fd = open(path, O_CREAT | O_WRONLY, 0644)) < 0)
+			{
+				perror(path);
+				return 1;
+			}
+			close(fd);
+		}
+
+		if(stat(dir, &st) < 0)
+		{
+			perror(dir);
+			return 1;
+		}
+		if(round == 0)
+		{
+			first = st.st_size;
+		}
+		//the new names are longer in places, so allow a block or two of slop
+		else if(st.st_size > first + 2 * st.st_blksize)
+		{
+			printf("FAIL: round %d, directory is %lld bytes, was %lld\n", round, (long long)st.st_size, (long long)first);
+			return 1;
+		}
+
+		//every other one first, so the holes are in the middle of blocks
+		for(i = 0; i < files; i += 2)
+		{
+			entry(path, dir, i, round);
+			unlink(path);
+		}
+		for(i = 1; i < files; i += 2)
+		{
+			entry(path, dir, i, round);
+			unlink(path);
+		}
+	}
+
+	rmdir(dir);
+	printf("directory stayed at %lld bytes over %d rounds\nOK\n", (long long)first, rounds);
+	return 0;
+}
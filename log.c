@@ -23,6 +23,9 @@
 
 #include "log.h"
 
+// the log opened by log_open(), for threads that have no fuse context
+static FILE *log_file = NULL;
+
 FILE *log_open()
 {
     FILE *logfile;
@@ -38,6 +41,7 @@ FILE *log_open()
     // set logfile to line buffering
     setvbuf(logfile, NULL, _IOLBF, 0);
 
+    log_file = logfile;
     return logfile;
 }
 
@@ -46,7 +50,9 @@ void log_msg(const char *format, ...)
     va_list ap;
     va_start(ap, format);
 
-    vfprintf(SFS_DATA->logfile, format, ap);
+    // the block layer's worker threads aren't fuse threads, so SFS_DATA is NULL there
+    vfprintf(log_file != NULL ? log_file : SFS_DATA->logfile, format, ap);
+    va_end(ap);
 }
 
 // fuse context
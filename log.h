@@ -13,8 +13,17 @@
 #define log_struct(st, field, format, typecast) \
   log_msg("    " #field " = " #format "\n", typecast st->field)
 
+//only pointers to these are passed, so callers that don't use them needn't include fuse.h and friends
+struct fuse_conn_info;
+struct fuse_context;
+struct fuse_file_info;
+struct stat;
+struct statvfs;
+struct utimbuf;
+
 FILE *log_open(void);
 void log_conn (struct fuse_conn_info *conn);
+void log_fuse_context(struct fuse_context *context);
 void log_fi (struct fuse_file_info *fi);
 void log_stat(struct stat *si);
 void log_statvfs(struct statvfs *sv);
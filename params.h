@@ -26,6 +26,22 @@
 struct sfs_state {
     FILE *logfile;
     char *diskfile;
+    int cache_blocks; // size of the block cache, --cache=N (0 turns it off)
+    int inode_cache;  // inodes kept in memory, --inode-cache=N
+    int dentry_cache; // name lookups kept in memory, --dentry-cache=N (0 turns it off)
+    int io_backend;   // BLOCK_IO_* from block.h, --io=pread|uring|mmap
+    int direct_io;    // open the image O_DIRECT, --direct
+    int block_size;   // block size used when formatting a new image, --block-size=N
+    int checksums;    // give a new image per-block checksums, --checksums
+    int inode_count;  // inodes in a new image's inode table, --inodes=N (0 = default)
+    int inode_size;   // bytes per inode in a new image's inode table, --inode-size=N (0 = default)
+    long long image_size; // bytes in a new image, --size=N[K|M|G|T] (0 = default)
+    int flush_interval; // ms between background writeback passes, --flush-interval=MS (0 = none)
+    int dirty_expire; // ms before a dirty block is due for writeback, --dirty-expire=MS
+    int dirty_ratio;  // percent of the cache dirty that starts writeback early, --dirty-ratio=PCT
+    int stripe_width; // blocks per stripe unit when diskFile lists several images, --stripe-width=N (0 = as formatted)
+    int relatime;     // only update atime when it is older than mtime/ctime or a day old, --relatime
+    int lazytime;     // keep timestamp-only inode changes in memory, --lazytime
 };
 #define SFS_DATA ((struct sfs_state *) fuse_get_context()->private_data)
 
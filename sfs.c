@@ -7,19 +7,27 @@
 
 */
 
+#define _DEFAULT_SOURCE //le32toh() and friends alongside params.h's _XOPEN_SOURCE
+
 #include "params.h"
 #include "block.h"
+#include "crc32c.h"
 
 #include <ctype.h>
 #include <dirent.h>
+#include <endian.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <fuse.h>
 #include <libgen.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <math.h>
@@ -39,6 +47,7 @@ inode currentNode;
 mode_t lastOpFlag; //holds file permission of just-opened file
 mode_t lastDirOpFlag; //holds folder permission of just-opened directory
 int fileFound;
+sfs_layout layout; //on-disk layout, read from the superblock at mount
 /*-------------------------*/
 
 ///////////////////////////////////////////////////////////
@@ -59,39 +68,103 @@ int fileFound;
  */
 void *sfs_init(struct fuse_conn_info *conn)
 {
-    disk_open("/.freespace/laf224/testfsfile");
+    block_backend_init(SFS_DATA->io_backend, SFS_DATA->direct_io);
+    block_cache_init(SFS_DATA->cache_blocks);
+    block_writeback_init(SFS_DATA->flush_interval, SFS_DATA->dirty_expire, SFS_DATA->dirty_ratio);
+    if(SFS_DATA->inode_cache > 0)
+    {
+	block_writeback_hook(inode_writeback);
+    }
+    block_stripe_init(SFS_DATA->stripe_width);
+    disk_open(SFS_DATA->diskfile);
+    if(inode_cache_init(SFS_DATA->inode_cache) < 0)
+    {
+	log_msg("Inode cache allocation failed, running without it\n");
+    }
+    if(dentry_cache_init(SFS_DATA->dentry_cache) < 0)
+    {
+	log_msg("Dentry cache allocation failed, running without it\n");
+    }
     
     int bstat;
-    char buffer[BLOCK_SIZE];
+    char *buffer = (char*)calloc(1, BLOCK_SIZE_MAX);
 
     //Read first byte(s) from file system. block_read() will return 0 if block is empty
     int readstat = block_read(0, buffer);
     log_msg("Readstat: %d\n",readstat);
     if(readstat == 0)
     {
-	//initialize file system
+	//initialize file system with the block size asked for on the command line
+	if(block_set_size(SFS_DATA->block_size) < 0)
+	{
+	    log_msg("Bad block size %d\n", SFS_DATA->block_size);
+	    exit(EXIT_FAILURE);
+	}
+	if(format_layout(BLOCK_SIZE, SFS_DATA->checksums, SFS_DATA->inode_count, SFS_DATA->inode_size, SFS_DATA->image_size) < 0)
+	{
+	    exit(EXIT_FAILURE);
+	}
+	if(layout.csum_blocks > 0 && block_csum_init(layout.csum_start, layout.csum_blocks, 1) < 0)
+	{
+	    log_msg("Could not set up block checksums\n");
+	    exit(EXIT_FAILURE);
+	}
 	setMetadata();
 	log_msg("Back from metadata init\n");
         //create root folder
-	//char *rootData = "0&.\n";
-	char rootData[BUFF_SIZE];
-	strcpy(rootData, "8\t.\n");
+	char *rootData = (char*)calloc(1, BLOCK_SIZE);
+	dirent_set((dir_entry*)rootData, BLOCK_SIZE, ROOT_INO, ".", 1, S_IFDIR);
 	bstat = block_write(DATA_START, rootData);
 	log_msg("Bstat after write: %d\n", bstat);
 
-	bzero(rootData, BUFF_SIZE);
-	bstat = block_read(DATA_START, rootData);
-	log_msg("Bstat after read: %d\n", bstat);
-
-	log_msg("Root data: %s\n", rootData);
+	free(rootData);
+    }
+    else if(readstat > 0)
+    {
+	if(block_set_size(read_layout(buffer)) < 0)
+	{
+	    log_msg("Unsupported block size in superblock\n");
+	    exit(EXIT_FAILURE);
+	}
+	//block 0 is at the start of the first file whatever the stripe width,
+	//so nothing read so far depends on it
+	if((layout.stripe_members > 1 ? layout.stripe_members : 1) != block_stripe_members() ||
+	   (layout.stripe_members > 1 && SFS_DATA->stripe_width > 0 && layout.stripe_width != SFS_DATA->stripe_width))
+	{
+	    log_msg("Filesystem was formatted striped over %d files with width %d, mounted with %d files\n",
+		    layout.stripe_members > 1 ? layout.stripe_members : 1, layout.stripe_width, block_stripe_members());
+	    exit(EXIT_FAILURE);
+	}
+	if(layout.stripe_members > 1)
+	{
+	    block_stripe_init(layout.stripe_width);
+	}
+	if(layout.csum_blocks > 0 && block_csum_init(layout.csum_start, layout.csum_blocks, 0) < 0)
+	{
+	    log_msg("Could not load block checksums\n");
+	    exit(EXIT_FAILURE);
+	}
+	if(layout.version < 2)
+	{
+	    migrate_inodes();
+	}
+	inode_chunk_init();
+	if(layout.version < 6)
+	{
+	    migrate_dirs();
+	}
     }
+    free(buffer);
 
-    else if(readstat < 0)
+    if(readstat < 0)
     {
 	log_msg("Failed to initialize sfs.\n");
 	exit(EXIT_FAILURE);
     }
 
+    //every lookup starts at the root, so it stays cached
+    inode_pin(ROOT_INO);
+
     fprintf(stderr, "in bb-init\n");
     log_msg("\nsfs_init()\n");
 
@@ -112,6 +185,7 @@ void *sfs_init(struct fuse_conn_info *conn)
 void sfs_destroy(void *userdata)
 {
     log_msg("\nsfs_destroy(userdata=0x%08x)\n", userdata);
+    inode_sync(1);
     disk_close();
 }
 
@@ -124,39 +198,15 @@ void sfs_destroy(void *userdata)
 int sfs_getattr(const char *path, struct stat *statbuf)
 {
     int retstat = 0;
-    //char fpath[BUFF_SIZE];
 	char *fpath = (char*)malloc(strlen(path)+1);
     strcpy(fpath, path);
-    log_msg("fpath: %s, path: %s\n",fpath,path);
-    int myLen = strlen(fpath);
-
-    if(strcmp(fpath,"/") == 0 && myLen == 1)
-    {
-	log_msg("JUST CHANGED / TO /.\n");
-	strcpy(fpath, "/.");
-    }
-	inode whygod;
-    inode start = get_inode("/", whygod, 0);
-
-    inode myInode = get_inode(fpath, start,0);
-    if(!fileFound)
-    {
-		free(fpath);
-        return -2; //file not found
-    }
-    
-    log_msg("myInode's number %d and its first block is index %d.\n", myInode.info.st_ino, myInode.direct[0]);
-
-    char *grabbedInode = get_buffer(myInode);
 
-    log_msg("Bruh, I just grabbed this inode: \n%s\n",grabbedInode);
+    //only the stat fields are wanted, so the file's block map isn't decoded
+    retstat = get_attr(fpath, statbuf);
 
-    *statbuf = myInode.info;
-    
     log_msg("\nsfs_getattr(path=\"%s\", statbuf=0x%08x)\n",
 	  path, statbuf);
     
-	free(grabbedInode);
 	free(fpath);
     return retstat;
 }
@@ -175,16 +225,11 @@ int sfs_getattr(const char *path, struct stat *statbuf)
  */
 int sfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
-    int i, j;
+    int i, ino;
     int retstat = 0;
     log_msg("\nsfs_create(path=\"%s\", mode=0%03o, fi=0x%08x)\n",
 	    path, mode, fi);
 
-    char inodeMap[64];
-    char dataMap[4031];
-    char freeBit;
-    int found = 0;
-
     char *pathCopy = (char*)malloc(strlen(path)+1);
 	//char pathCopy[BUFF_SIZE];
     strcpy(pathCopy,path);
@@ -198,80 +243,19 @@ int sfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
     {
 	    //make fileNode into new inode
 		log_msg("File does not exist\n");
-	    char *superBuff = read_super();
-	    memcpy(inodeMap, superBuff, 64);
-	    memcpy(dataMap, (superBuff + 64), 4031);
-	    char superCopyInode[64];
-	    char superCopyData[4031];
-	    memcpy(superCopyInode,inodeMap,64);
-	    memcpy(superCopyData,dataMap,4031);
-	    int bitLoc = -1;
-	    int blockLoc = -1;
-
-	    for(i = 0; i < 64; i++)
-	    {
-	        for(j = 7; j >= 0; j--)
-	        {
-		        freeBit = superCopyInode[i] & 0x1;
-	            if(freeBit)
-	            {
-					if (i != 0 && j != 0)
-					{
-		            	bitLoc = j;
-		            	blockLoc = i;
-		            	break;
-					}
-	            }
-		        superCopyInode[i] >>= 1;
-	        }
-	        if(bitLoc >= 0)
-	        {
-		        break;
-	        }
-	    }
 
-		if (bitLoc < 0)//No space in inode region
+		//claim an inode; the data starts out inline, so no block yet
+		int inodeBlock = myInodeIndex();
+		if (inodeBlock < 0)//No space in inode region
 		{
+			free(pathCopy);
 			return -ENOSPC;
 		}
 
-	    if (bitLoc == 0)
-	    {
-		    inodeMap[blockLoc] &= 0x7f;
-	    }
-	    else if (bitLoc == 1)
-	    {
-		    inodeMap[blockLoc] &= 0xbf;
-	    }
-	    else if (bitLoc == 2)
-	    {
-		    inodeMap[blockLoc] &= 0xdf;
-	    }
-	    else if (bitLoc == 3)
-	    {
-	        inodeMap[blockLoc] &= 0xef;
-	    }
-	    else if (bitLoc == 4)
-	    {
-            inodeMap[blockLoc] &= 0xf7;
-	    }
-	    else if (bitLoc == 5)
-	    {
-            inodeMap[blockLoc] &= 0xfb;
-	    }
-	    else if (bitLoc == 6)
-	    {
-            inodeMap[blockLoc] &= 0xfd;
-	    }
-	    else if (bitLoc == 7)
-	    {
-            inodeMap[blockLoc] &= 0xfe;
-	    }
-
-        int inodeBlock = (blockLoc*8) + bitLoc + INODE_START;
 		//log_msg("[Create] blockLoc:%d,bitLoc:%d,inodeBlock:%d\n",blockLoc,bitLoc,inodeBlock);
 
         inode root_inode;
+        memset(&root_inode, 0, sizeof(root_inode));
         root_inode.info.st_dev = 0;
         root_inode.info.st_ino = inodeBlock;
         root_inode.info.st_mode = S_IFREG | mode; //regular file with passed-in permissions
@@ -302,88 +286,14 @@ int sfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
         root_inode.info.st_ctime = time.tv_sec;
 
         root_inode.info.st_blksize = BLOCK_SIZE;
-        root_inode.info.st_blocks = 1;
-
-
-        int bitLocData = -1;
-	    int blockLocData = -1;
-
-	    for(i = 0; i < 4031; i++)
-	    {
-	        for(j = 7; j >= 0; j--)
-	        {
-		        freeBit = superCopyData[i] & 1;
-	            if(freeBit)
-	            {
-					//if (j != 0 && i != 0)
-					//{
-				        bitLocData = j;
-				        blockLocData = i;
-				        break;
-					//}
-	            }
-		        superCopyData[i] >>= 1;
-	        }
-	        if(bitLocData >= 0)
-	        {
-		        break;
-	        }
-	    }
+        root_inode.info.st_blocks = 0;
 
-		if (bitLocData < 0)//No space in inode region
-		{
-			return -ENOSPC;
-		}
-
-	    if (bitLocData == 0)
-	    {
-		    dataMap[blockLocData] &= 0x7f;
-	    }
-	    else if (bitLocData == 1)
-	    {
-		    dataMap[blockLocData] &= 0xbf;
-	    }
-	    else if (bitLocData == 2)
-	    {
-		    dataMap[blockLocData] &= 0xdf;
-	    }
-	    else if (bitLocData == 3)
-	    {
-	        dataMap[blockLocData] &= 0xef;
-	    }
-	    else if (bitLocData == 4)
-	    {
-            dataMap[blockLocData] &= 0xf7;
-	    }
-	    else if (bitLocData == 5)
-	    {
-            dataMap[blockLocData] &= 0xfb;
-	    }
-	    else if (bitLocData == 6)
-	    {
-            dataMap[blockLocData] &= 0xfd;
-	    }
-	    else if (bitLocData == 7)
-	    {
-            dataMap[blockLocData] &= 0xfe;
-	    }
 
-        int dataBlock = (blockLocData * 8) + (bitLocData + 520);
-        
-        root_inode.direct[0] = dataBlock;
+        //regular files live in the inode until they outgrow it (see loopWrite)
+        root_inode.flags = INODE_FL_INLINE;
 		fi->flags = mode;
         write_to_file(root_inode);
-
-        char insert_buffer[4095];
-        memcpy(insert_buffer, inodeMap, 64);
-        memcpy((insert_buffer + 64), dataMap, 4031);
-
-        for(i = 0; i < 8; i++)
-        {
-            block_write(i, insert_buffer + (BLOCK_SIZE * i));
-        }
-
-		log_msg("Just updated bit maps\n");
+        ino = root_inode.info.st_ino;
 
 
         //update parent folder after insertion
@@ -401,15 +311,10 @@ int sfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 		}
 
 		log_msg("Path Copy, moment of truth: %s\n",dummy);
-		char *directoryData;
-		asprintf(&directoryData,"%d\t%s\n",root_inode.info.st_ino,dummy);
 		fileFound = 1;
-		writeToDirectory(directoryData, MY_APPEND);
+		writeToDirectory(dummy, root_inode.info.st_ino, root_inode.info.st_mode, MY_APPEND);
 		
 		log_msg("Just updated directory data\n");
-		free(directoryData);
-		free(superBuff);
-		log_msg("suoerBuff was freed\n");
     }
 
     else
@@ -417,9 +322,14 @@ int sfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 		//update file mode
 		fileNode.info.st_mode = mode;
 		write_to_file(fileNode);
+		ino = fileNode.info.st_ino;
     }
     
 	free(pathCopy);
+	open_file *of = (open_file*)calloc(1, sizeof(open_file));
+	of->ino = ino;
+	inode_pin(ino);
+	fi->fh = (uint64_t)(uintptr_t)of;
 
     return retstat;
 }
@@ -442,38 +352,11 @@ int sfs_unlink(const char *path)
 		return -ENOENT;
 	}
 	
-	int i, len;
-	
-	if(unlinkInode.info.st_size % BLOCK_SIZE > 0)
-    {
-		len = (unlinkInode.info.st_size/BLOCK_SIZE)+1;
-    }
-    else
-    {
-		len = unlinkInode.info.st_size/BLOCK_SIZE;
-    }
-
-	char zeroBuff[BLOCK_SIZE];
-	memset(zeroBuff,'\0',BLOCK_SIZE);
-	int wstat;
-
-	for(i = 0; i < len; i++)
-	{
-		if(i < 32)//direct pointers
-		{
-			wstat = block_write(unlinkInode.direct[i],zeroBuff);
-			flipBit(unlinkInode.direct[i]);
-			unlinkInode.direct[i] = 0;
-		}
-
-		else
-		{
-			//TODO: handle indirect pointers
-		}
-	}
-	flipBit(unlinkInode.info.st_ino);
+	//data blocks (and for extent mapped files the tree blocks) go back to the bitmap
+	file_unmap(&unlinkInode);
+	freeInode(unlinkInode.info.st_ino);
 	unlinkInode.info.st_nlink = 0;
-	writeToDirectory(pathCopy,MY_DELETE);
+	writeToDirectory(pathCopy, 0, 0, MY_DELETE);
 	//log_msg("[unlink] okay...now what?\n");
     return retstat;
 }
@@ -488,6 +371,16 @@ int sfs_unlink(const char *path)
  *
  * Changed in version 2.2
  */
+//with --relatime, atime is only moved on when it is behind mtime or ctime, or a day old
+static int atime_due(const struct stat *st, time_t now)
+{
+    if(!SFS_DATA->relatime)
+    {
+	return 1;
+    }
+    return st->st_atime < st->st_mtime || st->st_atime < st->st_ctime || now - st->st_atime >= RELATIME_INTERVAL;
+}
+
 int sfs_open(const char *path, struct fuse_file_info *fi)
 {
     int retstat = 0;
@@ -511,8 +404,11 @@ int sfs_open(const char *path, struct fuse_file_info *fi)
 
     log_msg("\nsfs_open(path\"%s\", fi=0x%08x)\n",path, fi);
 
-	checkInode.info.st_atime = time.tv_sec;
-	write_to_file(checkInode);
+	if(atime_due(&checkInode.info, time.tv_sec))
+	{
+		checkInode.info.st_atime = time.tv_sec;
+		write_times(checkInode);
+	}
 	log_msg("Open Success.\n");
 
 	if(checkInode.info.st_mode & S_IFMT != S_IFREG) //check if file is actually a regular file
@@ -523,6 +419,10 @@ int sfs_open(const char *path, struct fuse_file_info *fi)
 	lastOpFlag = checkInode.info.st_mode; //record file permissions
 	//fi->flags = checkInode.info.st_mode;
 	free(pathCopy);
+	open_file *of = (open_file*)calloc(1, sizeof(open_file)); //pins the inode and tracks sequential reads (file_readahead)
+	of->ino = checkInode.info.st_ino;
+	inode_pin(of->ino);
+	fi->fh = (uint64_t)(uintptr_t)of;
 	return retstat;    
 }
 
@@ -546,7 +446,38 @@ int sfs_release(const char *path, struct fuse_file_info *fi)
     log_msg("\nsfs_release(path=\"%s\", fi=0x%08x)\n",
 	  path, fi);
     
-	//nothing to do here; we don't use any heap-allocated structs
+	//drop the state set up in open/create
+	open_file *of = (open_file*)(uintptr_t)fi->fh;
+	if(of != NULL)
+	{
+		inode_unpin(of->ino);
+		free(of);
+	}
+	fi->fh = 0;
+
+    return retstat;
+}
+
+/** Synchronize file contents
+ *
+ * If the datasync parameter is non-zero, then only the user data
+ * should be flushed, not the meta data.
+ *
+ * Changed in version 2.2
+ */
+int sfs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    int retstat = 0;
+    log_msg("\nsfs_fsync(path=\"%s\", datasync=%d, fi=0x%08x)\n",
+	    path, datasync, fi);
+
+	//we don't track which blocks belong to which file, so push everything out
+	//(fdatasync can leave held-back timestamps where they are)
+	inode_sync(!datasync);
+	if(block_sync() < 0)
+	{
+		retstat = -EIO;
+	}
 
     return retstat;
 }
@@ -567,34 +498,6 @@ int sfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse
     int retstat = 0;
     log_msg("\nsfs_read(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n",path, buf, size, offset, fi);
 
-	char *tempPath = malloc(strlen(path)+1);
-	strcpy(tempPath, path);
-	inode sup = get_inode(tempPath, rootNode, 0);
-	free(tempPath);
-	lastOpFlag = sup.info.st_mode;
-
-	lastOpFlag &= S_IRUSR; //mask file mode to get read permissions
-
-	if(lastOpFlag == S_IRUSR)
-	{
-		//log_msg("[Read] Permission Validated.\n");
-	}
-
-	else if((fi->flags & S_IRUSR) == S_IRUSR)
-	{
-		log_msg("[Read] Permission Validated by FUSE Struct.\n");
-	}
-
-	else
-	{
-		log_msg("[Read] Invalid Permission. Actual: %d OR %d Expected: %d\n", lastOpFlag, (fi->flags & S_IRUSR), S_IRUSR);
-		return -EACCES; //permission denied
-	}
-
-	//char fPath[BUFF_SIZE];
-	char *fPath = (char*)malloc(strlen(path)+1);
-	strcpy(fPath, path);
-
 	if(size <= 0) //if request to read 0 bytes or a null pointer is passed
 	{
 		return 0; //0 bytes read
@@ -605,6 +508,10 @@ int sfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse
 		log_msg("[Read] NULL Buffer\n");
 		return -EFAULT;//Bad address
 	}
+
+	//resolve the path once; the inode serves both the permission check and the read
+	char *fPath = (char*)malloc(strlen(path)+1);
+	strcpy(fPath, path);
 	inode dummy;
 	inode start = get_inode("/", dummy, 0);
 	inode readNode = get_inode(fPath, start, 0);
@@ -616,13 +523,35 @@ int sfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse
 		return -ENOENT; //file not found
 	}
 
-	char *inodeString = get_buffer(readNode);
-	char *stringStart = inodeString;
+	lastOpFlag = readNode.info.st_mode;
+
+	lastOpFlag &= S_IRUSR; //mask file mode to get read permissions
+
+	if(lastOpFlag == S_IRUSR)
+	{
+		//log_msg("[Read] Permission Validated.\n");
+	}
+
+	else if((fi->flags & S_IRUSR) == S_IRUSR)
+	{
+		log_msg("[Read] Permission Validated by FUSE Struct.\n");
+	}
+
+	else
+	{
+		log_msg("[Read] Invalid Permission. Actual: %d OR %d Expected: %d\n", lastOpFlag, (fi->flags & S_IRUSR), S_IRUSR);
+		free(fPath);
+		return -EACCES; //permission denied
+	}
+
+	off_t bytes;
 
-	inodeString += offset;
-	int bytes;
+	if((bytes = readNode.info.st_size - offset) <= 0) //offset is at or past the end of the file
+	{
+		retstat = 0;
+	}
 
-	if((bytes = readNode.info.st_size - offset) >= size) //if file contains enough bytes to read number requested
+	else if(bytes >= (off_t)size) //if file contains enough bytes to read number requested
 	{
 		retstat = size; //read all requested bytes
 	}
@@ -633,10 +562,12 @@ int sfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse
 	}
 
 
-	memcpy(buf, inodeString, retstat); //TODO: according to man pages, no errors are defined for memcpy. Do we have to do any sanity checks here?
-	//log_msg("[Read] Free Incoming\n");
-	free(stringStart);
-	//log_msg("[Read] Free Successful\n");
+	if(retstat > 0 && fi->fh != 0)
+	{
+		file_readahead(&((open_file*)(uintptr_t)fi->fh)->ra, readNode, offset, retstat);
+	}
+
+	retstat = read_range(readNode, buf, offset, retstat);
 
 	//TODO:Document this
 	/*if((offset+size)  >= readNode.info.st_size)//if starting point + #bytes to read goes past size of file
@@ -666,11 +597,26 @@ int sfs_write(const char *path, const char *buf, size_t size, off_t offset,
     log_msg("\nsfs_write(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n",
 	    path, buf, size, offset, fi);
 
-	char *tempPath = malloc(strlen(path)+1);
-	strcpy(tempPath, path);
-	inode sup = get_inode(tempPath, rootNode, 0);
-	free(tempPath);
-	lastOpFlag = sup.info.st_mode;
+	if(buf == NULL)
+	{
+		log_msg("[Write] NULL Buffer\n");
+		return -EFAULT;
+	}
+
+	//resolve the path once; the inode serves both the permission check and the write
+	char *fPath = (char*)malloc(strlen(path)+1);
+	strcpy(fPath, path);
+	inode dummy;
+	inode start = get_inode("/", dummy, 0);
+	inode writeNode = get_inode(fPath, start, 0);
+	if(!fileFound)
+	{
+		free(fPath);
+		//log_msg("[Write] File Not Found\n");
+		return -ENOENT; //file not found
+	}
+
+	lastOpFlag = writeNode.info.st_mode;
 
 	//log_msg("[Write] buff:%s\n",buf);
 
@@ -690,80 +636,68 @@ int sfs_write(const char *path, const char *buf, size_t size, off_t offset,
 	else
 	{
 		log_msg("[Write] Invalid Permission. Actual: %d OR %d Expected: %d\n", lastOpFlag, (fi->flags & S_IWUSR), S_IWUSR);
+		free(fPath);
 		return -EACCES; //permission denied
 	}
 
+	inode before = writeNode; //to tell if only the mtime changes
+	off_t oldSize = writeNode.info.st_size;
+	off_t newSize = offset + (off_t)size > oldSize ? offset + (off_t)size : oldSize;
 
-	if(buf == NULL)
+	if((writeNode.flags & INODE_FL_INLINE) && newSize <= INODE_INLINE)
 	{
-		log_msg("[Write] NULL Buffer\n");
-		return -EFAULT;
+		//still fits: the inode is written back below
+		if(offset > oldSize)
+		{
+			memset(writeNode.inline_data + oldSize, 0, offset - oldSize);
+		}
+		memcpy(writeNode.inline_data + offset, buf, size);
+		retstat = size;
 	}
-
-	//char fPath[BUFF_SIZE];
-	char *fPath = (char*)malloc(strlen(path)+1);
-	strcpy(fPath, path);
-	inode dummy;
-	inode start = get_inode("/", dummy, 0);
-	inode writeNode = get_inode(fPath, start, 0);
-	if(!fileFound)
+	else
 	{
-		free(fPath);
-		//log_msg("[Write] File Not Found\n");
-		return -ENOENT; //file not found
-	}
-
-	char *inodeString = get_buffer(writeNode);
-	inodeString = (char*)realloc(inodeString, writeNode.info.st_size + offset + size);
+		if(writeNode.flags & INODE_FL_INLINE)
+		{
+			//outgrown, so it moves out to blocks like any other file
+			char held[INODE_INLINE_MAX];
+			memcpy(held, writeNode.inline_data, oldSize);
+			retstat = loopWrite(held, oldSize, &writeNode);
+		}
 
-	char *startString = inodeString;
-	inodeString += offset;
+		//a write past the end leaves zeroes, not whatever the blocks held before
+		if(retstat >= 0 && offset > oldSize)
+		{
+			retstat = zero_range(&writeNode, oldSize, offset - oldSize);
+			writeNode.info.st_size = retstat >= 0 ? offset : oldSize;
+		}
 
-	//log_msg("[Write] Now memcopying...\n");
-	memcpy(inodeString, buf, size);	
-	
-	//log_msg("[Write] Now writing...\n");
-	retstat = loopWrite(startString, &writeNode);
-	//log_msg("[Write] ...File Written\n");
+		if(retstat >= 0)
+		{
+			retstat = write_range(&writeNode, buf, offset, size);
+		}
+	}
 
 	//update inode modification time & size
 	struct timespec time;
 	clock_gettime(CLOCK_REALTIME, &time); 
 	writeNode.info.st_mtime = time.tv_sec;
 
-	//TODO: will we ever have to worry about file size decreasing?
-	if(retstat > 0)
-	{
-		int fSize = writeNode.info.st_size - offset; //get number of bytes remaining after offset
-
-		if(size > fSize)//if more bytes are written to file than current size of file, the file will expand in size
-		{
-			writeNode.info.st_size += (size - fSize); //increase file size by spillover bytes
-			int len;
-			if(writeNode.info.st_size % BLOCK_SIZE > 0)
-    		{
-				len = (writeNode.info.st_size/BLOCK_SIZE)+1;
-    		}
-    		else
-    		{
-				len = writeNode.info.st_size/BLOCK_SIZE;
-    		}
-			writeNode.info.st_blocks = len;
-		}
+	writeNode.info.st_size = retstat >= 0 ? newSize : oldSize;
+	writeNode.info.st_blocks = writeNode.flags & INODE_FL_INLINE ? 0 :
+		(writeNode.info.st_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
 
-		else
-		{
-			//part of file was overwritten, but the file has not grown. Nothing changes here
-		}
-		//log_msg("[Write] size:%d,offset:%d\n",writeNode.info.st_size,offset);
+	//an overwrite inside the blocks the file already has leaves the inode as it was
+	before.info.st_mtime = writeNode.info.st_mtime;
+	if(memcmp(&before, &writeNode, sizeof(inode)) == 0)
+	{
+		write_times(writeNode);
+	}
+	else
+	{
+		write_to_file(writeNode);
 	}
 
-	write_to_file(writeNode);
-
-	//log_msg("[Write] Free Incoming\n");
-	free(startString);
 	free(fPath);
-	//log_msg("[Write] Free Successful\n");
     return retstat; //restat for read/write contains number of bytes written/read in operation
 }
 
@@ -801,10 +735,7 @@ int sfs_mkdir(const char *path, mode_t mode)
 			return -ENOSPC;
 		}
 
-		char *currentBuffer, *parentBuffer;
-		asprintf(&parentBuffer, "%d\t%s\n", nodeIndex, fPath);
-		asprintf(&currentBuffer, "%d\t.\n", nodeIndex);
-
+		memset(&dirNode, 0, sizeof(dirNode));
 		dirNode.info.st_dev = 0;
     	dirNode.info.st_ino = nodeIndex;
     	dirNode.info.st_mode = S_IFDIR | mode; //directory with passed-in permissions
@@ -812,11 +743,12 @@ int sfs_mkdir(const char *path, mode_t mode)
     	dirNode.info.st_uid = getuid();
     	dirNode.info.st_gid = getgid();
     	dirNode.info.st_rdev = 0;
-    	dirNode.info.st_size = strlen(currentBuffer)+1;
+    	dirNode.info.st_size = 0; //blockIndex may hold an old directory; the "." entry below is the first thing in it
 		//log_msg("[mkdir] Directory size: %d\n", dirNode.info.st_size);
 		dirNode.info.st_blksize = BLOCK_SIZE;
 		dirNode.info.st_blocks = 1;
 		dirNode.direct[0] = blockIndex;
+		dirNode.flags = INODE_FL_DIRENT;
 
 		for(i = 1; i < 32; i++)
         {
@@ -836,18 +768,18 @@ int sfs_mkdir(const char *path, mode_t mode)
 
 		fileFound = 1;
 
-		//log_msg("[mkdir] About to write to parent directory: %s\n", parentBuffer);	
-		writeToDirectory(parentBuffer, MY_APPEND); //update parent directory
+		//log_msg("[mkdir] About to write to parent directory: %s\n", fPath);	
+		writeToDirectory(fPath, nodeIndex, dirNode.info.st_mode, MY_APPEND); //update parent directory
 
 		//log_msg("[mkdir] About to write new directory metadata\n");
 		write_to_file(dirNode); //write new inode to metadata region
 
-		//log_msg("[mkdir] About to write to this directory: %s\n", currentBuffer);
+		//log_msg("[mkdir] About to write to this directory: .\n");
 		parentNode = dirNode; //set parent directory to self to add dirNode to its own directory
-		writeToDirectory(currentBuffer, MY_APPEND); //update directory of self
+		writeToDirectory(".", nodeIndex, dirNode.info.st_mode, MY_APPEND); //update directory of self
 
 		//log_msg("[mkdir] Returning from mkdir\n");
-		free(parentBuffer); free(currentBuffer); free(pathStart);
+		free(pathStart);
 	}    
 
 
@@ -860,7 +792,6 @@ int sfs_mkdir(const char *path, mode_t mode)
 int sfs_rmdir(const char *path)
 {
     int retstat = 0;
-	int rmBlocks;
     log_msg("sfs_rmdir(path=\"%s\")\n",path);
 
 	char *fPath = (char*)malloc(strlen(path)+1);
@@ -869,38 +800,27 @@ int sfs_rmdir(const char *path)
 
 	inode dummy;
 	inode start = get_inode("/", dummy, 0);
+	inode dirNode = get_inode(fPath,start,0);
 
 	if(!fileFound)
 	{
 		//log_msg("[sfs_rmdir] File not found?\n");
+		free(fPath);
     	return -ENOENT;//file not found
 	}    
 
 	//log_msg("[sfs_rmdir] Removing nested stuff...\n");
-	removeSubDir(fPath,start);
+	removeSubDir(&dirNode);
 	//log_msg("[sfs_rmdir] Just removed nested stuff...\n");
 
-	inode dirNode = get_inode(fPath,start,0);
-
-	if(dirNode.info.st_size % BLOCK_SIZE > 0)
-    {
-		rmBlocks = (dirNode.info.st_size/BLOCK_SIZE)+1;
-    }
-    else
-    {
-		rmBlocks = dirNode.info.st_size/BLOCK_SIZE;
-    }
-  
 	//log_msg("[sfs_rmdir] Flipping bits...\n");
-	flipBit(dirNode.info.st_ino);
-	int i;
-	for(i=0;i<rmBlocks;i++)
-	{
-		flipBit(dirNode.direct[i]);
-	}
+	freeInode(dirNode.info.st_ino);
+	file_unmap(&dirNode);
+	dentry_purge(dirNode.info.st_ino);
+	dir_room_purge(dirNode.info.st_ino);
 
 	//log_msg("[sfs_rmdir] Finalizing in writeToDirectory...\n");
-	writeToDirectory(fPath, MY_DELETE);
+	writeToDirectory(fPath, 0, 0, MY_DELETE);
 
 	//log_msg("[sfs_rmdir] Just finalized in writeToDirectory...\n");
 	free(fPath);
@@ -985,28 +905,43 @@ int sfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offse
 
 	//TODO: check read permission
 
-	char* inodeAsString = get_buffer(myInode);
-    log_msg("after get buffer\n");
-	if (inodeAsString == NULL)
+	char *blk = (char*)malloc(BLOCK_SIZE);
+	char myName[DIRENT_NAME_MAX + 1];
+	int b, off, here;
+	off_t next;
+	dir_entry *d;
+
+	if(blk == NULL)
 	{
-		return retstat;
+		return -ENOMEM;
 	}
-	char* myFree = inodeAsString;
-	char* token = strtok(inodeAsString,"\n");
-	log_msg("after first strtok\n");
-	while(token != NULL)
+
+	//mode 2 above: an entry's offset is where the record after it starts.
+	//Records stay where they are as others come and go (see dir_entry), so
+	//a listing picks up at offset, reading only the blocks from there on.
+	memset(&fillMe, 0, sizeof(fillMe));
+	for(b = offset / BLOCK_SIZE; b < myInode.info.st_size / BLOCK_SIZE && dir_block(myInode, b, blk) == 0; b++)
 	{
-		char* myName=strstr(token,"\t")+1;
-		if(filler(buf,myName,&fillMe,0) != 0)
+		for(off = here = 0; (d = dirent_next(blk, &off)) != NULL; here = off)
 		{
-			free(myFree);
-			return -ENOMEM;
+			next = (off_t)b * BLOCK_SIZE + off;
+			if(d->ino == 0 || (off_t)b * BLOCK_SIZE + here < offset)
+			{
+				continue; //unused, or listed already
+			}
+			memcpy(myName, d->name, d->name_len);
+			myName[d->name_len] = '\0';
+			fillMe.st_ino = le32toh(d->ino);
+			fillMe.st_mode = d->type << 12; //back from DT_* to the S_IFMT bits
+			if(filler(buf,myName,&fillMe,next) != 0)
+			{
+				free(blk);
+				return retstat; //buffer full, the next call carries on from the last offset it took
+			}
 		}
-		token = strtok(NULL,"\n");
     }
+    free(blk);
     log_msg("after while loop\n");
-	free(myFree);
-	log_msg("after freeing\n");
     return retstat;
 }
 
@@ -1034,6 +969,7 @@ struct fuse_operations sfs_oper = {
   .release = sfs_release,
   .read = sfs_read,
   .write = sfs_write,
+  .fsync = sfs_fsync,
 
   .rmdir = sfs_rmdir,
   .mkdir = sfs_mkdir,
@@ -1045,19 +981,172 @@ struct fuse_operations sfs_oper = {
 
 void sfs_usage()
 {
-    fprintf(stderr, "usage:  sfs [FUSE and mount options] diskFile mountPoint\n");
+    fprintf(stderr, "usage:  sfs [FUSE and mount options] [sfs options] diskFile[,diskFile...] mountPoint\n");
+    fprintf(stderr, "sfs options:\n");
+    fprintf(stderr, "    --cache=N    keep up to N blocks in the write-back cache (default %d, 0 = off)\n", BLOCK_CACHE_DEFAULT);
+    fprintf(stderr, "    --inode-cache=N  keep up to N inodes in memory (default %d, 0 = off)\n", INODE_CACHE_DEFAULT);
+    fprintf(stderr, "    --dentry-cache=N keep up to N name lookups, found or not, in memory (default %d, 0 = off)\n", DENTRY_CACHE_DEFAULT);
+    fprintf(stderr, "    --io=TYPE    disk I/O backend: pread (default), uring or mmap\n");
+    fprintf(stderr, "    --direct     open the disk O_DIRECT, bypassing the host page cache\n");
+    fprintf(stderr, "    --block-size=N  block size for a new filesystem, a power of two from %d to %d (default %d)\n",
+	    BLOCK_SIZE_MIN, BLOCK_SIZE_MAX, BLOCK_SIZE_DEFAULT);
+    fprintf(stderr, "    --size=N[K|M|G|T]  size of a new filesystem's image (default %dM)\n", SYSTEM_SIZE / (1024 * 1024));
+    fprintf(stderr, "    --inodes=N   size of the inode table of a new filesystem (default %d)\n", INODE_COUNT_DEFAULT);
+    fprintf(stderr, "    --inode-size=N  bytes per inode of a new filesystem, a power of two from %d to %d (default %d);\n"
+	    "                    files up to N-76 bytes are kept in the inode itself\n", INODE_SIZE, INODE_SIZE_MAX, INODE_SIZE);
+    fprintf(stderr, "    --checksums  give a new filesystem a CRC32C per block, checked on every disk read\n");
+    fprintf(stderr, "    --flush-interval=MS  how often the flusher thread writes back old dirty blocks (default %d, 0 = no flusher)\n", BLOCK_FLUSH_INTERVAL);
+    fprintf(stderr, "    --dirty-expire=MS    how long a block may stay dirty before the flusher writes it (default %d)\n", BLOCK_DIRTY_EXPIRE);
+    fprintf(stderr, "    --dirty-ratio=PCT    wake the flusher once this much of the cache is dirty (default %d)\n", BLOCK_DIRTY_RATIO);
+    fprintf(stderr, "    --relatime   only update a file's access time when it is older than its modification or change time, or a day old\n");
+    fprintf(stderr, "    --lazytime   keep access and modification time updates in memory until the inode is written for another\n"
+	    "                 reason, evicted, synced, or has held them for %d hours\n", LAZYTIME_EXPIRE / 3600);
+    fprintf(stderr, "    --stripe-width=N     with several diskFiles, stripe the filesystem over them N blocks at a time (default %d)\n", BLOCK_STRIPE_WIDTH);
     abort();
 }
 
-int main(int argc, char *argv[])
+//a byte count with an optional K, M, G or T suffix (powers of 1024)
+static long long parse_size(const char *s)
 {
+    char *end;
+    long long n = strtoll(s, &end, 10);
 
-    int fuse_stat;
+    switch(*end) //each case falls through to the next
+    {
+    case 'T': case 't': n *= 1024;
+    case 'G': case 'g': n *= 1024;
+    case 'M': case 'm': n *= 1024;
+    case 'K': case 'k': n *= 1024;
+    }
+    return n;
+}
+
+//Pull our own --options out of argv so fuse_main never sees them
+void sfs_options(int *argc, char *argv[], struct sfs_state *sfs_data)
+{
+    int i, j = 1;
+
+    sfs_data->cache_blocks = BLOCK_CACHE_DEFAULT;
+    sfs_data->inode_cache = INODE_CACHE_DEFAULT;
+    sfs_data->dentry_cache = DENTRY_CACHE_DEFAULT;
+    sfs_data->io_backend = BLOCK_IO_PREAD;
+    sfs_data->direct_io = 0;
+    sfs_data->block_size = BLOCK_SIZE_DEFAULT;
+    sfs_data->checksums = 0;
+    sfs_data->flush_interval = BLOCK_FLUSH_INTERVAL;
+    sfs_data->dirty_expire = BLOCK_DIRTY_EXPIRE;
+    sfs_data->dirty_ratio = BLOCK_DIRTY_RATIO;
+    sfs_data->stripe_width = 0;
+    sfs_data->inode_count = 0;
+    sfs_data->inode_size = 0;
+    sfs_data->image_size = 0;
+    sfs_data->relatime = 0;
+    sfs_data->lazytime = 0;
+
+    for(i = 1; i < *argc; i++)
+    {
+	if(strncmp(argv[i], "--size=", 7) == 0)
+	{
+	    sfs_data->image_size = parse_size(argv[i] + 7);
+	    continue;
+	}
+	if(strncmp(argv[i], "--inode-size=", 13) == 0)
+	{
+	    sfs_data->inode_size = atoi(argv[i] + 13);
+	    continue;
+	}
+	if(strncmp(argv[i], "--inode-cache=", 14) == 0)
+	{
+	    sfs_data->inode_cache = atoi(argv[i] + 14);
+	    continue;
+	}
+	if(strncmp(argv[i], "--dentry-cache=", 15) == 0)
+	{
+	    sfs_data->dentry_cache = atoi(argv[i] + 15);
+	    continue;
+	}
+	if(strncmp(argv[i], "--cache=", 8) == 0)
+	{
+	    sfs_data->cache_blocks = atoi(argv[i] + 8);
+	    continue;
+	}
+	if(strcmp(argv[i], "--io=uring") == 0)
+	{
+	    sfs_data->io_backend = BLOCK_IO_URING;
+	    continue;
+	}
+	if(strcmp(argv[i], "--io=mmap") == 0)
+	{
+	    sfs_data->io_backend = BLOCK_IO_MMAP;
+	    continue;
+	}
+	if(strcmp(argv[i], "--io=pread") == 0)
+	{
+	    sfs_data->io_backend = BLOCK_IO_PREAD;
+	    continue;
+	}
+	if(strncmp(argv[i], "--block-size=", 13) == 0)
+	{
+	    sfs_data->block_size = atoi(argv[i] + 13);
+	    continue;
+	}
+	if(strncmp(argv[i], "--flush-interval=", 17) == 0)
+	{
+	    sfs_data->flush_interval = atoi(argv[i] + 17);
+	    continue;
+	}
+	if(strncmp(argv[i], "--dirty-expire=", 15) == 0)
+	{
+	    sfs_data->dirty_expire = atoi(argv[i] + 15);
+	    continue;
+	}
+	if(strncmp(argv[i], "--dirty-ratio=", 14) == 0)
+	{
+	    sfs_data->dirty_ratio = atoi(argv[i] + 14);
+	    continue;
+	}
+	if(strncmp(argv[i], "--inodes=", 9) == 0)
+	{
+	    sfs_data->inode_count = atoi(argv[i] + 9);
+	    continue;
+	}
+	if(strncmp(argv[i], "--stripe-width=", 15) == 0)
+	{
+	    sfs_data->stripe_width = atoi(argv[i] + 15);
+	    continue;
+	}
+	if(strcmp(argv[i], "--checksums") == 0)
+	{
+	    sfs_data->checksums = 1;
+	    continue;
+	}
+	if(strcmp(argv[i], "--direct") == 0)
+	{
+	    sfs_data->direct_io = 1;
+	    continue;
+	}
+	if(strcmp(argv[i], "--relatime") == 0)
+	{
+	    sfs_data->relatime = 1;
+	    continue;
+	}
+	if(strcmp(argv[i], "--lazytime") == 0)
+	{
+	    sfs_data->lazytime = 1;
+	    continue;
+	}
+	argv[j++] = argv[i];
+    }
+
+    argv[j] = NULL;
+    *argc = j;
+}
+
+int main(int argc, char *argv[])
+{
+
+    int fuse_stat;
     struct sfs_state *sfs_data;
-    
-    // sanity checking on the command line
-    if ((argc < 3) || (argv[argc-2][0] == '-') || (argv[argc-1][0] == '-'))
-	sfs_usage();
 
     sfs_data = malloc(sizeof(struct sfs_state));
     if (sfs_data == NULL) {
@@ -1065,6 +1154,12 @@ int main(int argc, char *argv[])
 	abort();
     }
 
+    sfs_options(&argc, argv, sfs_data);
+
+    // sanity checking on the command line
+    if ((argc < 3) || (argv[argc-2][0] == '-') || (argv[argc-1][0] == '-'))
+	sfs_usage();
+
     // Pull the diskfile and save it in internal data
     sfs_data->diskfile = argv[argc-2];
     argv[argc-2] = argv[argc-1];
@@ -1083,44 +1178,33 @@ int main(int argc, char *argv[])
 
 void setMetadata()
 {
-	char superBuffer[4095];
-
-    superBuffer[0] = 0x7f;
-
 	int i;
-	for(i = 1; i < 4094; i++)
-	{
-		superBuffer[i] = 0xff;
-	}
-
-	superBuffer[64] = 0x7f;
+	unsigned char *superBuffer = (unsigned char*)malloc(layout.super_blocks * BLOCK_SIZE);
+	memset(superBuffer, 0xff, layout.super_blocks * BLOCK_SIZE);
 
-	int stat;
-	char readbuff[BLOCK_SIZE];
-	
-	for(i = 0; i < 8; i++)
-	{
-		stat = block_write(i, (superBuffer + (i * BLOCK_SIZE)));
-		//log_msg("[setMetadata] Wrote super to block %d.\tStatus: %d\n", i, stat);
-		stat = block_read(i, readbuff);
-		//log_msg("[setMetadata] Read super section from file: %s.\tStatus: %d\n", readbuff, stat);
-		bzero(readbuff, BLOCK_SIZE);
-	}
+	//header first, then every inode and data block free except the root's
+	write_header(superBuffer);
+	superBuffer[layout.inode_map_off] = 0x7f;
+	superBuffer[layout.data_map_off] = 0x7f;
 
+	write_super((char*)superBuffer);
+	free(superBuffer);
 
     //fill in root inode
     inode root_inode;
+    memset(&root_inode, 0, sizeof(root_inode));
     root_inode.info.st_dev = 0;
-    root_inode.info.st_ino = INODE_START;
+    root_inode.info.st_ino = ROOT_INO;
     root_inode.info.st_mode = S_IFDIR | S_IRWXU | S_IRWXG | S_IRWXO; //give root EVERYTHING
     root_inode.info.st_nlink = 1;
     root_inode.info.st_uid = getuid();
     root_inode.info.st_gid = getgid();
     root_inode.info.st_rdev = 0;
-    root_inode.info.st_size = 5; //see string in init()
+    root_inode.info.st_size = BLOCK_SIZE; //just "." (see init())
 	root_inode.info.st_blksize = BLOCK_SIZE;
 	root_inode.info.st_blocks = 1;
     root_inode.direct[0] = DATA_START;
+    root_inode.flags = INODE_FL_DIRENT;
 
     for(i = 1; i < 32; i++)
     {
@@ -1147,6 +1231,349 @@ void setMetadata()
     currentNode = root_inode;
 }
 
+/*
+ * Dentry cache
+ *
+ * Maps (directory inode, name) to the inode number found there, or to -1
+ * for a name known not to be there, so a path resolved or probed for
+ * recently is resolved again without reading any directory.  dir_find
+ * fills it in, writeToDirectory keeps it right as entries are added and
+ * removed, and a removed directory's entries are purged, since its inode
+ * number can come back as a new directory.  Names longer than
+ * DENTRY_NAME_MAX aren't cached.  Laid out like the inode cache: one
+ * array, hash chains and an LRU list, all under dcache_lock, which is
+ * never held while calling anything else.
+ */
+typedef struct dentry
+{
+    int dir; //0 while the entry is unused
+    int ino; //-1: negative entry
+    unsigned int hash;
+    char name[DENTRY_NAME_MAX + 1];
+    struct dentry *hash_next;
+    struct dentry *lru_prev, *lru_next;
+} dentry;
+
+static dentry *dcache = NULL;
+static dentry **dcache_hash = NULL;
+static int dcache_size = 0;
+static dentry *dcache_head = NULL, *dcache_tail = NULL;
+static pthread_mutex_t dcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int dcache_key(int dir, const char *name)
+{
+    return crc32c(dir, name, strlen(name));
+}
+
+static void dcache_unlink(dentry *d)
+{
+    if(d->lru_prev) d->lru_prev->lru_next = d->lru_next; else dcache_head = d->lru_next;
+    if(d->lru_next) d->lru_next->lru_prev = d->lru_prev; else dcache_tail = d->lru_prev;
+}
+
+static void dcache_push_front(dentry *d)
+{
+    d->lru_prev = NULL;
+    d->lru_next = dcache_head;
+    if(dcache_head) dcache_head->lru_prev = d; else dcache_tail = d;
+    dcache_head = d;
+}
+
+static void dcache_push_back(dentry *d)
+{
+    d->lru_next = NULL;
+    d->lru_prev = dcache_tail;
+    if(dcache_tail) dcache_tail->lru_next = d; else dcache_head = d;
+    dcache_tail = d;
+}
+
+static void dcache_unhash(dentry *d)
+{
+    dentry **pp = &dcache_hash[d->hash % dcache_size];
+
+    while(*pp != d)
+    {
+	pp = &(*pp)->hash_next;
+    }
+    *pp = d->hash_next;
+}
+
+static dentry *dcache_find(int dir, const char *name, unsigned int hash)
+{
+    dentry *d;
+
+    for(d = dcache_hash[hash % dcache_size]; d != NULL; d = d->hash_next)
+    {
+	if(d->dir == dir && d->hash == hash && strcmp(d->name, name) == 0)
+	{
+	    dcache_unlink(d);
+	    dcache_push_front(d);
+	    return d;
+	}
+    }
+    return NULL;
+}
+
+int dentry_cache_init(int n)
+{
+    int i;
+
+    pthread_mutex_lock(&dcache_lock);
+    free(dcache);
+    free(dcache_hash);
+    dcache = NULL;
+    dcache_hash = NULL;
+    dcache_head = dcache_tail = NULL;
+    dcache_size = 0;
+
+    if(n > 0)
+    {
+	dcache = (dentry*)calloc(n, sizeof(dentry));
+	dcache_hash = (dentry**)calloc(n, sizeof(dentry*));
+	if(dcache == NULL || dcache_hash == NULL)
+	{
+	    free(dcache);
+	    free(dcache_hash);
+	    dcache = NULL;
+	    dcache_hash = NULL;
+	    pthread_mutex_unlock(&dcache_lock);
+	    return -1;
+	}
+	dcache_size = n;
+	for(i = 0; i < n; i++)
+	{
+	    dcache_push_back(&dcache[i]);
+	}
+    }
+    pthread_mutex_unlock(&dcache_lock);
+
+    log_msg("Dentry cache: %d entries\n", n);
+    return 0;
+}
+
+//1 and the inode number (-1 for a negative entry) in *ino if name in dir is cached
+static int dcache_lookup(int dir, const char *name, int *ino)
+{
+    dentry *d = NULL;
+
+    pthread_mutex_lock(&dcache_lock);
+    if(dcache_size > 0 && strlen(name) <= DENTRY_NAME_MAX)
+    {
+	d = dcache_find(dir, name, dcache_key(dir, name));
+	if(d != NULL)
+	{
+	    *ino = d->ino;
+	}
+    }
+    pthread_mutex_unlock(&dcache_lock);
+    return d != NULL;
+}
+
+//remember that name in dir is ino, or isn't there if ino is -1
+static void dcache_set(int dir, const char *name, int ino)
+{
+    unsigned int hash;
+    dentry *d;
+
+    if(strlen(name) > DENTRY_NAME_MAX)
+    {
+	return;
+    }
+
+    pthread_mutex_lock(&dcache_lock);
+    if(dcache_size > 0)
+    {
+	hash = dcache_key(dir, name);
+	d = dcache_find(dir, name, hash);
+	if(d == NULL)
+	{
+	    //take the least recently used entry
+	    d = dcache_tail;
+	    if(d->dir != 0)
+	    {
+		dcache_unhash(d);
+	    }
+	    d->dir = dir;
+	    d->hash = hash;
+	    strcpy(d->name, name);
+	    d->hash_next = dcache_hash[hash % dcache_size];
+	    dcache_hash[hash % dcache_size] = d;
+	    dcache_unlink(d);
+	    dcache_push_front(d);
+	}
+	d->ino = ino;
+    }
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+//forget everything cached under directory dir
+void dentry_purge(int dir)
+{
+    int i;
+
+    pthread_mutex_lock(&dcache_lock);
+    for(i = 0; i < dcache_size; i++)
+    {
+	if(dcache[i].dir == dir)
+	{
+	    dcache_unhash(&dcache[i]);
+	    dcache[i].dir = 0;
+	    dcache_unlink(&dcache[i]);
+	    dcache_push_back(&dcache[i]);
+	}
+    }
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+static int dirent_len(const dir_entry *d)
+{
+    int len = le16toh(d->rec_len);
+
+    return len > 0 ? len : BLOCK_SIZE_MAX;
+}
+
+static void dirent_set_len(dir_entry *d, int len)
+{
+    d->rec_len = htole16(len < BLOCK_SIZE_MAX ? len : 0);
+}
+
+//fill in the record at d, rec_len bytes long, for name (len bytes) as inode ino of the given mode
+void dirent_set(dir_entry *d, int rec_len, int ino, const char *name, int len, mode_t mode)
+{
+    d->ino = htole32(ino);
+    dirent_set_len(d, rec_len);
+    d->name_len = len;
+    d->type = (mode & S_IFMT) >> 12; //DT_* are the S_IFMT bits shifted down
+    memcpy(d->name, name, len);
+}
+
+//the record at *off in directory block blk, moving *off on to the next; NULL at the end of the block or a bad record
+dir_entry *dirent_next(char *blk, int *off)
+{
+    dir_entry *d;
+
+    if(*off + DIRENT_HEADER > BLOCK_SIZE)
+    {
+	return NULL;
+    }
+    d = (dir_entry*)(blk + *off);
+    if(dirent_len(d) < DIRENT_LEN(d->name_len) || *off + dirent_len(d) > BLOCK_SIZE)
+    {
+	return NULL;
+    }
+    *off += dirent_len(d);
+    return d;
+}
+
+//read block b of directory dir into blk
+int dir_block(inode dir, int b, char *blk)
+{
+    int n = file_block(dir, b);
+
+    return n > 0 && block_read(n, blk) >= 0 ? 0 : -1;
+}
+
+//inode number of name in directory dir, -1 if it isn't there
+static int dir_find(inode dir, const char *name)
+{
+    char *blk;
+    int ino, b, off, len = strlen(name);
+    dir_entry *d;
+
+    if(dcache_lookup(dir.info.st_ino, name, &ino))
+    {
+	return ino;
+    }
+
+    ino = dir_index_find(dir, name);
+    if(ino != -2)
+    {
+	dcache_set(dir.info.st_ino, name, ino);
+	return ino;
+    }
+
+    if((blk = (char*)malloc(BLOCK_SIZE)) == NULL)
+    {
+	return -1; //not remembered, so a later lookup tries again
+    }
+    ino = -1;
+    for(b = 0; ino < 0 && b < dir.info.st_size / BLOCK_SIZE && dir_block(dir, b, blk) == 0; b++)
+    {
+	for(off = 0; (d = dirent_next(blk, &off)) != NULL; )
+	{
+	    if(d->ino != 0 && d->name_len == len && memcmp(d->name, name, len) == 0)
+	    {
+		ino = le32toh(d->ino);
+		break;
+	    }
+	}
+    }
+    free(blk);
+
+    dcache_set(dir.info.st_ino, name, ino);
+    if(ino < 0 && dir.info.st_size > BLOCK_SIZE)
+    {
+	dir_index_rebuild(dir.info.st_ino); //the scan cost as much as this
+    }
+    return ino;
+}
+
+/** Attributes of the file at path
+ *
+ * The directories on the way are read in full, since their entries are
+ * needed, but the file itself only has its stat fields decoded (see
+ * read_attr).  Returns 0, or -ENOENT.
+ */
+int get_attr(char *path, struct stat *st)
+{
+    char *copy, *name;
+    inode dir, dummy;
+    int ino, len;
+
+    if(strcmp(path, "/") == 0)
+    {
+	read_attr(ROOT_INO, st);
+	return 0;
+    }
+
+    copy = (char*)malloc(strlen(path) + 1);
+    strcpy(copy, path);
+    len = strlen(copy);
+    if(len > 1 && copy[len-1] == '/')
+    {
+	copy[len-1] = '\0';
+    }
+
+    name = strrchr(copy, '/');
+    if(name == NULL || name == copy)
+    {
+	dir = get_inode("/", dummy, 0);
+	name = name == NULL ? copy : name + 1;
+    }
+    else
+    {
+	*name++ = '\0';
+	dir = get_inode(copy, get_inode("/", dummy, 0), 0);
+	if(!fileFound)
+	{
+	    free(copy);
+	    return -ENOENT;
+	}
+    }
+
+    ino = dir_find(dir, name);
+    free(copy);
+    if(ino < 0)
+    {
+	fileFound = 0;
+	return -ENOENT;
+    }
+
+    fileFound = 1;
+    read_attr(ino, st);
+    return 0;
+}
+
 inode get_inode(char *path, inode this_inode,int depth)
 {
     //TODO: L: I'll make this recursive for now, we'll see if we can change that later
@@ -1159,7 +1586,7 @@ inode get_inode(char *path, inode this_inode,int depth)
     //log_msg("[get_inode] Path in get_inode: %s\n", path);
 	if(strcmp(path, "/") == 0)
     {
-		rootNode = read_from_file(8);
+		rootNode = read_from_file(ROOT_INO);
 		parentNode = rootNode;
     	return rootNode;
     }
@@ -1186,47 +1613,20 @@ inode get_inode(char *path, inode this_inode,int depth)
 		//log_msg("[get_inode] Searching for file '%s'.\n", path);
 		//TODO: read directory here, get inode
 
-		char *bufferTgt = get_buffer(this_inode);
-		char *buffTgtStart = bufferTgt;
-		//log_msg("[get_inode] get_buffer just returned:%s\n",bufferTgt);
-        //parse string to find filename
-        char *tokenTgt = strtok(bufferTgt, "\n");
-        char *fnameTgt;
-        char inumTgt[4]; //max size
-        int tgtNodeTgt;
-        int stroffsetTgt;
-
-        while(tokenTgt != NULL)
-        {
-	    //need to manually tokenize here; can't re-call strtok on new string (STATEFUL)
-	        fnameTgt = strstr(tokenTgt, "\t")+1;
-	        if(strcmp(path, fnameTgt) == 0)//file found
-	        {
-		        //log_msg("[get_inode] fnameTgt: %s",fnameTgt);
-	            stroffsetTgt = fnameTgt - tokenTgt - 1;
-	            tokenTgt[stroffsetTgt] = '\0';
-	            strcpy(inumTgt, tokenTgt);
-	            tgtNodeTgt = atoi(inumTgt);
-	            tgt = read_from_file(tgtNodeTgt);
-				//log_msg("[get_inode] just read from file\n");
-	            break;
-	        }
-	        tokenTgt = strtok(NULL, "\n");
-        }
-
-        if (tokenTgt == NULL)
+		int tgtNodeTgt = dir_find(this_inode, path);
+        if (tgtNodeTgt < 0)
         {
             //log_msg("[get_inode] Failed to find inode with path: %s\n",path);
 	        fileFound = 0;
         }
-
-		//log_msg("[get_inode] freeing buffer...\n");
-        free(buffTgtStart);
-		//log_msg("[get_inode] freed buffer...\n");
+        else
+        {
+	        tgt = read_from_file(tgtNodeTgt);
+        }
 
 		if (depth == 0)
 		{
-			rootNode = read_from_file(8);
+			rootNode = read_from_file(ROOT_INO);
 			parentNode = rootNode;
 		}
 
@@ -1252,840 +1652,3360 @@ inode get_inode(char *path, inode this_inode,int depth)
     
     //log_msg("[get_inode] Searching for folder '%s' [name size %d] in path '%s'.\n", filename, i, path);
 
-    char *buffer = get_buffer(this_inode);
-
-    //parse string to find filename
-    char *token = strtok(buffer, "\n");
-    char *fname;
-    char inum[4]; //max size
-    int tgtNode;
-    int stroffset;
-
-    while(token != NULL)
-    {
-	//need to manually tokenize here; can't re-call strtok on new string (STATEFUL)
-	fname = strstr(token, "\t")+1;
-	if(strcmp(filename, fname) == 0)//file found
-	{
-	    stroffset = fname - token - 1;
-	    token[stroffset] = '\0';
-	    strcpy(inum, token);
-	    tgtNode = atoi(inum);
-	    tgt = read_from_file(tgtNode);
-	    break;
-	}
-	token = strtok(NULL, "\n");
-    }
-
-    if (token == NULL)
+    int tgtNode = dir_find(this_inode, filename);
+    if (tgtNode < 0)
     {
         log_msg("Failed to find inode with path: %s\n",path);
 	fileFound = 0;
 	return tgt;
     }
 
-    free(buffer);
+    tgt = read_from_file(tgtNode);
     log_msg("[get_inode] Newpath is %s\n and tgt is %i", newpath, tgt.info.st_ino);
 	parentNode = tgt;
 	//log_msg("~~End of [get_inode]~~\n");
     return get_inode(newpath, tgt, depth+1);
 }
 
-void write_to_file(inode insert_inode)
+//split inline bytes around the flags word in the slot at buf (see INODE_FL_INLINE); toSlot says which way
+static void inline_copy(unsigned char *buf, unsigned char *data, int len, int toSlot)
 {
-    char *rootString;
-
-    asprintf(&rootString, "%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t", insert_inode.info.st_dev, insert_inode.info.st_ino, insert_inode.info.st_mode, insert_inode.info.st_nlink, insert_inode.info.st_uid, insert_inode.info.st_gid, insert_inode.info.st_rdev, insert_inode.info.st_size, insert_inode.direct[0], insert_inode.direct[1], insert_inode.direct[2], insert_inode.direct[3], insert_inode.direct[4], insert_inode.direct[5], insert_inode.direct[6], insert_inode.direct[7], insert_inode.direct[8], insert_inode.direct[9], insert_inode.direct[10], insert_inode.direct[11], insert_inode.direct[12],insert_inode.direct[13],insert_inode.direct[14],insert_inode.direct[15],insert_inode.direct[16],insert_inode.direct[17],insert_inode.direct[18],insert_inode.direct[19],insert_inode.direct[20],insert_inode.direct[21],insert_inode.direct[22],insert_inode.direct[23],insert_inode.direct[24],insert_inode.direct[25],insert_inode.direct[26],insert_inode.direct[27],insert_inode.direct[28],insert_inode.direct[29],insert_inode.direct[30],insert_inode.direct[31],insert_inode.indirect[0], insert_inode.indirect[1], insert_inode.info.st_atime, insert_inode.info.st_mtime, insert_inode.info.st_ctime, insert_inode.info.st_blksize, insert_inode.info.st_blocks);
+    int head = offsetof(disk_inode, flags) - offsetof(disk_inode, map);
+    unsigned char *parts[2] = {buf + offsetof(disk_inode, map), buf + offsetof(disk_inode, ext_count)};
+    int i, n;
 
-    int bstat = block_write(insert_inode.info.st_ino , rootString);
-    
-    if(bstat < 0)
+    for(i = 0; i < 2 && len > 0; i++)
     {
-		log_msg("Failed to write inode %d to file.\n", insert_inode.info.st_ino);
+	n = i == 0 && len > head ? head : len;
+	if(toSlot)
+	{
+	    memcpy(parts[i], data, n);
+	}
+	else
+	{
+	    memcpy(data, parts[i], n);
+	}
+	data += n;
+	len -= n;
     }
-
-    free(rootString);
 }
 
-
-inode read_from_file(int node)
+static void encode_inode(const inode *node, unsigned char *buf)
 {
-    inode testnode;
+    disk_inode d;
     int i;
 
-    char buf[BUFF_SIZE];
-    int bstat = block_read(node, buf);
-    if(bstat < 0)
+    memset(&d, 0, sizeof(d));
+    d.magic = htole16(INODE_MAGIC);
+    d.version = htole16(INODE_VERSION);
+    d.dev = htole32(node->info.st_dev);
+    d.ino = htole32(node->info.st_ino);
+    d.mode = htole32(node->info.st_mode);
+    d.nlink = htole32(node->info.st_nlink);
+    d.uid = htole32(node->info.st_uid);
+    d.gid = htole32(node->info.st_gid);
+    d.rdev = htole32(node->info.st_rdev);
+    d.size = htole64(node->info.st_size);
+    d.atime = htole64(node->info.st_atime);
+    d.mtime = htole64(node->info.st_mtime);
+    d.ctime = htole64(node->info.st_ctime);
+    d.blksize = htole32(node->info.st_blksize);
+    d.blocks = htole32(node->info.st_blocks);
+    for(i = 0; i < DIRECT_COUNT; i++)
     {
-		log_msg("Failed to read from node %d.\n", node);
+	if(layout.ptr_size == 4)
+	{
+	    d.map.p32.direct[i] = htole32(node->direct[i]);
+	}
+	else
+	{
+	    d.map.p16.direct[i] = htole16(node->direct[i]);
+	}
+    }
+    for(i = 0; i < 2; i++)
+    {
+	if(layout.ptr_size == 4)
+	{
+	    d.map.p32.indirect[i] = htole32(node->indirect[i]);
+	}
+	else
+	{
+	    d.map.p16.indirect[i] = htole16(node->indirect[i]);
+	}
+    }
+    d.flags = htole32(node->flags);
+    d.ext_count = htole16(node->ext_count);
+    d.ext_depth = htole16(node->ext_depth);
+    for(i = 0; i < node->ext_count; i++)
+    {
+	d.ext[i][0] = htole32(node->ext[i].logical);
+	d.ext[i][1] = htole32(node->ext[i].physical);
+	d.ext[i][2] = htole32(node->ext[i].length);
     }
 
-    char *token = strtok(buf, "\t");
-
-    testnode.info.st_dev = atoi(token);
+    memcpy(buf, &d, sizeof(d));
+    if(node->flags & INODE_FL_INLINE)
+    {
+	inline_copy(buf, (unsigned char*)node->inline_data, node->info.st_size < INODE_INLINE ? node->info.st_size : INODE_INLINE, 1);
+    }
+}
+
+//the stat fields only, from the record's first INODE_ATTR_BYTES; returns -1 if buf doesn't hold a binary inode
+static int decode_inode_attr(const unsigned char *buf, inode *node)
+{
+    disk_inode d;
+
+    memcpy(&d, buf, INODE_ATTR_BYTES);
+    if(le16toh(d.magic) != INODE_MAGIC || le16toh(d.version) < 1 || le16toh(d.version) > INODE_VERSION)
+    {
+	return -1;
+    }
+
+    memset(&node->info, 0, sizeof(node->info));
+    node->info.st_dev = le32toh(d.dev);
+    node->info.st_ino = le32toh(d.ino);
+    node->info.st_mode = le32toh(d.mode);
+    node->info.st_nlink = le32toh(d.nlink);
+    node->info.st_uid = le32toh(d.uid);
+    node->info.st_gid = le32toh(d.gid);
+    node->info.st_rdev = le32toh(d.rdev);
+    node->info.st_size = le64toh(d.size);
+    node->info.st_atime = le64toh(d.atime);
+    node->info.st_mtime = le64toh(d.mtime);
+    node->info.st_ctime = le64toh(d.ctime);
+    node->info.st_blksize = le32toh(d.blksize);
+    node->info.st_blocks = le32toh(d.blocks);
+    return 0;
+}
+
+//the block map, extents or inline data of a record decode_inode_attr has accepted
+static void decode_inode_map(const unsigned char *buf, inode *node)
+{
+    disk_inode d;
+    int i;
+
+    memcpy(&d, buf, sizeof(d));
+    memset((char*)node + offsetof(inode, direct), 0, sizeof(*node) - offsetof(inode, direct));
+    for(i = 0; i < DIRECT_COUNT; i++)
+    {
+	node->direct[i] = layout.ptr_size == 4 ? le32toh(d.map.p32.direct[i]) : le16toh(d.map.p16.direct[i]);
+    }
+    for(i = 0; i < 2; i++)
+    {
+	node->indirect[i] = layout.ptr_size == 4 ? le32toh(d.map.p32.indirect[i]) : le16toh(d.map.p16.indirect[i]);
+    }
+    if(le16toh(d.version) < 2)
+    {
+	return; //no flags or extents
+    }
+
+    node->flags = le32toh(d.flags);
+    if(le16toh(d.version) >= 3 && (node->flags & INODE_FL_INLINE))
+    {
+	//the mapping fields hold data
+	memset(node->direct, 0, sizeof(node->direct));
+	memset(node->indirect, 0, sizeof(node->indirect));
+	inline_copy((unsigned char*)buf, node->inline_data, node->info.st_size < INODE_INLINE ? node->info.st_size : INODE_INLINE, 0);
+	return;
+    }
+    node->ext_count = le16toh(d.ext_count);
+    node->ext_depth = le16toh(d.ext_depth);
+    if(node->ext_count > INODE_EXTENTS)
+    {
+	node->ext_count = INODE_EXTENTS;
+    }
+    for(i = 0; i < node->ext_count; i++)
+    {
+	node->ext[i].logical = le32toh(d.ext[i][0]);
+	node->ext[i].physical = le32toh(d.ext[i][1]);
+	node->ext[i].length = le32toh(d.ext[i][2]);
+    }
+}
+
+//returns -1 if buf doesn't hold a binary inode
+static int decode_inode(const unsigned char *buf, inode *node)
+{
+    if(decode_inode_attr(buf, node) < 0)
+    {
+	return -1;
+    }
+    decode_inode_map(buf, node);
+    return 0;
+}
+
+//inodes of version 0 and 1 images: 47 tab separated numbers
+static void parse_text_inode(char *buf, inode *node)
+{
+    int i;
+
+    memset(node, 0, sizeof(*node));
+    char *token = strtok(buf, "\t");
+    if(token == NULL)
+    {
+	return;
+    }
+
+    node->info.st_dev = atoi(token);
     token = strtok(NULL, "\t");
-    testnode.info.st_ino = atoi(token);
+    node->info.st_ino = atoi(token);
     token = strtok(NULL, "\t");
-    testnode.info.st_mode = atoi(token);
+    node->info.st_mode = atoi(token);
     token = strtok(NULL, "\t");
-    testnode.info.st_nlink = atoi(token);
+    node->info.st_nlink = atoi(token);
     token = strtok(NULL, "\t");
-    testnode.info.st_uid = atoi(token);
+    node->info.st_uid = atoi(token);
     token = strtok(NULL, "\t");
-    testnode.info.st_gid = atoi(token);
+    node->info.st_gid = atoi(token);
     token = strtok(NULL, "\t");
-    testnode.info.st_rdev = atoi(token);
+    node->info.st_rdev = atoi(token);
     token = strtok(NULL, "\t");
-    testnode.info.st_size = atoi(token);
+    node->info.st_size = atoll(token);
     token = strtok(NULL, "\t");
 
-	int len;
-	if(testnode.info.st_size % BLOCK_SIZE > 0)
-    {
-		len = (testnode.info.st_size/BLOCK_SIZE)+1;
-    }
-    else
-    {
-		len = testnode.info.st_size/BLOCK_SIZE;
-    }
-	testnode.info.st_blocks = len;
-
     for(i = 0; i < 32; i++)
     {
-		testnode.direct[i] = atoi(token);
+		node->direct[i] = atoi(token);
 		token = strtok(NULL, "\t");
     }
 
-    //log_msg("Indirect Time!\n");
-    testnode.indirect[0] = atoi(token);
+    node->indirect[0] = atoi(token);
     token = strtok(NULL, "\t");
-    testnode.indirect[1] = atoi(token);
+    node->indirect[1] = atoi(token);
     token = strtok(NULL, "\t");
 
-    testnode.info.st_atime = atoi(token);
+    node->info.st_atime = atoi(token);
     token = strtok(NULL, "\t");
-    testnode.info.st_mtime = atoi(token);
+    node->info.st_mtime = atoi(token);
     token = strtok(NULL, "\t");
-    testnode.info.st_ctime = atoi(token);
+    node->info.st_ctime = atoi(token);
     token = strtok(NULL, "\t");
-    testnode.info.st_blksize = atoi(token);
+    node->info.st_blksize = atoi(token);
     token = strtok(NULL, "\t");
-    testnode.info.st_blocks = atoi(token);
-    
-    //log_msg("[read_from_file] Just tokenized!\n");
-    
-
-    return testnode;
+    node->info.st_blocks = atoi(token);
 }
 
-//NOTE: this function returns an allocated string which must be freed
-char* get_buffer(inode node)
+int inode_block(int ino, int *offset)
 {
-    if(!fileFound)
+    int index = ino - layout.ino_base;
+
+    if(index >= layout.inode_count)
     {
-		//log_msg("[get_buffer] fileFound sucks\n");
-		return NULL;
+	return inode_chunk_block(index - layout.inode_count, offset);
     }
+    *offset = index % layout.inodes_per_block * layout.inode_size;
+    return layout.inode_start + index / layout.inodes_per_block;
+}
 
-    int i;
-    char *buffer = NULL;
-    char readbuff[BLOCK_SIZE];
-
-    int len;
-    int bstat;
+/*
+ * Inode cache
+ *
+ * Entries sit in one array, are found through a hash on the inode number
+ * and are kept on an LRU list, most recently used first, with unused ones
+ * at the tail.  icache_lock covers all of it, including the inode table
+ * reads and writes made on a miss or an eviction (the block layer's own
+ * locks nest inside it).  An inode freed while it is still open keeps its
+ * entry, out of the hash, until the last release takes its pins off, so
+ * those pins are never taken off a new inode given the same number.
+ */
+typedef struct icache_entry
+{
+    inode node;
+    int ino; //0 while the entry is unused
+    int dirty;
+    long long dirtied; //ms clock (see icache_now) when dirty was last set on a clean entry
+    int cold; //node's block map and inline data are decoded too, not just node.info; always set if dirty
+    time_t lazy; //when write_times last changed a clean entry, 0 if it hasn't
+    int pins;
+    int dead; //inode number of a dropped entry still pinned by open files, else 0
+    struct icache_entry *hash_next;
+    struct icache_entry *lru_prev, *lru_next;
+} icache_entry;
+
+static icache_entry *icache = NULL;
+
+//monotonic ms, the same clock the block flusher ages dirty blocks by
+static long long icache_now()
+{
+    struct timespec ts;
 
-    //implementing a ceil()
-	
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+static icache_entry **icache_hash = NULL;
+static int icache_size = 0;
+static icache_entry *icache_head = NULL, *icache_tail = NULL;
+static int icache_dead = 0; //entries with dead set
+static pthread_mutex_t icache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//read an inode straight from the inode table; with full clear only node.info is filled in.
+//Returns whether the rest was
+static int inode_load(int node, inode *testnode, int full)
+{
+    int offset;
 
-    if(node.info.st_size % BLOCK_SIZE > 0)
-    {
-		len = (node.info.st_size/BLOCK_SIZE)+1;
-    }
-    else
+    char buf[BLOCK_SIZE + 1];
+    int block = inode_block(node, &offset);
+    int bstat = block < 0 ? -1 : block_read(block, buf);
+    buf[BLOCK_SIZE] = '\0';
+    if(bstat < 0)
     {
-		len = node.info.st_size/BLOCK_SIZE;
+		log_msg("Failed to read from node %d.\n", node);
+		memset(testnode, 0, sizeof(*testnode));
+		return 1;
     }
 
-	//log_msg("[get_buffer] len:%d,size:%d\n",len,node.info.st_size);
-
-    //TODO: for now, assume directories won't require indirect inodes; total string size less than 32 * 512. (Maybe) fix this later
-    for(i = 0; i < len; i++)
+    if(decode_inode_attr((unsigned char*)buf + offset, testnode) < 0)
     {
-		bstat = block_read(node.direct[i], readbuff);
-		//log_msg("[get_buffer] status of block_read from data block %d: %d\n", node.direct[i], bstat);
-		int count = 0;
-		char*newLinePtr = strstr(readbuff, "\n");
-		while(newLinePtr != NULL)
-		{
-			newLinePtr += 1;
-			count++;
-			newLinePtr = strstr(newLinePtr, "\n");
-		}
-        char *nullPtr = readbuff + strlen(readbuff) + 1;
-		if(nullPtr != NULL)
-		{
-			//nullPtr += 1;
-			//log_msg("[get_buffer] nullPtrString:%s\n",nullPtr);
-
-		}
-		//log_msg("[get_buffer] Newline count:%d\n",count);
-		//log_msg("[get_buffer] Yo, this is readbuff:\n%s\n",readbuff);
-		if(bstat < 0)
+		//not migrated yet (see migrate_inodes); these are always a block each.
+		//Anywhere else it is a slot that was never written, such as a file
+		//unlinked before its inode left the cache
+		if(layout.version < 2)
 		{
-			//log_msg("[get_buffer] Failed to read block in get_buffer.\n");
+			parse_text_inode(buf, testnode);
 		}
-
-		if((i+1) == len)
+		else
 		{
-			int thislen = strlen(readbuff)+1;
-			//log_msg("[get_buffer] bytes in last block: %d\n",thislen);
+			memset(testnode, 0, sizeof(*testnode));
 		}
+		return 1;
+    }
+    if(full)
+    {
+		decode_inode_map((unsigned char*)buf + offset, testnode);
+    }
+    return full;
+}
 
-		buffer = realloc(buffer, BLOCK_SIZE * (i+1));
-		memcpy((buffer + (BLOCK_SIZE * i)), readbuff, BLOCK_SIZE);
-		memset(readbuff, '\0', BLOCK_SIZE);
+//write an inode straight to the inode table
+static void inode_store(const inode *insert_inode)
+{
+    //the block is shared with other inodes, so update just this one's slot
+    unsigned char *blockBuf = (unsigned char*)calloc(1, BLOCK_SIZE);
+    int offset, block = inode_block(insert_inode->info.st_ino, &offset);
+    int bstat = block < 0 ? -1 : block_read(block, blockBuf);
+    if(bstat >= 0)
+    {
+	encode_inode(insert_inode, blockBuf + offset);
+	bstat = block_write(block, blockBuf);
+    }
+    free(blockBuf);
+    
+    if(bstat < 0)
+    {
+		log_msg("Failed to write inode %d to file.\n", insert_inode->info.st_ino);
     }
+}
 
-	//log_msg("[get_buffer] Returning: [begin]\n%s\n[end]", buffer);
-    return buffer;
+static void icache_unlink(icache_entry *e)
+{
+    if(e->lru_prev) e->lru_prev->lru_next = e->lru_next; else icache_head = e->lru_next;
+    if(e->lru_next) e->lru_next->lru_prev = e->lru_prev; else icache_tail = e->lru_prev;
 }
 
+static void icache_push_front(icache_entry *e)
+{
+    e->lru_prev = NULL;
+    e->lru_next = icache_head;
+    if(icache_head) icache_head->lru_prev = e; else icache_tail = e;
+    icache_head = e;
+}
 
-char* read_super()
+static void icache_push_back(icache_entry *e)
 {
-    char *buffer = (char*)malloc(BLOCK_SIZE * 8);
-    char readbuff[BLOCK_SIZE];
-    int i, bstat;
+    e->lru_next = NULL;
+    e->lru_prev = icache_tail;
+    if(icache_tail) icache_tail->lru_next = e; else icache_head = e;
+    icache_tail = e;
+}
+
+static icache_entry *icache_lookup(int ino)
+{
+    icache_entry *e;
 
-    for(i = 0; i < 8; i++)
+    if(icache_size == 0)
+    {
+	return NULL;
+    }
+    for(e = icache_hash[ino % icache_size]; e != NULL; e = e->hash_next)
     {
-		bstat = block_read(i, readbuff);
-		memcpy((buffer + (BLOCK_SIZE * i)), readbuff, BLOCK_SIZE);
-		bzero(readbuff, BLOCK_SIZE);
+	if(e->ino == ino)
+	{
+	    icache_unlink(e);
+	    icache_push_front(e);
+	    return e;
+	}
     }
+    return NULL;
+}
 
-    return buffer;
+static void icache_unhash(icache_entry *e)
+{
+    icache_entry **pp = &icache_hash[e->ino % icache_size];
+
+    while(*pp != e)
+    {
+	pp = &(*pp)->hash_next;
+    }
+    *pp = e->hash_next;
 }
 
-void writeToDirectory(char *fPath, int flag) //1 = append, 0 = remove
+//take the least recently used unpinned entry for ino; NULL if every entry is pinned
+static icache_entry *icache_claim(int ino)
 {
-	log_msg("In writeToDirectory\n");
-	log_msg("Parent Ino:%d\n",parentNode.info.st_ino);
-	char *inodeString = get_buffer(parentNode);
-	if(inodeString == NULL)
+    icache_entry *e;
+
+    for(e = icache_tail; e != NULL && e->pins > 0; e = e->lru_prev);
+    if(e == NULL)
+    {
+	return NULL;
+    }
+
+    if(e->ino != 0)
+    {
+	if(e->dirty || e->lazy)
 	{
-		//log_msg("[writeToDirectory] Writing to empty directory\n"); 
-		inodeString = (char*)malloc(1);
-		inodeString[0] = '\0';
+	    inode_store(&e->node);
 	}
+	icache_unhash(e);
+    }
+
+    e->ino = ino;
+    e->dirty = 0;
+    e->cold = 0;
+    e->lazy = 0;
+    e->hash_next = icache_hash[ino % icache_size];
+    icache_hash[ino % icache_size] = e;
+    icache_unlink(e);
+    icache_push_front(e);
+    return e;
+}
 
-	log_msg("Directory String:\n%s\n",inodeString);
+//find ino in the cache, reading it in on a miss; full also wants the block map decoded
+static icache_entry *icache_get(int ino, int full)
+{
+    icache_entry *e = icache_lookup(ino);
 
-	if(flag == 1)//append
+    if(e == NULL && icache_size > 0)
+    {
+	e = icache_claim(ino);
+	if(e != NULL)
 	{
-		int iLen = strlen(inodeString);
-		int fLen = strlen(fPath);
-		log_msg("inode string size: %d fpath size:%d\n",iLen,fLen);
-		inodeString = realloc(inodeString,iLen + fLen + 1);
-		strcat(inodeString,fPath);
+	    e->cold = inode_load(ino, &e->node, full);
 	}
+    }
+    else if(e != NULL && full && !e->cold)
+    {
+	//only the attributes were wanted before; the entry is clean, so the table has the rest
+	e->cold = inode_load(ino, &e->node, 1);
+    }
+    return e;
+}
+
+int inode_cache_init(int n)
+{
+    int i;
 
-	else if(flag == 0)//remove
+    pthread_mutex_lock(&icache_lock);
+    free(icache);
+    free(icache_hash);
+    icache = NULL;
+    icache_hash = NULL;
+    icache_head = icache_tail = NULL;
+    icache_size = 0;
+    icache_dead = 0;
+
+    if(n > 0)
+    {
+	icache = (icache_entry*)calloc(n, sizeof(icache_entry));
+	icache_hash = (icache_entry**)calloc(n, sizeof(icache_entry*));
+	if(icache == NULL || icache_hash == NULL)
 	{
-		//log_msg("[writeToDirectory] Deleting in writeToDirectory\n");
-		inode dummy;
-		inode start = get_inode("/",dummy, 0);
-		inode removalNode = get_inode(fPath, start, 0);
-		if(!fileFound)
-		{
-			//log_msg("[writeToDirectory] Failed to find file when deleting\n");
-			return;
-		}
+	    free(icache);
+	    free(icache_hash);
+	    icache = NULL;
+	    icache_hash = NULL;
+	    pthread_mutex_unlock(&icache_lock);
+	    return -1;
+	}
+	icache_size = n;
+	for(i = 0; i < n; i++)
+	{
+	    icache_push_back(&icache[i]);
+	}
+    }
+    pthread_mutex_unlock(&icache_lock);
 
-		while(strstr(fPath, "/") != NULL)
-		{
-			fPath = strstr(fPath, "/")+1;//get name of file to be removed
-		}
+    log_msg("Inode cache: %d inodes\n", n);
+    return 0;
+}
 
+void write_to_file(inode insert_inode)
+{
+    icache_entry *e;
 
-		char *format, *tempBuff;
-		//log_msg("[writeToDirectory] Ino: %d FileName: %s\n",removalNode.info.st_ino, fPath);
+    pthread_mutex_lock(&icache_lock);
+    e = icache_lookup(insert_inode.info.st_ino);
+    if(e == NULL && icache_size > 0)
+    {
+	e = icache_claim(insert_inode.info.st_ino);
+    }
 
-		asprintf(&format, "%d\t%s\n", removalNode.info.st_ino, fPath);//create 'format' of string to search for: Inode Number [tab] Filename
-		
-		char *tgtString = strstr(inodeString, format);//get location of string to be removed. 
-		
-		int strLen = strstr(tgtString, "\n") - tgtString + 1;//get length of string about to be removed
+    if(e != NULL)
+    {
+	e->node = insert_inode;
+	if(!e->dirty)
+	{
+	    e->dirtied = icache_now();
+	}
+	e->dirty = 1;
+	e->cold = 1;
+	e->lazy = 0; //any held-back timestamps go out with the rest
+    }
+    else
+    {
+	inode_store(&insert_inode); //cache off or all pinned: write through
+    }
+    pthread_mutex_unlock(&icache_lock);
+}
 
-		asprintf(&tempBuff, "%s", tgtString + strLen);//copy all bytes directly after string about to be removed
+void write_times(inode insert_inode)
+{
+    icache_entry *e;
 
-		memset((inodeString + (tgtString - inodeString)), '\0', strlen(tgtString));//clear out entire string starting from removal target
+    if(!SFS_DATA->lazytime)
+    {
+	write_to_file(insert_inode);
+	return;
+    }
 
-		strcat(inodeString, tempBuff);//re-insert copied string
-	
-		free(tempBuff);
-		free(format);
-	}
+    pthread_mutex_lock(&icache_lock);
+    e = icache_lookup(insert_inode.info.st_ino);
+    if(e == NULL && icache_size > 0)
+    {
+	e = icache_claim(insert_inode.info.st_ino);
+    }
 
-	else //sanity check
+    if(e != NULL)
+    {
+	e->node = insert_inode;
+	e->cold = 1;
+	if(!e->dirty && !e->lazy)
 	{
-		//log_msg("[writeToDirectory] Holy shit my sanity is gone (check writeToDirectory)\n");
+	    e->lazy = time(NULL);
 	}
+    }
+    else
+    {
+	inode_store(&insert_inode); //nowhere to hold it
+    }
+    pthread_mutex_unlock(&icache_lock);
+}
 
-	//char myStringArg[BUFF_SIZE];
-	int xyz = strlen(inodeString)+1;
-	char *myStringArg = (char*)malloc(xyz);
-	int count = 0;
-	char *newLinePtr;
-	newLinePtr = strstr(inodeString, "\n");
-	while(newLinePtr != NULL)
-	{
-		newLinePtr += 1;
-		count++;
-		newLinePtr = strstr(newLinePtr, "\n");
-	}
-	//log_msg("[writeToDirectory] inodeString+1: %d, number of newline characters in inode string before strcpy: %d\n",xyz, count);
-	strcpy(myStringArg,inodeString);
-	parentNode.info.st_size = strlen(myStringArg) + 1;
 
-	int len;
-	if(parentNode.info.st_size % BLOCK_SIZE > 0)
+inode read_from_file(int node)
+{
+    inode testnode;
+    icache_entry *e;
+
+    pthread_mutex_lock(&icache_lock);
+    e = icache_get(node, 1);
+    if(e != NULL)
     {
-		len = (parentNode.info.st_size/BLOCK_SIZE)+1;
+	testnode = e->node;
     }
     else
     {
-		len = parentNode.info.st_size/BLOCK_SIZE;
+	inode_load(node, &testnode, 1);
     }
-	parentNode.info.st_blocks = len;
+    pthread_mutex_unlock(&icache_lock);
 
-	//log_msg("[writeToDirectory] String: %s File Size: %d Block Count: %d\n", myStringArg, parentNode.info.st_size, len);
-
-	loopWrite(myStringArg, &parentNode);
-	write_to_file(parentNode);
-	//log_msg("[writeToDirectory] New Directory Contents:\n%s\n",myStringArg);
-	count = 0;
-	newLinePtr = strstr(myStringArg, "\n");
-	while(newLinePtr != NULL)
-	{
-		newLinePtr += 1;
-		count++;
-		newLinePtr = strstr(newLinePtr, "\n");
-	}
-	//log_msg("[writeToDirectory] number of newline characters in inode string after strcpy: %d\n", count);
-	free(inodeString);
-	free(myStringArg);
-	rootNode = read_from_file(8);
+    return testnode;
 }
 
-int loopWrite(char* myString, inode* thisNode)
+void read_attr(int ino, struct stat *st)
 {
-	inode node = *thisNode;
-	//log_msg("[loopWrite] In loopWrite\n");
-	int bstat;
-	int mySize = strlen(myString)+1;
-	//log_msg("[loopWrite] myString: %s\tmySize:%d\n",myString,mySize);
-	int myBlockCount;
-	int totalWritten = 0;
-	int i,thisBlock,thisInode;
-	char myZero[BLOCK_SIZE];
-	memset(myZero,'\0',BLOCK_SIZE);
-	char writeBuff[513];
-	writeBuff[512] = '\0';
-	char *writeStart;
-
+    icache_entry *e;
+    inode node;
 
-	//implementing a ceil()
-    if(mySize % BLOCK_SIZE > 0)
+    pthread_mutex_lock(&icache_lock);
+    e = icache_get(ino, 0);
+    if(e != NULL)
     {
-		myBlockCount = (mySize/BLOCK_SIZE)+1;
+	*st = e->node.info;
     }
     else
     {
-		myBlockCount = mySize/BLOCK_SIZE;
+	inode_load(ino, &node, 0);
+	*st = node.info;
     }
+    pthread_mutex_unlock(&icache_lock);
+}
 
-	//log_msg("[loopWrite] myBlockCount-->%d\n",myBlockCount);
+void inode_pin(int ino)
+{
+    icache_entry *e;
 
-	for(i = 0; i < myBlockCount; i++)
-	{
-		if(i < 32)//use direct pointers
-		{
-			if(node.direct[i] == 0)//uninitialized direct pointer
-			{
-				//initialize block pointer
-				//log_msg("[loopWrite] index check\n");
-				thisBlock = myBlockIndex();
-				//log_msg("[loopWrite] thisBlock----->%d\n",thisBlock);
+    pthread_mutex_lock(&icache_lock);
+    e = icache_get(ino, 0);
+    if(e != NULL)
+    {
+	e->pins++;
+    }
+    pthread_mutex_unlock(&icache_lock);
+}
 
-				if (thisBlock < 0)//Out of space
-				{
-					//log_msg("[loopWrite] Out of Space {Direct}\n");
-					*thisNode = node;
-					return totalWritten;
-				}
-			
-				node.direct[i] = thisBlock;
-			}
-			//log_msg("[loopWrite] Writing...\n");
-			bstat = block_write(node.direct[i],myZero);//Clearing out just in case
-			if(bstat < 1)
-			{
-				//log_msg("[loopWrite] Something in clearing out datablock, bstat:%d\n",bstat);
-			}
+void inode_unpin(int ino)
+{
+    icache_entry *e = NULL;
+    int i;
 
-			memcpy(writeBuff, myString, BLOCK_SIZE);
-			if((writeStart = strstr(writeBuff, "\0")) - writeBuff < BLOCK_SIZE && writeStart - writeBuff > 0)
-			{
-				memset(writeStart, '\0', BLOCK_SIZE - (writeStart - writeBuff));
-			}
+    pthread_mutex_lock(&icache_lock);
+    //pins left on a dropped ino go first; they all stand for open files alike
+    for(i = 0; icache_dead > 0 && e == NULL && i < icache_size; i++)
+    {
+	e = icache[i].dead == ino ? &icache[i] : NULL;
+    }
+    if(e == NULL)
+    {
+	e = icache_lookup(ino);
+    }
+    if(e != NULL && e->pins > 0)
+    {
+	e->pins--;
+	if(e->pins == 0 && e->dead != 0)
+	{
+	    e->dead = 0;
+	    icache_dead--;
+	}
+    }
+    pthread_mutex_unlock(&icache_lock);
+}
 
+void inode_drop(int ino)
+{
+    icache_entry *e;
 
-			bstat = block_write(node.direct[i],writeBuff);//actual write
-			memset(writeBuff, '\0', BLOCK_SIZE);
+    pthread_mutex_lock(&icache_lock);
+    e = icache_lookup(ino);
+    if(e != NULL)
+    {
+	icache_unhash(e);
+	e->ino = 0;
+	e->dirty = 0;
+	e->lazy = 0;
+	if(e->pins > 0)
+	{
+	    e->dead = ino; //still open: the entry waits for its releases
+	    icache_dead++;
+	}
+	icache_unlink(e);
+	icache_push_back(e);
+    }
+    pthread_mutex_unlock(&icache_lock);
+}
 
-			if(bstat < 1)
-			{
-				//log_msg("[loopWrite] Something in actual data write, bstat:%d\n",bstat);
-			}
-		}
-		else
-		{
-			if (node.indirect[0] == 0)//uninitialized indirect pointer
-			{
-				thisInode = myInodeIndex();
-				log_msg("New Inode Index: %d\n",thisInode);
-				if (thisInode < 0)//Out of space
-				{
-					//log_msg("[loopWrite] Out of Space {Indirect}\n");
-					*thisNode = node;
-					return totalWritten;
-				}
-				node.indirect[0] = thisInode;
-				//loopWrite()
-			}
-			else
-			{
-			}
-		}
-		totalWritten += BLOCK_SIZE;
-		//TODO:Possible seg fault; double check later
-		//log_msg("[loopWrite] Next block...please don't seg fault\n");
-		myString += BLOCK_SIZE;
+int inode_sync(int times)
+{
+    int i, n = 0;
+
+    pthread_mutex_lock(&icache_lock);
+    for(i = 0; i < icache_size; i++)
+    {
+	if(icache[i].ino != 0 && (icache[i].dirty || (times && icache[i].lazy)))
+	{
+	    inode_store(&icache[i].node);
+	    icache[i].dirty = 0;
+	    icache[i].lazy = 0;
+	    n++;
 	}
+    }
+    pthread_mutex_unlock(&icache_lock);
 
-	//log_msg("[loopWrite] leaving loopwrite\n");
-	*thisNode = node;
-	return mySize;
+    return n;
 }
 
-int myBlockIndex()
+//flusher hook: write inodes that have been dirty for expire_ms, and timestamps held back LAZYTIME_EXPIRE
+void inode_writeback(int expire_ms)
 {
-		//log_msg("In myBlockIndex\n");
-		char *superBuff = read_super();
-		char inodeMap[64];
-		char dataMap[4031];
-	    memcpy(inodeMap, superBuff, 64);
-	    memcpy(dataMap, (superBuff + 64), 4031);
-	    //char superCopyInode[64];
-	    char superCopyData[4031];
-	    //memcpy(superCopyInode,inodeMap,64);
-	    memcpy(superCopyData,dataMap,4031);
-		int bitLocData = -1;
-	    int blockLocData = -1;
-		int i, j;
-		char freeBit;
-
-	    for(i = 0; i < 4031; i++)
-	    {
-	        for(j = 7; j >= 0; j--)
-	        {
-		        freeBit = superCopyData[i] & 1;
-	            if(freeBit)
-	            {
-					bitLocData = j;
-				    blockLocData = i;
-				    break;
-				}
-		        superCopyData[i] >>= 1;
-	        }
-	        if(bitLocData >= 0)
-	        {
-		        break;
-	        }
-	    }
+    long long cutoff = icache_now() - expire_ms;
+    time_t lazy_cutoff = time(NULL) - LAZYTIME_EXPIRE;
+    int i;
 
-		if (bitLocData < 0)//Out of space
-		{
-			return -1;
-		}
+    pthread_mutex_lock(&icache_lock);
+    for(i = 0; i < icache_size; i++)
+    {
+	if(icache[i].ino == 0)
+	{
+	    continue;
+	}
+	if((icache[i].dirty && icache[i].dirtied <= cutoff) || (icache[i].lazy && icache[i].lazy <= lazy_cutoff))
+	{
+	    inode_store(&icache[i].node);
+	    icache[i].dirty = 0;
+	    icache[i].lazy = 0;
+	}
+    }
+    pthread_mutex_unlock(&icache_lock);
+}
 
-	    if (bitLocData == 0)
-	    {
-		    dataMap[blockLocData] &= 0x7f;
-	    }
-	    else if (bitLocData == 1)
-	    {
-		    dataMap[blockLocData] &= 0xbf;
-	    }
-	    else if (bitLocData == 2)
+/** Convert an older image's inodes to the binary format
+ *
+ * Version 0 and 1 images keep each inode as a line of text.  Every inode
+ * in use is parsed once and written back as a disk_inode, still one per
+ * block, then a version 1 header is bumped to 2 so later mounts skip this.  Version 0
+ * images have no header to bump; for them the pass runs at each mount but
+ * only reads, as everything is already binary after the first.
+ */
+void migrate_inodes()
+{
+    unsigned char *superBuff = (unsigned char*)read_super();
+    unsigned char *map = superBuff + layout.inode_map_off;
+    char *buf = (char*)malloc(BLOCK_SIZE + 1);
+    inode node;
+    int i, converted = 0;
+
+    for(i = 0; i < INODE_COUNT; i++)
+    {
+	if(map[i / 8] & (0x80 >> (i % 8)))
+	{
+	    continue; //free
+	}
+	if(block_read(INODE_START + i, buf) < 0)
+	{
+	    log_msg("migrate_inodes: can't read inode %d\n", layout.ino_base + i);
+	    continue;
+	}
+	buf[BLOCK_SIZE] = '\0';
+	if(decode_inode((unsigned char*)buf, &node) == 0)
+	{
+	    continue;
+	}
+	parse_text_inode(buf, &node);
+	node.info.st_ino = layout.ino_base + i;
+	write_to_file(node);
+	converted++;
+    }
+
+    if(layout.magic == SFS_MAGIC)
+    {
+	layout.version = 2;
+	write_header(superBuff);
+	write_super((char*)superBuff);
+    }
+
+    inode_sync(1);
+    log_msg("Converted %d text inodes to binary\n", converted);
+    free(buf);
+    free(superBuff);
+}
+
+/*
+ * Extent maps (see INODE_FL_EXTENTS in sfs.h)
+ *
+ * Files only ever grow at the end, so extents are only added after the
+ * last one: a new run that carries on from the last extent on disk just
+ * lengthens it, anything else goes in as a new extent in the rightmost
+ * leaf.  When that leaf is full a new one is started and an index entry
+ * for it added one level up, and so on; when the inode itself is full its
+ * entries are pushed down into a new tree block and the tree gets one
+ * level deeper.  Tree blocks are read through the block cache.
+ */
+
+//entries of tree block b into e (room for EXTENT_PER_BLOCK); -1 if it isn't one
+static int ext_read_node(int b, extent *e, int *depth)
+{
+	unsigned char *buf = (unsigned char*)malloc(BLOCK_SIZE);
+	uint16_t h[3];
+	uint32_t w[3];
+	int i, count = -1;
+
+	if(block_read(b, buf) >= 0)
+	{
+		memcpy(h, buf, sizeof(h));
+		if(le16toh(h[0]) == EXTENT_MAGIC)
+		{
+			count = le16toh(h[1]);
+			*depth = le16toh(h[2]);
+			if(count > EXTENT_PER_BLOCK)
+			{
+				count = EXTENT_PER_BLOCK;
+			}
+			for(i = 0; i < count; i++)
+			{
+				memcpy(w, buf + EXTENT_HEADER + i * EXTENT_SIZE, sizeof(w));
+				e[i].logical = le32toh(w[0]);
+				e[i].physical = le32toh(w[1]);
+				e[i].length = le32toh(w[2]);
+			}
+		}
+	}
+
+	free(buf);
+	return count;
+}
+
+static int ext_write_node(int b, const extent *e, int count, int depth)
+{
+	unsigned char *buf = (unsigned char*)calloc(1, BLOCK_SIZE);
+	uint16_t h[4] = { htole16(EXTENT_MAGIC), htole16(count), htole16(depth), 0 };
+	uint32_t w[3];
+	int i, bstat;
+
+	memcpy(buf, h, sizeof(h));
+	for(i = 0; i < count; i++)
+	{
+		w[0] = htole32(e[i].logical);
+		w[1] = htole32(e[i].physical);
+		w[2] = htole32(e[i].length);
+		memcpy(buf + EXTENT_HEADER + i * EXTENT_SIZE, w, sizeof(w));
+	}
+
+	bstat = block_write(b, buf);
+	free(buf);
+	return bstat;
+}
+
+//the last entry in e[0..count) starting at or before index, -1 if none
+static int ext_search(const extent *e, int count, int index)
+{
+	int lo = 0, hi = count - 1, found = -1;
+
+	while(lo <= hi)
+	{
+		int mid = (lo + hi) / 2;
+		if(e[mid].logical <= index)
+		{
+			found = mid;
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid - 1;
+		}
+	}
+	return found;
+}
+
+//the extent holding file block index; 0 and out->length 0 if it isn't mapped
+static int ext_lookup(const inode *node, int index, extent *out)
+{
+	extent *e = (extent*)node->ext, *buf = NULL;
+	int count = node->ext_count, depth = node->ext_depth, i;
+
+	out->length = 0;
+	while(1)
+	{
+		i = ext_search(e, count, index);
+		if(i < 0)
+		{
+			break;
+		}
+		if(depth == 0)
+		{
+			if(index < e[i].logical + e[i].length)
+			{
+				*out = e[i];
+			}
+			break;
+		}
+
+		if(buf == NULL)
+		{
+			buf = (extent*)malloc(EXTENT_PER_BLOCK * sizeof(extent));
+		}
+		count = ext_read_node(e[i].physical, buf, &depth);
+		if(count < 0)
+		{
+			log_msg("Bad extent tree block %d in inode %d\n", e[i].physical, node->info.st_ino);
+			break;
+		}
+		e = buf;
+	}
+
+	free(buf);
+	return out->length > 0 ? out->physical + index - out->logical : 0;
+}
+
+//a chain of new tree blocks depth levels deep ending in a leaf holding x; returns the top one
+static int ext_new_branch(extent x, int depth)
+{
+	int b = myBlockIndex();
+	extent entry;
+
+	if(b < 0)
+	{
+		return -1;
+	}
+
+	if(depth > 0)
+	{
+		entry.logical = x.logical;
+		entry.physical = ext_new_branch(x, depth - 1);
+		entry.length = 0;
+		if(entry.physical < 0)
+		{
+			freeRun(b, 1);
+			return -1;
+		}
+		x = entry;
+	}
+
+	ext_write_node(b, &x, 1, depth);
+	return b;
+}
+
+/* Add x after the last extent of e[0..*count), whose entries are depth
+ * levels above the leaves.  Returns 0 when it went in, 1 when there is no
+ * room at this level (the caller starts a new branch), -1 when out of
+ * space. */
+static int ext_append(extent *e, int *count, int max, int depth, extent x, int *changed)
+{
+	extent *child;
+	int n, childDepth, r;
+
+	*changed = 0;
+	if(depth == 0)
+	{
+		extent *last = *count > 0 ? &e[*count - 1] : NULL;
+		if(last != NULL && last->logical + last->length == x.logical && last->physical + last->length == x.physical)
+		{
+			last->length += x.length;
+		}
+		else if(*count < max)
+		{
+			e[(*count)++] = x;
+		}
+		else
+		{
+			return 1;
+		}
+		*changed = 1;
+		return 0;
+	}
+
+	child = (extent*)malloc(EXTENT_PER_BLOCK * sizeof(extent));
+	n = ext_read_node(e[*count - 1].physical, child, &childDepth);
+	if(n < 0)
+	{
+		free(child);
+		return -1;
+	}
+	r = ext_append(child, &n, EXTENT_PER_BLOCK, childDepth, x, changed);
+	if(r == 0 && *changed)
+	{
+		ext_write_node(e[*count - 1].physical, child, n, childDepth);
+	}
+	free(child);
+	*changed = 0;
+
+	if(r != 1)
+	{
+		return r;
+	}
+	if(*count == max)
+	{
+		return 1;
+	}
+
+	e[*count].logical = x.logical;
+	e[*count].physical = ext_new_branch(x, depth - 1);
+	e[*count].length = 0;
+	if(e[*count].physical < 0)
+	{
+		return -1;
+	}
+	(*count)++;
+	*changed = 1;
+	return 0;
+}
+
+//add the run x to the end of a file's extent map
+static int ext_add(inode *node, extent x)
+{
+	int r, changed, b;
+
+	r = ext_append(node->ext, &node->ext_count, INODE_EXTENTS, node->ext_depth, x, &changed);
+	if(r != 1)
+	{
+		return r;
+	}
+
+	//the inode is full: move its entries down a level and try again
+	b = myBlockIndex();
+	if(b < 0)
+	{
+		return -1;
+	}
+	ext_write_node(b, node->ext, node->ext_count, node->ext_depth);
+	node->ext[0].physical = b; //logical stays that of the first entry
+	node->ext[0].length = 0;
+	node->ext_count = 1;
+	node->ext_depth++;
+	return ext_append(node->ext, &node->ext_count, INODE_EXTENTS, node->ext_depth, x, &changed) == 0 ? 0 : -1;
+}
+
+//free every run under e[0..count) and the tree blocks holding them
+static void ext_free(const extent *e, int count, int depth)
+{
+	extent *child;
+	int i, n, childDepth;
+
+	for(i = 0; i < count; i++)
+	{
+		if(depth == 0)
+		{
+			freeRun(e[i].physical, e[i].length);
+			continue;
+		}
+		child = (extent*)malloc(EXTENT_PER_BLOCK * sizeof(extent));
+		n = ext_read_node(e[i].physical, child, &childDepth);
+		if(n >= 0)
+		{
+			ext_free(child, n, childDepth);
+		}
+		free(child);
+		freeRun(e[i].physical, 1);
+	}
+}
+
+//logical block just past the end of a file's extent map
+static int ext_end(const inode *node)
+{
+	extent *e = (extent*)node->ext, *buf = NULL;
+	int count = node->ext_count, depth = node->ext_depth, end = 0;
+
+	while(count > 0)
+	{
+		if(depth == 0)
+		{
+			end = e[count - 1].logical + e[count - 1].length;
+			break;
+		}
+		if(buf == NULL)
+		{
+			buf = (extent*)malloc(EXTENT_PER_BLOCK * sizeof(extent));
+		}
+		count = ext_read_node(e[count - 1].physical, buf, &depth);
+		e = buf;
+	}
+
+	free(buf);
+	return end;
+}
+
+/*
+ * Block maps (inodes without INODE_FL_EXTENTS: directories, and files
+ * from older images)
+ *
+ * File block i is direct[i] for the first DIRECT_COUNT blocks, then an
+ * entry of the pointer block indirect[0], then an entry of one of the
+ * pointer blocks listed in the pointer block indirect[1].  A pointer
+ * block is PTRS_PER_BLOCK little-endian block numbers, 0 for none,
+ * and is read through the block cache, so finding a block is at most two
+ * cached reads.  Older images could have an inode number in indirect[0]
+ * that was never used, so anything outside the data region counts as
+ * unset.
+ */
+static int ptr_valid(int b)
+{
+	return b >= DATA_START && b < BLOCK_COUNT;
+}
+
+//entry slot of pointer block b, with buf holding it (cur says which block is loaded)
+static int ptr_get(unsigned char *buf, int *cur, int b, int slot)
+{
+	uint16_t p;
+	uint32_t q;
+
+	if(*cur != b)
+	{
+		if(block_read(b, buf) < 0)
+		{
+			*cur = 0;
+			return 0;
+		}
+		*cur = b;
+	}
+	if(layout.ptr_size == 4)
+	{
+		memcpy(&q, buf + slot * 4, 4);
+		return le32toh(q);
+	}
+	memcpy(&p, buf + slot * 2, 2);
+	return le16toh(p);
+}
+
+static void ptr_set(int b, int slot, int value)
+{
+	unsigned char *buf = (unsigned char*)malloc(BLOCK_SIZE);
+	uint16_t p = htole16(value);
+	uint32_t q = htole32(value);
+
+	if(block_read(b, buf) >= 0)
+	{
+		if(layout.ptr_size == 4)
+		{
+			memcpy(buf + slot * 4, &q, 4);
+		}
+		else
+		{
+			memcpy(buf + slot * 2, &p, 2);
+		}
+		block_write(b, buf);
+	}
+	free(buf);
+}
+
+//a new, empty pointer block
+static int ptr_new()
+{
+	int b = myBlockIndex();
+
+	if(b >= 0)
+	{
+		char *zero = (char*)calloc(1, BLOCK_SIZE);
+		block_write(b, zero);
+		free(zero);
+	}
+	return b;
+}
+
+//which pointer leads to file block index: 0 direct[*a], 1 indirect[0] slot *a, 2 indirect[1] slot *a then *b; -1 past the end
+static int bmap_path(int index, int *a, int *b)
+{
+	if(index < DIRECT_COUNT)
+	{
+		*a = index;
+		return 0;
+	}
+	index -= DIRECT_COUNT;
+	if(index < PTRS_PER_BLOCK)
+	{
+		*a = index;
+		return 1;
+	}
+	index -= PTRS_PER_BLOCK;
+	if(index < PTRS_PER_BLOCK * PTRS_PER_BLOCK)
+	{
+		*a = index / PTRS_PER_BLOCK;
+		*b = index % PTRS_PER_BLOCK;
+		return 2;
+	}
+	return -1;
+}
+
+/* Disk blocks of file blocks first..first+count-1 into blocks, stopping
+ * at the first that isn't mapped.  Each pointer block is read once for
+ * all the entries taken from it. */
+static int bmap_blocks(const inode *node, int first, int count, int *blocks)
+{
+	unsigned char *top = NULL, *leaf = NULL;
+	int topCur = 0, leafCur = 0;
+	int i, a, b, p = 0;
+
+	for(i = 0; i < count; i++)
+	{
+		switch(bmap_path(first + i, &a, &b))
+		{
+		case 0:
+			p = node->direct[a];
+			break;
+		case 1:
+			if(leaf == NULL)
+			{
+				leaf = (unsigned char*)malloc(BLOCK_SIZE);
+			}
+			p = ptr_valid(node->indirect[0]) ? ptr_get(leaf, &leafCur, node->indirect[0], a) : 0;
+			break;
+		case 2:
+			if(leaf == NULL)
+			{
+				leaf = (unsigned char*)malloc(BLOCK_SIZE);
+			}
+			if(top == NULL)
+			{
+				top = (unsigned char*)malloc(BLOCK_SIZE);
+			}
+			p = ptr_valid(node->indirect[1]) ? ptr_get(top, &topCur, node->indirect[1], a) : 0;
+			p = ptr_valid(p) ? ptr_get(leaf, &leafCur, p, b) : 0;
+			break;
+		default:
+			p = 0;
+		}
+		if(!ptr_valid(p))
+		{
+			break;
+		}
+		blocks[i] = p;
+	}
+
+	free(top);
+	free(leaf);
+	return i;
+}
+
+//map file block index, allocating it (and pointer blocks on the way) if need be; 0 when out of space
+static int bmap_alloc(inode *node, int index)
+{
+	unsigned char *buf = (unsigned char*)malloc(BLOCK_SIZE);
+	int cur = 0, a, b, p = 0, q;
+	unsigned int *slot = NULL;
+
+	switch(bmap_path(index, &a, &b))
+	{
+	case 0:
+		slot = &node->direct[a];
+		break;
+	case 1:
+		slot = &node->indirect[0];
+		break;
+	case 2:
+		slot = &node->indirect[1];
+		break;
+	default:
+		free(buf);
+		return 0;
+	}
+
+	if(index < DIRECT_COUNT)
+	{
+		if(!ptr_valid(*slot) && (p = myBlockIndex()) >= 0)
+		{
+			*slot = p;
+		}
+		free(buf);
+		return ptr_valid(*slot) ? *slot : 0;
+	}
+
+	//top pointer block, hung off the inode
+	if(!ptr_valid(*slot))
+	{
+		if((p = ptr_new()) < 0)
+		{
+			free(buf);
+			return 0;
+		}
+		*slot = p;
+	}
+	p = *slot;
+
+	if(index >= DIRECT_COUNT + PTRS_PER_BLOCK)
+	{
+		//double indirect: the pointer block for slot a of the top one
+		q = ptr_get(buf, &cur, p, a);
+		if(!ptr_valid(q))
+		{
+			if((q = ptr_new()) < 0)
+			{
+				free(buf);
+				return 0;
+			}
+			ptr_set(p, a, q);
+		}
+		p = q;
+		a = b;
+	}
+
+	q = ptr_get(buf, &cur, p, a);
+	if(!ptr_valid(q))
+	{
+		if((q = myBlockIndex()) < 0)
+		{
+			free(buf);
+			return 0;
+		}
+		ptr_set(p, a, q);
+	}
+
+	free(buf);
+	return q;
+}
+
+//free every block of pointer block b (level 2: the pointer blocks it lists too), then b
+static void bmap_free(int b, int level)
+{
+	unsigned char *buf = (unsigned char*)malloc(BLOCK_SIZE);
+	int cur = 0, i, p;
+
+	for(i = 0; i < PTRS_PER_BLOCK; i++)
+	{
+		p = ptr_get(buf, &cur, b, i);
+		if(!ptr_valid(p))
+		{
+			continue;
+		}
+		if(level == 2)
+		{
+			bmap_free(p, 1);
+		}
+		else
+		{
+			freeRun(p, 1);
+		}
+	}
+
+	free(buf);
+	freeRun(b, 1);
+}
+
+int file_block(inode node, int index)
+{
+	int b;
+
+	return file_blocks(node, index, 1, &b) == 1 ? b : 0;
+}
+
+int file_blocks(inode node, int first, int count, int *blocks)
+{
+	extent x;
+	int i = 0, j;
+
+	if(first < 0 || (node.flags & INODE_FL_INLINE))
+	{
+		return 0;
+	}
+
+	if(!(node.flags & INODE_FL_EXTENTS))
+	{
+		return bmap_blocks(&node, first, count, blocks);
+	}
+
+	//one lookup per extent rather than per block
+	while(i < count && ext_lookup(&node, first + i, &x) != 0)
+	{
+		for(j = first + i - x.logical; j < x.length && i < count; j++)
+		{
+			blocks[i++] = x.physical + j;
+		}
+	}
+	return i;
+}
+
+int file_map(inode *node, int n)
+{
+	int i, b, got;
+
+	if(!(node->flags & INODE_FL_EXTENTS))
+	{
+		for(i = 0; i < n && bmap_alloc(node, i) != 0; i++);
+		return i;
+	}
+
+	//claim what's missing a run at a time, right after the current last block if that's free
+	i = ext_end(node);
+	while(i < n)
+	{
+		extent x;
+		int goal = i > 0 ? file_block(*node, i - 1) + 1 : DATA_START;
+
+		b = myBlockRun(goal, n - i, &got);
+		if(b < 0)
+		{
+			break;
+		}
+		x.logical = i;
+		x.physical = b;
+		x.length = got;
+		if(ext_add(node, x) < 0)
+		{
+			freeRun(b, got);
+			break;
+		}
+		i += got;
+	}
+	return i < n ? i : n;
+}
+
+void file_unmap(inode *node)
+{
+	int i;
+
+	if(node->flags & INODE_FL_INLINE)
+	{
+		return; //nothing outside the inode
+	}
+
+	if(node->flags & INODE_FL_EXTENTS)
+	{
+		ext_free(node->ext, node->ext_count, node->ext_depth);
+		node->ext_count = 0;
+		node->ext_depth = 0;
+		return;
+	}
+
+	if(node->flags & INODE_FL_INDEX)
+	{
+		//a directory's index hangs off ext[] (see dir_index_find)
+		ext_free(node->ext, node->ext_count, node->ext_depth);
+		node->ext_count = 0;
+		node->ext_depth = 0;
+		node->flags &= ~INODE_FL_INDEX;
+	}
+
+	for(i = 0; i < INODE_DIRECT; i++)
+	{
+		if(ptr_valid(node->direct[i]))
+		{
+			freeRun(node->direct[i], 1);
+		}
+		node->direct[i] = 0;
+	}
+	for(i = 0; i < 2; i++)
+	{
+		if(ptr_valid(node->indirect[i]))
+		{
+			bmap_free(node->indirect[i], i + 1);
+		}
+		node->indirect[i] = 0;
+	}
+}
+
+//Copy size bytes starting at offset out of a file's data blocks into buf.
+//Only the blocks that overlap the range are touched; in a memory-mapped
+//image they are copied straight out of the mapping.
+int read_range(inode node, char *buf, off_t offset, size_t size)
+{
+	char *readbuff = NULL;
+	char *oneBlock = NULL;
+	const char *src;
+	int i, first, count, chunk, done = 0;
+	int start = offset % BLOCK_SIZE;
+	int *blocks;
+
+	if(node.flags & INODE_FL_INLINE)
+	{
+		//the inode was the only read
+		count = node.info.st_size < INODE_INLINE ? node.info.st_size : INODE_INLINE;
+		if(offset >= count)
+		{
+			return 0;
+		}
+		if(size > count - offset)
+		{
+			size = count - offset;
+		}
+		memcpy(buf, node.inline_data + offset, size);
+		return size;
+	}
+
+	first = offset / BLOCK_SIZE;
+	count = (start + size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	blocks = (int*)malloc(count * sizeof(int));
+	count = file_blocks(node, first, count, blocks);
+
+	if(count > 0 && block_map(blocks[0]) == NULL)
+	{
+		//not mapped: fetch the whole span in one go
+		readbuff = (char*)malloc(count * BLOCK_SIZE);
+		if(block_readv(blocks, count, readbuff) < 0)
+		{
+			free(readbuff);
+			free(blocks);
+			return -EIO; //unreadable, or failed its checksum
+		}
+	}
+
+	for(i = 0; done < size && i < count; i++)
+	{
+		chunk = BLOCK_SIZE - start;
+		if(chunk > size - done)
+		{
+			chunk = size - done;
+		}
+
+		if(readbuff != NULL)
+		{
+			src = readbuff + i * BLOCK_SIZE;
+		}
+		else if((src = block_map(blocks[i])) == NULL)
+		{
+			//past the end of the mapping, or checksummed
+			if(oneBlock == NULL && (oneBlock = (char*)malloc(BLOCK_SIZE)) == NULL)
+			{
+				free(blocks);
+				return -ENOMEM;
+			}
+			if(block_read(blocks[i], oneBlock) < 0)
+			{
+				free(oneBlock);
+				free(blocks);
+				return -EIO;
+			}
+			src = oneBlock;
+		}
+
+		memcpy(buf + done, src + start, chunk);
+		done += chunk;
+		start = 0;
+	}
+
+	free(readbuff);
+	free(oneBlock);
+	free(blocks);
+	return done;
+}
+
+//Copy size bytes from buf into a file's data at offset, mapping blocks
+//for the range if need be.  Only the blocks the range covers are written;
+//the first and last are read first unless they are past st_size, which
+//the caller updates afterwards.  Data held in the inode is left to loopWrite.
+int write_range(inode *node, const char *buf, off_t offset, size_t size)
+{
+	char *writeBuff;
+	int i, first, count, have, ret;
+	int start = offset % BLOCK_SIZE, end;
+	int *blocks;
+
+	if(node->flags & INODE_FL_INLINE)
+	{
+		return -EINVAL;
+	}
+	if(size == 0)
+	{
+		return 0;
+	}
+
+	first = offset / BLOCK_SIZE;
+	count = (start + size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	end = (start + size) % BLOCK_SIZE;
+	have = (node->info.st_size + BLOCK_SIZE - 1) / BLOCK_SIZE; //blocks holding data so far
+
+	//block maps are filled in from the range, not from block 0
+	if(node->flags & INODE_FL_EXTENTS)
+	{
+		i = file_map(node, first + count) - first;
+	}
+	else
+	{
+		for(i = 0; i < count && bmap_alloc(node, first + i) != 0; i++);
+	}
+	if(i < count)
+	{
+		return -ENOSPC;
+	}
+
+	blocks = (int*)malloc(count * sizeof(int));
+	writeBuff = (char*)calloc(count, BLOCK_SIZE);
+	ret = file_blocks(*node, first, count, blocks) == count ? size : -EIO;
+
+	//the edges keep what else they hold
+	if(ret > 0 && start > 0 && first < have && block_read(blocks[0], writeBuff) < 0)
+	{
+		ret = -EIO;
+	}
+	if(ret > 0 && end > 0 && (count > 1 || start == 0) && first + count - 1 < have &&
+	   block_read(blocks[count - 1], writeBuff + (count - 1) * BLOCK_SIZE) < 0)
+	{
+		ret = -EIO;
+	}
+
+	if(ret > 0)
+	{
+		memcpy(writeBuff + start, buf, size);
+		if(block_writev(blocks, count, writeBuff) < 0)
+		{
+			ret = -EIO;
+		}
+	}
+
+	free(writeBuff);
+	free(blocks);
+	return ret;
+}
+
+//Write zeroes over len bytes of a file from offset, a bounded run of
+//blocks at a time.  Returns 0 or write_range's error.
+int zero_range(inode *node, off_t offset, off_t len)
+{
+	size_t chunk = (size_t)BLOCK_SIZE * 64;
+	char *zero = (char*)calloc(1, chunk);
+	int ret = 0;
+
+	while(len > 0 && ret >= 0)
+	{
+		if((off_t)chunk > len)
+		{
+			chunk = len;
+		}
+		ret = write_range(node, zero, offset, chunk);
+		offset += chunk;
+		len -= chunk;
+	}
+
+	free(zero);
+	return ret < 0 ? ret : 0;
+}
+
+void file_readahead(readahead *ra, inode node, off_t offset, size_t size)
+{
+	int n;
+	int last = (offset + size - 1) / BLOCK_SIZE;
+	int fileBlocks = (node.info.st_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	int *blocks;
+
+	if(node.flags & INODE_FL_INLINE)
+	{
+		return;
+	}
+
+	if(offset != ra->next)
+	{
+		//not where the last read stopped, so start over
+		ra->next = offset + size;
+		ra->window = 0;
+		ra->ahead = last + 1;
+		return;
+	}
+
+	ra->next = offset + size;
+
+	//still more than half a window fetched ahead of the reader
+	if(ra->ahead - last > ra->window / 2)
+	{
+		return;
+	}
+
+	//the stream kept up with the last window, so make the next one bigger
+	//sized in bytes so a smaller block size doesn't shrink what is fetched
+	ra->window = ra->window == 0 ? RA_MIN_BYTES / BLOCK_SIZE : ra->window * 2;
+	if(ra->window > RA_MAX_BYTES / BLOCK_SIZE)
+	{
+		ra->window = RA_MAX_BYTES / BLOCK_SIZE;
+	}
+
+	if(ra->ahead <= last)
+	{
+		ra->ahead = last + 1;
+	}
+
+	n = last + 1 + ra->window;
+	if(n > fileBlocks)
+	{
+		n = fileBlocks;
+	}
+	if(n <= ra->ahead || (blocks = (int*)malloc((n - ra->ahead) * sizeof(int))) == NULL)
+	{
+		return;
+	}
+	n = file_blocks(node, ra->ahead, n - ra->ahead, blocks);
+
+	if(n > 0)
+	{
+		block_readahead(blocks, n);
+	}
+	free(blocks);
+	ra->ahead += n;
+}
+
+static int* super_list()
+{
+    int i;
+    int *blocks = (int*)malloc(layout.super_blocks * sizeof(int));
+    for(i = 0; i < layout.super_blocks; i++)
+    {
+	blocks[i] = i;
+    }
+    return blocks;
+}
+
+char* read_super()
+{
+    char *buffer = (char*)malloc(layout.super_blocks * BLOCK_SIZE);
+    int *blocks = super_list();
+
+    //the super region is contiguous, so this is a single read
+    block_readv(blocks, layout.super_blocks, buffer);
+
+    free(blocks);
+    return buffer;
+}
+
+void write_super(char *buffer)
+{
+    int *blocks = super_list();
+    block_writev(blocks, layout.super_blocks, buffer);
+    free(blocks);
+}
+
+static void put_le32(unsigned char *p, unsigned int v)
+{
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
+
+static unsigned int get_le32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+int format_layout(int blockSize, int checksums, int inodes, int inodeSize, long long imageSize)
+{
+    long long blocks = (imageSize > 0 ? imageSize : SYSTEM_SIZE) / blockSize;
+
+    if(inodeSize == 0)
+    {
+	inodeSize = INODE_SIZE;
+    }
+    if(inodeSize < INODE_SIZE || inodeSize > INODE_SIZE_MAX || inodeSize > blockSize || (inodeSize & (inodeSize - 1)))
+    {
+	log_msg("Bad inode size %d\n", inodeSize);
+	return -1;
+    }
+    //block numbers are ints here and 32 bits on disk
+    if(blocks < IMAGE_BLOCKS_MIN || blocks > INT_MAX)
+    {
+	log_msg("Bad image size %lld: %lld blocks, %d to %d allowed\n", imageSize, blocks, IMAGE_BLOCKS_MIN, INT_MAX);
+	return -1;
+    }
+
+    memset(&layout, 0, sizeof(layout));
+    layout.magic = SFS_MAGIC;
+    layout.version = SFS_VERSION;
+    layout.block_size = blockSize;
+    layout.block_count = blocks;
+    layout.ptr_size = 4;
+
+    layout.inode_size = inodeSize;
+    layout.inodes_per_block = blockSize / inodeSize;
+    layout.ino_base = 1;
+
+    //keep at least three quarters of the image for data
+    layout.inode_count = inodes > 0 ? inodes : INODE_COUNT_DEFAULT;
+    if(layout.inode_count > (long long)layout.block_count / 4 * layout.inodes_per_block)
+    {
+	layout.inode_count = ((long long)layout.block_count / 4 * layout.inodes_per_block) & ~7;
+    }
+    layout.inode_blocks = (layout.inode_count + layout.inodes_per_block - 1) / layout.inodes_per_block;
+
+    layout.inode_map_off = SFS_HEADER_SIZE;
+    layout.data_map_off = layout.inode_map_off + (layout.inode_count + 7) / 8;
+    layout.super_blocks = (layout.data_map_off + (layout.block_count + 7) / 8 + blockSize - 1) / blockSize;
+    layout.csum_start = layout.super_blocks;
+    layout.csum_blocks = checksums ? ((long long)layout.block_count * 4 + blockSize - 1) / blockSize : 0;
+    layout.inode_start = layout.csum_start + layout.csum_blocks;
+    layout.data_start = layout.inode_start + layout.inode_blocks;
+    layout.data_count = layout.block_count - layout.data_start;
+    layout.stripe_members = block_stripe_members();
+    layout.stripe_width = block_stripe_width();
+
+    log_msg("Formatting: %d byte blocks, %d blocks, %d %d byte inodes in %d blocks, data at %d\n",
+	    layout.block_size, layout.block_count, layout.inode_count, layout.inode_size, layout.inode_blocks, layout.data_start);
+    return 0;
+}
+
+void write_header(unsigned char *buf)
+{
+    //older headers were 64 bytes, with the inode bitmap straight after
+    memset(buf, 0, layout.version >= 4 ? SFS_HEADER_SIZE : 64);
+    put_le32(buf, layout.magic);
+    put_le32(buf + 4, layout.version);
+    put_le32(buf + 8, layout.block_size);
+    put_le32(buf + 12, layout.block_count);
+    put_le32(buf + 16, layout.super_blocks);
+    put_le32(buf + 20, layout.inode_start);
+    put_le32(buf + 24, layout.inode_count);
+    put_le32(buf + 28, layout.data_start);
+    put_le32(buf + 32, layout.data_count);
+    put_le32(buf + 36, layout.inode_map_off);
+    put_le32(buf + 40, layout.data_map_off);
+    put_le32(buf + 44, layout.csum_start);
+    put_le32(buf + 48, layout.csum_blocks);
+    put_le32(buf + 52, layout.stripe_members);
+    put_le32(buf + 56, layout.stripe_width);
+    put_le32(buf + 60, layout.inodes_per_block);
+    if(layout.version >= 4)
+    {
+	put_le32(buf + 64, layout.inode_size);
+	put_le32(buf + 68, layout.ichunk_start);
+	put_le32(buf + 72, layout.ichunk_count);
+    }
+}
+
+int read_layout(char *block0)
+{
+    const unsigned char *p = (const unsigned char*)block0;
+
+    memset(&layout, 0, sizeof(layout));
+    if(get_le32(p) != SFS_MAGIC)
+    {
+	//image from before the header: everything was fixed
+	layout.version = 0;
+	layout.block_size = 512;
+	layout.block_count = 32768;
+	layout.super_blocks = 8;
+	layout.inode_start = 8;
+	layout.inode_count = 512;
+	layout.data_start = 520;
+	layout.data_count = 32248;
+	layout.inode_map_off = 0;
+	layout.data_map_off = 64;
+	layout.inodes_per_block = 1;
+	layout.inode_size = 512;
+	layout.ptr_size = 2;
+	layout.inode_blocks = 512;
+	layout.ino_base = 8;
+	log_msg("No superblock header, using the version 0 layout\n");
+	return layout.block_size;
+    }
+
+    layout.magic = get_le32(p);
+    layout.version = get_le32(p + 4);
+    layout.block_size = get_le32(p + 8);
+    layout.block_count = get_le32(p + 12);
+    layout.super_blocks = get_le32(p + 16);
+    layout.inode_start = get_le32(p + 20);
+    layout.inode_count = get_le32(p + 24);
+    layout.data_start = get_le32(p + 28);
+    layout.data_count = get_le32(p + 32);
+    layout.inode_map_off = get_le32(p + 36);
+    layout.data_map_off = get_le32(p + 40);
+    layout.csum_start = get_le32(p + 44);
+    layout.csum_blocks = get_le32(p + 48);
+    layout.stripe_members = get_le32(p + 52);
+    layout.stripe_width = get_le32(p + 56);
+    layout.inodes_per_block = get_le32(p + 60);
+    layout.inode_size = layout.version >= 4 ? get_le32(p + 64) : INODE_SIZE;
+    layout.ichunk_start = layout.version >= 4 ? get_le32(p + 68) : 0;
+    layout.ichunk_count = layout.version >= 4 ? get_le32(p + 72) : 0;
+    layout.ptr_size = layout.version >= 5 ? 4 : 2;
+    if(layout.version < 3)
+    {
+	//a block per inode, numbered by block
+	layout.inodes_per_block = 1;
+	layout.inode_size = layout.block_size;
+	layout.ino_base = layout.inode_start;
+    }
+    else
+    {
+	layout.ino_base = 1;
+    }
+    layout.inode_blocks = (layout.inode_count + layout.inodes_per_block - 1) / layout.inodes_per_block;
+    log_msg("Superblock: version %d, %d byte blocks, %d blocks, data at %d\n",
+	    layout.version, layout.block_size, layout.block_count, layout.data_start);
+    return layout.block_size;
+}
+
+/*
+ * Directory index
+ *
+ * A directory bigger than a block also gets a hashed index of its
+ * entries, so a lookup reads the index's root, any interior blocks and
+ * one leaf instead of the whole directory.  The index is a little file
+ * of its own, mapped with extents through the directory inode's ext[]
+ * (which block-mapped directories don't otherwise use), and
+ * INODE_FL_INDEX says it is there.
+ *
+ * Every entry is keyed by the CRC32C of its name.  Block 0 is the root:
+ * a DIR_INDEX_HEADER (magic, levels below it, entry count, the directory
+ * size the index matches and the number of index blocks) and then
+ * (hash, block) pairs sorted by hash, each covering the hashes from its
+ * own up to the next one's.  The blocks they point at are interior
+ * blocks of the same form or, at the bottom, leaves: a header (magic,
+ * record count, bytes used) then records of hash, inode number, name
+ * length and name.  A full leaf is split in two at a hash boundary, so
+ * names with the same hash stay in one leaf, and a full interior block
+ * likewise; a full root has its entries moved down into a new block.
+ *
+ * The index is kept up to date by writeToDirectory.  Anything it can't
+ * deal with (a leaf full of one hash, no space, a name over 255 bytes),
+ * or a directory size other than the one it was last updated for, just
+ * means the index is dropped and lookups scan the directory as before.
+ * It stays dropped until a scan fails to find a name, which costs as much
+ * as building it again, so that is when it is rebuilt; a directory whose
+ * index keeps failing isn't rebuilt on every change.
+ */
+#define DX_MAGIC 0x5844 //"DX", root and interior blocks
+#define DX_LEAF_MAGIC 0x4c44 //"DL"
+#define DX_HEADER 16
+#define DX_ENTRIES ((BLOCK_SIZE - DX_HEADER) / 8)
+#define DX_NAME_MAX 255
+
+typedef struct dx_rec
+{
+    unsigned int hash;
+    int off, len; //where the record is in its leaf, and its size
+} dx_rec;
+
+static unsigned int dx_hash(const char *name)
+{
+    return crc32c(0, name, strlen(name));
+}
+
+//the directory's index as an extent mapped inode of its own
+static void dx_view(const inode *dir, inode *view)
+{
+    memset(view, 0, sizeof(*view));
+    view->info.st_ino = dir->info.st_ino;
+    view->flags = INODE_FL_EXTENTS;
+    view->ext_count = dir->ext_count;
+    view->ext_depth = dir->ext_depth;
+    memcpy(view->ext, dir->ext, sizeof(view->ext));
+}
+
+static void dx_unview(inode *dir, const inode *view)
+{
+    dir->ext_count = view->ext_count;
+    dir->ext_depth = view->ext_depth;
+    memcpy(dir->ext, view->ext, sizeof(dir->ext));
+}
+
+static int dx_read(inode *view, int logical, unsigned char *buf)
+{
+    int b = file_block(*view, logical);
+
+    return b > 0 && block_read(b, buf) >= 0 ? 0 : -1;
+}
+
+static int dx_write(inode *view, int logical, unsigned char *buf)
+{
+    int b = file_block(*view, logical);
+
+    return b > 0 && block_write(b, buf) >= 0 ? 0 : -1;
+}
+
+//a new block at the end of the index; the count is kept in the root's header
+static int dx_new(inode *view, unsigned char *root)
+{
+    int n = get_le32(root + 12);
+
+    if(file_map(view, n + 1) != n + 1)
+    {
+	return -1;
+    }
+    put_le32(root + 12, n + 1);
+    return n;
+}
+
+static void dx_header(unsigned char *buf, int magic, int depth)
+{
+    memset(buf, 0, BLOCK_SIZE);
+    buf[0] = magic & 0xff;
+    buf[1] = magic >> 8;
+    buf[2] = depth & 0xff;
+    buf[3] = depth >> 8;
+}
+
+static int dx_depth(const unsigned char *buf)
+{
+    return buf[2] | (buf[3] << 8);
+}
+
+static int dx_magic(const unsigned char *buf)
+{
+    return buf[0] | (buf[1] << 8);
+}
+
+//the last entry of an interior block whose hash is at or below h
+static int dx_search(const unsigned char *buf, unsigned int h)
+{
+    int lo = 1, hi = get_le32(buf + 4) - 1, found = 0;
+
+    while(lo <= hi)
+    {
+	int mid = (lo + hi) / 2;
+	if(get_le32(buf + DX_HEADER + mid * 8) <= h)
+	{
+	    found = mid;
+	    lo = mid + 1;
+	}
+	else
+	{
+	    hi = mid - 1;
+	}
+    }
+    return found;
+}
+
+//put (h, child) in at entry pos of a block known to have room
+static void dx_node_put(unsigned char *buf, int pos, unsigned int h, int child)
+{
+    int count = get_le32(buf + 4);
+    unsigned char *p = buf + DX_HEADER + pos * 8;
+
+    memmove(p + 8, p, (count - pos) * 8);
+    put_le32(p, h);
+    put_le32(p + 4, child);
+    put_le32(buf + 4, count + 1);
+}
+
+static int dx_rec_cmp(const void *a, const void *b)
+{
+    unsigned int x = ((const dx_rec*)a)->hash, y = ((const dx_rec*)b)->hash;
+
+    return x < y ? -1 : x > y;
+}
+
+//add the record rec to a leaf, splitting it if it is full: 1 and the new leaf's first hash and block then
+static int dx_leaf_add(inode *view, unsigned char *root, unsigned char *buf, int blk,
+		       const unsigned char *rec, int recLen, unsigned int h, unsigned int *splitHash, int *splitBlk)
+{
+    int count = get_le32(buf + 4), used = get_le32(buf + 8);
+    int i, k, nb, off, retstat = -1;
+    dx_rec *recs;
+    unsigned char *left, *right, *into;
+
+    if(DX_HEADER + used + recLen <= BLOCK_SIZE)
+    {
+	memcpy(buf + DX_HEADER + used, rec, recLen);
+	put_le32(buf + 4, count + 1);
+	put_le32(buf + 8, used + recLen);
+	return dx_write(view, blk, buf);
+    }
+
+    recs = (dx_rec*)malloc(count * sizeof(dx_rec));
+    for(i = 0, off = DX_HEADER; i < count; i++)
+    {
+	recs[i].hash = get_le32(buf + off);
+	recs[i].off = off;
+	recs[i].len = 9 + buf[off + 8];
+	off += recs[i].len;
+    }
+    qsort(recs, count, sizeof(dx_rec), dx_rec_cmp);
+
+    //split as near the middle as the hashes allow
+    for(k = 0, i = 0; i <= count / 2 && k == 0; i++)
+    {
+	if(count / 2 + i < count && count / 2 + i > 0 && recs[count / 2 + i - 1].hash != recs[count / 2 + i].hash)
+	{
+	    k = count / 2 + i;
+	}
+	else if(count / 2 - i > 0 && recs[count / 2 - i - 1].hash != recs[count / 2 - i].hash)
+	{
+	    k = count / 2 - i;
+	}
+    }
+    if(k == 0 || (nb = dx_new(view, root)) < 0)
+    {
+	free(recs);
+	return -1;
+    }
+
+    left = (unsigned char*)malloc(BLOCK_SIZE);
+    right = (unsigned char*)malloc(BLOCK_SIZE);
+    dx_header(left, DX_LEAF_MAGIC, 0);
+    dx_header(right, DX_LEAF_MAGIC, 0);
+    for(i = 0; i < count; i++)
+    {
+	into = i < k ? left : right;
+	used = get_le32(into + 8);
+	memcpy(into + DX_HEADER + used, buf + recs[i].off, recs[i].len);
+	put_le32(into + 4, get_le32(into + 4) + 1);
+	put_le32(into + 8, used + recs[i].len);
+    }
+
+    *splitHash = recs[k].hash;
+    *splitBlk = nb;
+    into = h < *splitHash ? left : right;
+    used = get_le32(into + 8);
+    if(DX_HEADER + used + recLen <= BLOCK_SIZE)
+    {
+	memcpy(into + DX_HEADER + used, rec, recLen);
+	put_le32(into + 4, get_le32(into + 4) + 1);
+	put_le32(into + 8, used + recLen);
+	if(dx_write(view, blk, left) == 0 && dx_write(view, nb, right) == 0)
+	{
+	    retstat = 1;
+	}
+    }
+
+    free(left);
+    free(right);
+    free(recs);
+    return retstat;
+}
+
+/* Add rec under the interior block in buf (block blk).  Returns 0 when
+ * it went in, 1 when the block split (the new block's first hash and
+ * number in *splitHash and *splitBlk), -1 when the index can't take it. */
+static int dx_add(inode *view, unsigned char *root, unsigned char *buf, int blk,
+		  const unsigned char *rec, int recLen, unsigned int h, unsigned int *splitHash, int *splitBlk)
+{
+    unsigned char *child = (unsigned char*)malloc(BLOCK_SIZE), *right;
+    int pos = dx_search(buf, h), depth = dx_depth(buf), count, half, nb, r;
+    int childBlk = get_le32(buf + DX_HEADER + pos * 8 + 4);
+    unsigned int sh;
+    int sb;
+
+    if(dx_read(view, childBlk, child) < 0)
+    {
+	free(child);
+	return -1;
+    }
+    if(depth == 0)
+    {
+	r = dx_leaf_add(view, root, child, childBlk, rec, recLen, h, &sh, &sb);
+    }
+    else
+    {
+	r = dx_add(view, root, child, childBlk, rec, recLen, h, &sh, &sb);
+    }
+    free(child);
+    if(r != 1)
+    {
+	return r;
+    }
+
+    //the child split: its new half goes in after it
+    count = get_le32(buf + 4);
+    if(count < DX_ENTRIES)
+    {
+	dx_node_put(buf, pos + 1, sh, sb);
+	return blk == 0 ? 0 : dx_write(view, blk, buf); //the root is written by the caller
+    }
+    if(blk == 0)
+    {
+	return -1; //the caller moves the root's entries down first, so this can't happen
+    }
+
+    //full: the upper half moves to a new block
+    if((nb = dx_new(view, root)) < 0)
+    {
+	return -1;
+    }
+    right = (unsigned char*)malloc(BLOCK_SIZE);
+    half = count / 2;
+    dx_header(right, DX_MAGIC, depth);
+    memcpy(right + DX_HEADER, buf + DX_HEADER + half * 8, (count - half) * 8);
+    put_le32(right + 4, count - half);
+    put_le32(buf + 4, half);
+    if(pos + 1 <= half)
+    {
+	dx_node_put(buf, pos + 1, sh, sb);
+    }
+    else
+    {
+	dx_node_put(right, pos + 1 - half, sh, sb);
+    }
+    *splitHash = get_le32(right + DX_HEADER);
+    *splitBlk = nb;
+    r = dx_write(view, blk, buf) == 0 && dx_write(view, nb, right) == 0 ? 1 : -1;
+    free(right);
+    return r;
+}
+
+//add name to the index in root, writing the root back
+static int dx_insert(inode *view, unsigned char *root, int ino, const char *name)
+{
+    unsigned char rec[9 + DX_NAME_MAX];
+    int len = strlen(name), nb, r;
+    unsigned int h = dx_hash(name), sh;
+    int sb;
+
+    if(len > DX_NAME_MAX)
+    {
+	return -1;
+    }
+    put_le32(rec, h);
+    put_le32(rec + 4, ino);
+    rec[8] = len;
+    memcpy(rec + 9, name, len);
+
+    if(get_le32(root + 4) == DX_ENTRIES)
+    {
+	//no room left for a split below: the root's entries move to a block of their own, a level down
+	unsigned char *moved;
+	int depth = dx_depth(root);
+
+	if((nb = dx_new(view, root)) < 0)
+	{
+	    return -1;
+	}
+	moved = (unsigned char*)malloc(BLOCK_SIZE);
+	memcpy(moved, root, BLOCK_SIZE);
+	put_le32(moved + 8, 0); //size and block count are the root's alone
+	put_le32(moved + 12, 0);
+	r = dx_write(view, nb, moved);
+	free(moved);
+	if(r < 0)
+	{
+	    return -1;
+	}
+	root[2] = (depth + 1) & 0xff;
+	root[3] = (depth + 1) >> 8;
+	memset(root + DX_HEADER, 0, BLOCK_SIZE - DX_HEADER);
+	put_le32(root + 4, 0);
+	dx_node_put(root, 0, 0, nb);
+    }
+
+    r = dx_add(view, root, root, 0, rec, 9 + len, h, &sh, &sb);
+    if(r < 0)
+    {
+	return -1;
+    }
+    return dx_write(view, 0, root);
+}
+
+/* Walk down from the root in buf to the leaf that covers h, leaving it
+ * in buf.  Returns its block, or -1. */
+static int dx_leaf(inode *view, unsigned char *buf, unsigned int h)
+{
+    int blk = 0, level;
+
+    for(level = 0; level < 8 && dx_magic(buf) == DX_MAGIC; level++)
+    {
+	blk = get_le32(buf + DX_HEADER + dx_search(buf, h) * 8 + 4);
+	if(dx_read(view, blk, buf) < 0)
+	{
+	    return -1;
+	}
+    }
+    return dx_magic(buf) == DX_LEAF_MAGIC ? blk : -1;
+}
+
+//the offset of name's record in the leaf in buf, 0 if it isn't there
+static int dx_leaf_find(const unsigned char *buf, unsigned int h, const char *name)
+{
+    int count = get_le32(buf + 4), len = strlen(name), i, off;
+
+    for(i = 0, off = DX_HEADER; i < count && off + 9 <= BLOCK_SIZE; i++, off += 9 + buf[off + 8])
+    {
+	if(get_le32(buf + off) == h && buf[off + 8] == len && memcmp(buf + off + 9, name, len) == 0)
+	{
+	    return off;
+	}
+    }
+    return 0;
+}
+
+//read the root of dir's index into buf; -1 if there is none or it is out of date
+static int dx_root(const inode *dir, inode *view, unsigned char *buf)
+{
+    if(!(dir->flags & INODE_FL_INDEX))
+    {
+	return -1;
+    }
+    dx_view(dir, view);
+    if(dx_read(view, 0, buf) < 0 || dx_magic(buf) != DX_MAGIC || get_le32(buf + 8) != dir->info.st_size)
+    {
+	return -1;
+    }
+    return 0;
+}
+
+/** Look a name up in a directory's index
+ *
+ * Returns its inode number, -1 if it isn't in the directory, or -2 if
+ * the directory has no usable index (the caller then scans it).
+ */
+int dir_index_find(inode dir, const char *name)
+{
+    unsigned char *buf = (unsigned char*)malloc(BLOCK_SIZE);
+    unsigned int h = dx_hash(name);
+    int ino = -2, off;
+    inode view;
+
+    if(dx_root(&dir, &view, buf) == 0 && dx_leaf(&view, buf, h) >= 0)
+    {
+	off = dx_leaf_find(buf, h, name);
+	ino = off > 0 ? (int)get_le32(buf + off + 4) : -1;
+    }
+
+    free(buf);
+    return ino;
+}
+
+//free a directory's index
+static void dx_drop(inode *dir)
+{
+    inode view;
+
+    if(dir->flags & INODE_FL_INDEX)
+    {
+	dx_view(dir, &view);
+	file_unmap(&view);
+	dir->flags &= ~INODE_FL_INDEX;
+	dir->ext_count = 0;
+	dir->ext_depth = 0;
+	memset(dir->ext, 0, sizeof(dir->ext));
+    }
+}
+
+//index every entry of dir, which holds size bytes of dir_entry records
+static void dx_build(inode *dir, int size)
+{
+    unsigned char *root = (unsigned char*)malloc(BLOCK_SIZE), *leaf = (unsigned char*)malloc(BLOCK_SIZE);
+    char *blk = (char*)malloc(BLOCK_SIZE);
+    char name[DIRENT_NAME_MAX + 1];
+    int ok, b, off;
+    dir_entry *d;
+    inode view;
+
+    dx_view(dir, &view); //no ext[] yet
+    dx_header(root, DX_MAGIC, 0);
+    dx_header(leaf, DX_LEAF_MAGIC, 0);
+    dx_node_put(root, 0, 0, 1);
+    put_le32(root + 12, 2);
+    ok = file_map(&view, 2) == 2 && dx_write(&view, 1, leaf) == 0;
+
+    for(b = 0; ok && b < size / BLOCK_SIZE; b++)
+    {
+	ok = dir_block(*dir, b, blk) == 0;
+	for(off = 0; ok && (d = dirent_next(blk, &off)) != NULL; )
+	{
+	    if(d->ino != 0)
 	    {
-		    dataMap[blockLocData] &= 0xdf;
+		memcpy(name, d->name, d->name_len);
+		name[d->name_len] = '\0';
+		ok = dx_insert(&view, root, le32toh(d->ino), name) == 0;
 	    }
-	    else if (bitLocData == 3)
+	}
+    }
+
+    put_le32(root + 8, size);
+    ok = ok && dx_write(&view, 0, root) == 0;
+    dx_unview(dir, &view);
+    dir->flags |= INODE_FL_INDEX;
+    if(!ok)
+    {
+	log_msg("Could not index directory %d\n", dir->info.st_ino);
+	dx_drop(dir);
+    }
+
+    free(blk);
+    free(root);
+    free(leaf);
+}
+
+/* Bring dir's index up to date with a change to it: ino and name were
+ * added (flag MY_APPEND) or removed, leaving size bytes of entries, which
+ * are already on disk.  A directory that has just outgrown its first
+ * block is indexed; an index that can't be updated is dropped and left
+ * for dir_index_rebuild. */
+static void dx_update(inode *dir, int flag, int ino, const char *name, int size)
+{
+    unsigned char *buf = (unsigned char*)malloc(BLOCK_SIZE);
+    int ok = 0, blk, off;
+    unsigned int h;
+    inode view;
+
+    if(dx_root(dir, &view, buf) == 0)
+    {
+	if(flag == MY_APPEND)
+	{
+	    ok = dx_insert(&view, buf, ino, name) == 0;
+	}
+	else
+	{
+	    unsigned char *leaf = (unsigned char*)malloc(BLOCK_SIZE);
+
+	    h = dx_hash(name);
+	    memcpy(leaf, buf, BLOCK_SIZE);
+	    if((blk = dx_leaf(&view, leaf, h)) >= 0)
 	    {
-	        dataMap[blockLocData] &= 0xef;
+		off = dx_leaf_find(leaf, h, name);
+		if(off > 0)
+		{
+		    int len = 9 + leaf[off + 8], used = get_le32(leaf + 8);
+
+		    memmove(leaf + off, leaf + off + len, DX_HEADER + used - off - len);
+		    memset(leaf + DX_HEADER + used - len, 0, len);
+		    put_le32(leaf + 4, get_le32(leaf + 4) - 1);
+		    put_le32(leaf + 8, used - len);
+		    ok = dx_write(&view, blk, leaf) == 0;
+		}
 	    }
-	    else if (bitLocData == 4)
+	    free(leaf);
+	}
+	if(ok)
+	{
+	    put_le32(buf + 8, size);
+	    ok = dx_write(&view, 0, buf) == 0;
+	}
+	dx_unview(dir, &view);
+    }
+    free(buf);
+
+    if(ok)
+    {
+	return;
+    }
+    if(dir->flags & INODE_FL_INDEX)
+    {
+	dx_drop(dir);
+    }
+    else if(size > BLOCK_SIZE && dir->info.st_size <= BLOCK_SIZE)
+    {
+	dx_build(dir, size);
+    }
+}
+
+/** Index directory ino again after its index was dropped
+ *
+ * dir_find calls this when it had to scan a directory of more than one
+ * block and didn't find the name.  parentNode and rootNode are kept in
+ * step, since they are written back as they stand.
+ */
+void dir_index_rebuild(int ino)
+{
+    inode dir = read_from_file(ino);
+
+    dx_drop(&dir);
+    dx_build(&dir, dir.info.st_size);
+    write_to_file(dir);
+    if(parentNode.info.st_ino == (ino_t)ino)
+    {
+	parentNode = dir;
+    }
+    if(rootNode.info.st_ino == (ino_t)ino)
+    {
+	rootNode = dir;
+    }
+}
+
+/*
+ * Free space in directories
+ *
+ * A new entry goes in the first record, in any block, with enough slack
+ * after its own name for it, as in ext2, so the space dir_remove frees is
+ * used again and a directory whose names come and go stays the same
+ * size.  Records are never moved to make room, so readdir offsets hold.
+ * So that finding the block doesn't mean reading the directory, the most
+ * slack in each block is kept in memory for the last DIR_ROOM_DIRS
+ * directories added to.  A directory that has no slot yet starts out
+ * knowing only its last block, and learns the rest as dir_add and
+ * dir_remove write blocks, so a create never reads more than one block
+ * to look for room.  A figure that is too high only costs a block read
+ * before it is put right.
+ */
+#define DIR_ROOM_DIRS 16
+
+typedef struct dir_room
+{
+    int dir; //inode number, 0 for an unused slot
+    int blocks; //blocks of the directory room covers
+    int *room; //the most slack of any record in each block
+    unsigned long used; //when it was last looked at
+} dir_room;
+
+static dir_room dir_rooms[DIR_ROOM_DIRS];
+static unsigned long dir_room_clock = 0;
+static pthread_mutex_t dir_room_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//the most bytes a new record could take in directory block blk
+static int dirent_room(char *blk)
+{
+    int off = 0, room = 0, r;
+    dir_entry *d;
+
+    while((d = dirent_next(blk, &off)) != NULL)
+    {
+	r = d->ino == 0 ? dirent_len(d) : dirent_len(d) - DIRENT_LEN(d->name_len);
+	room = r > room ? r : room;
+    }
+    return room;
+}
+
+//directory dir's slot, or NULL; with claim set, one is taken from the least recently used
+static dir_room *dir_room_slot(int dir, int claim)
+{
+    dir_room *r, *old = &dir_rooms[0];
+
+    for(r = dir_rooms; r < dir_rooms + DIR_ROOM_DIRS; r++)
+    {
+	if(r->dir == dir)
+	{
+	    return r;
+	}
+	old = r->used < old->used ? r : old;
+    }
+    if(!claim)
+    {
+	return NULL;
+    }
+    free(old->room);
+    old->dir = dir;
+    old->blocks = 0;
+    old->room = NULL;
+    return old;
+}
+
+//the first block of dir with a record that has need bytes to spare, or -1
+static int dir_room_find(inode *dir, int need)
+{
+    char *blk;
+    int blocks = dir->info.st_size / BLOCK_SIZE, b, last = 0;
+    int *room;
+    dir_room *r;
+
+    pthread_mutex_lock(&dir_room_lock);
+    r = dir_room_slot(dir->info.st_ino, 0);
+    if(r == NULL || r->blocks != blocks)
+    {
+	//not seen lately: only the last block is read, so a create costs one
+	//read however big the directory is; slack further back is picked up
+	//again as dir_remove and dir_add write those blocks
+	pthread_mutex_unlock(&dir_room_lock);
+	if(blocks > 0 && (blk = (char*)malloc(BLOCK_SIZE)) != NULL)
+	{
+	    last = dir_block(*dir, blocks - 1, blk) == 0 ? dirent_room(blk) : 0;
+	    free(blk);
+	}
+	room = (int*)calloc(blocks > 0 ? blocks : 1, sizeof(int));
+	if(room == NULL)
+	{
+	    return -1; //dir_add appends a block instead
+	}
+	if(blocks > 0)
+	{
+	    room[blocks - 1] = last;
+	}
+	pthread_mutex_lock(&dir_room_lock);
+	r = dir_room_slot(dir->info.st_ino, 1);
+	free(r->room);
+	r->room = room;
+	r->blocks = blocks;
+    }
+    r->used = ++dir_room_clock;
+    for(b = 0; b < r->blocks && r->room[b] < need; b++);
+    b = b < r->blocks ? b : -1;
+    pthread_mutex_unlock(&dir_room_lock);
+    return b;
+}
+
+//block b of directory dir, which may be the one just added, now has room bytes to spare
+static void dir_room_set(int dir, int b, int room)
+{
+    dir_room *r;
+    int *grown;
+
+    pthread_mutex_lock(&dir_room_lock);
+    if((r = dir_room_slot(dir, 0)) != NULL)
+    {
+	if(b == r->blocks)
+	{
+	    grown = (int*)realloc(r->room, (b + 1) * sizeof(int));
+	    if(grown == NULL)
 	    {
-            dataMap[blockLocData] &= 0xf7;
+		//forget it; the next dir_room_find starts it again
+		free(r->room);
+		memset(r, 0, sizeof(dir_room));
+		pthread_mutex_unlock(&dir_room_lock);
+		return;
 	    }
-	    else if (bitLocData == 5)
+	    r->room = grown;
+	    r->blocks++;
+	}
+	if(b < r->blocks)
+	{
+	    r->room[b] = room;
+	}
+    }
+    pthread_mutex_unlock(&dir_room_lock);
+}
+
+void dir_room_purge(int dir)
+{
+    dir_room *r;
+
+    pthread_mutex_lock(&dir_room_lock);
+    if((r = dir_room_slot(dir, 0)) != NULL)
+    {
+	free(r->room);
+	memset(r, 0, sizeof(dir_room));
+    }
+    pthread_mutex_unlock(&dir_room_lock);
+}
+
+//Add name to directory dir as inode ino of the given mode.  It goes in the
+//first record with room for it after its own name, or failing that in a
+//new block, so one block and the inode are written.
+static int dir_add(inode *dir, int ino, const char *name, mode_t mode)
+{
+    char *blk;
+    int len = strlen(name), need = DIRENT_LEN(len), size = dir->info.st_size;
+    int b, off, used = 0;
+    dir_entry *d = NULL;
+
+    if(len == 0 || len > DIRENT_NAME_MAX)
+    {
+	return -ENAMETOOLONG;
+    }
+    if((blk = (char*)malloc(BLOCK_SIZE)) == NULL)
+    {
+	return -ENOMEM;
+    }
+
+    while(d == NULL && (b = dir_room_find(dir, need)) >= 0)
+    {
+	if(dir_block(*dir, b, blk) < 0)
+	{
+	    dir_room_set(dir->info.st_ino, b, 0);
+	    continue;
+	}
+	for(off = 0; (d = dirent_next(blk, &off)) != NULL; )
+	{
+	    used = d->ino != 0 ? DIRENT_LEN(d->name_len) : 0;
+	    if(dirent_len(d) - used >= need)
 	    {
-            dataMap[blockLocData] &= 0xfb;
+		break;
 	    }
-	    else if (bitLocData == 6)
+	}
+	if(d == NULL)
+	{
+	    dir_room_set(dir->info.st_ino, b, dirent_room(blk)); //less than it said
+	}
+    }
+
+    if(d != NULL)
+    {
+	//split the slack off the record, or take over an unused one
+	dirent_set((dir_entry*)((char*)d + used), dirent_len(d) - used, ino, name, len, mode);
+	if(used > 0)
+	{
+	    dirent_set_len(d, used);
+	}
+    }
+    else
+    {
+	b = size / BLOCK_SIZE;
+	size += BLOCK_SIZE;
+	memset(blk, 0, BLOCK_SIZE);
+	dirent_set((dir_entry*)blk, BLOCK_SIZE, ino, name, len, mode);
+    }
+
+    if(write_range(dir, blk, (off_t)b * BLOCK_SIZE, BLOCK_SIZE) != BLOCK_SIZE)
+    {
+	free(blk);
+	return -ENOSPC;
+    }
+    dir_room_set(dir->info.st_ino, b, dirent_room(blk));
+    free(blk);
+
+    dx_update(dir, MY_APPEND, ino, name, size); //checked against the size before this change
+    dcache_set(dir->info.st_ino, name, ino);
+    dir->info.st_size = size;
+    dir->info.st_blocks = size / BLOCK_SIZE;
+    write_to_file(*dir);
+    return 0;
+}
+
+//Take name out of directory dir, writing back just the block it was in.
+//Returns the inode number it had, or -1 if it wasn't there.
+static int dir_remove(inode *dir, const char *name)
+{
+    char *blk = (char*)malloc(BLOCK_SIZE);
+    int len = strlen(name), ino = -1, b, off;
+    dir_entry *d, *prev;
+
+    if(blk == NULL)
+    {
+	return -1;
+    }
+
+    for(b = 0; ino < 0 && b < dir->info.st_size / BLOCK_SIZE && dir_block(*dir, b, blk) == 0; b++)
+    {
+	for(off = 0, prev = NULL; (d = dirent_next(blk, &off)) != NULL; prev = d)
+	{
+	    if(d->ino != 0 && d->name_len == len && memcmp(d->name, name, len) == 0)
 	    {
-            dataMap[blockLocData] &= 0xfd;
+		ino = le32toh(d->ino);
+		if(prev != NULL)
+		{
+		    dirent_set_len(prev, dirent_len(prev) + dirent_len(d));
+		}
+		else
+		{
+		    d->ino = 0;
+		}
+		write_range(dir, blk, (off_t)b * BLOCK_SIZE, BLOCK_SIZE);
+		dir_room_set(dir->info.st_ino, b, dirent_room(blk));
+		break;
 	    }
-	    else if (bitLocData == 7)
+	}
+    }
+    free(blk);
+
+    if(ino >= 0)
+    {
+	dx_update(dir, MY_DELETE, ino, name, dir->info.st_size);
+	dcache_set(dir->info.st_ino, name, -1);
+	write_to_file(*dir); //the index may have moved
+    }
+    return ino;
+}
+
+//rewrite directory ino, and the ones below it first, as dir_entry records; returns how many were converted
+static int migrate_dir(int ino)
+{
+    inode dir = read_from_file(ino);
+    char *text, *copy, *save, *line, *name, *out = NULL;
+    int n = 0, size = 0, off = BLOCK_SIZE, last = -1, child, len;
+    struct stat st;
+
+    if(dir.flags & INODE_FL_DIRENT)
+    {
+	return 0;
+    }
+
+    text = (char*)calloc(dir.info.st_size + 1, 1);
+    if(read_range(dir, text, 0, dir.info.st_size) < 0)
+    {
+	log_msg("migrate_dirs: can't read directory %d\n", ino);
+	free(text);
+	return 0;
+    }
+
+    //subdirectories first, so a converted directory has nothing left below it
+    copy = strdup(text);
+    for(line = strtok_r(copy, "\n", &save); line != NULL; line = strtok_r(NULL, "\n", &save))
+    {
+	child = atoi(line);
+	if(strchr(line, '\t') == NULL || child == ino)
+	{
+	    continue;
+	}
+	read_attr(child, &st);
+	if(S_ISDIR(st.st_mode))
+	{
+	    n += migrate_dir(child);
+	}
+    }
+    free(copy);
+
+    for(line = strtok_r(text, "\n", &save); line != NULL; line = strtok_r(NULL, "\n", &save))
+    {
+	if((name = strchr(line, '\t')) == NULL || (len = strlen(++name)) == 0 || len > DIRENT_NAME_MAX)
+	{
+	    continue;
+	}
+	child = atoi(line);
+	if(child == ino)
+	{
+	    st.st_mode = dir.info.st_mode;
+	}
+	else
+	{
+	    read_attr(child, &st);
+	}
+
+	if(off + DIRENT_LEN(len) > BLOCK_SIZE)
+	{
+	    //a new block, and the last record of the one before runs on to its end
+	    if(last >= 0)
 	    {
-            dataMap[blockLocData] &= 0xfe;
+		dirent_set_len((dir_entry*)(out + last), size - last);
 	    }
+	    out = (char*)realloc(out, size + BLOCK_SIZE);
+	    memset(out + size, 0, BLOCK_SIZE);
+	    off = 0;
+	    size += BLOCK_SIZE;
+	}
+	last = size - BLOCK_SIZE + off;
+	dirent_set((dir_entry*)(out + last), DIRENT_LEN(len), child, name, len, st.st_mode);
+	off += DIRENT_LEN(len);
+    }
+    if(last >= 0)
+    {
+	dirent_set_len((dir_entry*)(out + last), size - last);
+    }
+    free(text);
+
+    if(size > 0 && write_range(&dir, out, 0, size) != size)
+    {
+	log_msg("migrate_dirs: can't write directory %d\n", ino);
+	free(out);
+	return n;
+    }
+    free(out);
+
+    dir.flags |= INODE_FL_DIRENT;
+    dir.info.st_size = size;
+    dir.info.st_blocks = size / BLOCK_SIZE;
+    dx_drop(&dir);
+    if(size > BLOCK_SIZE)
+    {
+	dx_build(&dir, size);
+    }
+    write_to_file(dir);
+    return n + 1;
+}
+
+/** Convert an older image's directories to dir_entry records
+ *
+ * Before version 6 each directory entry was a line of text.  Every
+ * directory under the root is rewritten as records, its subdirectories
+ * before it, and marked INODE_FL_DIRENT.  The header's version also says
+ * how the rest of the image is laid out, so it stays as it is and this
+ * runs at every mount of such an image; once the root is marked it
+ * stops there.
+ */
+void migrate_dirs()
+{
+    int converted = migrate_dir(ROOT_INO);
+
+    inode_sync(1);
+    log_msg("Converted %d text directories to dir_entry records\n", converted);
+}
+
+//Add the entry fPath, a name, for inode ino of the given mode to
+//parentNode (flag MY_APPEND), or remove the entry at path fPath.
+void writeToDirectory(char *fPath, int ino, mode_t mode, int flag)
+{
+	log_msg("In writeToDirectory\n");
+	log_msg("Parent Ino:%d\n",parentNode.info.st_ino);
+
+	if(flag == MY_APPEND)
+	{
+		if(dir_add(&parentNode, ino, fPath, mode) < 0)
+		{
+			log_msg("Could not add %s to directory %d\n", fPath, parentNode.info.st_ino);
+		}
+	}
+
+	else if(flag == MY_DELETE)
+	{
+		inode dummy;
+		inode start = get_inode("/",dummy, 0);
+		get_inode(fPath, start, 0); //for parentNode
+		if(!fileFound)
+		{
+			//log_msg("[writeToDirectory] Failed to find file when deleting\n");
+			return;
+		}
+
+		while(strstr(fPath, "/") != NULL)
+		{
+			fPath = strstr(fPath, "/")+1;//get name of file to be removed
+		}
+
+		dir_remove(&parentNode, fPath);
+	}
+
+	rootNode = read_from_file(ROOT_INO);
+}
 
-        int dataBlock = (blockLocData * 8) + (bitLocData + DATA_START);
+//Move the len bytes a file held in its inode out to extents.  The inode
+//is only changed if the data made it to disk; the caller writes it back.
+int loopWrite(const char* data, size_t len, inode* thisNode)
+{
+	inode node = *thisNode;
+	int bstat = 0;
 
-        char insert_buffer[4095];
-        memcpy(insert_buffer, inodeMap, 64);
-        memcpy((insert_buffer + 64), dataMap, 4031);
+	node.flags = (node.flags & ~INODE_FL_INLINE) | INODE_FL_EXTENTS;
+	memset(node.inline_data, 0, sizeof(node.inline_data));
+	node.ext_count = 0;
+	node.ext_depth = 0;
+	node.info.st_size = 0; //no blocks yet, so write_range has nothing to read back
 
-        for(i = 0; i < 8; i++)
-        {
-            block_write(i, insert_buffer + (BLOCK_SIZE * i));
-        }
+	if(len > 0 && (bstat = write_range(&node, data, 0, len)) < 0)
+	{
+		log_msg("[loopWrite] moving %d bytes out of inode %d failed: %d\n", (int)len, (int)node.info.st_ino, bstat);
+		file_unmap(&node);
+		return bstat;
+	}
 
-		free(superBuff);
-		return dataBlock;
+	node.info.st_size = thisNode->info.st_size;
+	*thisNode = node;
+	return bstat;
 }
 
-int myInodeIndex()
+/*
+ * Bitmaps are read and changed a block of the super region at a time,
+ * through the block cache, so claiming or freeing a block touches one
+ * or two blocks however big the image is.  A map_cursor holds the
+ * block being worked on and writes it back when it moves on.
+ */
+typedef struct map_cursor
 {
-		//log_msg("[myInodeIndex] In myInodeIndex\n");
-		char *superBuff = read_super();
-		char inodeMap[64];
-		char dataMap[4031];
-	    memcpy(inodeMap, superBuff, 64);
-	    memcpy(dataMap, (superBuff + 64), 4031);
-	    char superCopyInode[64];
-	    //char superCopyData[64];
-	    memcpy(superCopyInode,inodeMap,64);
-	    //memcpy(superCopyData,dataMap,4031);
-	    int bitLoc = -1;
-	    int blockLoc = -1;
-		int j,i;
-		char freeBit;
-
-	    for(i = 0; i < 64; i++)
-	    {
-			log_msg("Value of block: %x\n",superCopyInode[i] & 0xff);
-	        for(j = 7; j >= 0; j--)
-	        {
-		        freeBit = superCopyInode[i] & 1;
-	            if(freeBit)
-	            {
-		            bitLoc = j;
-		            blockLoc = i;
-		            break;
-	            }
-		        superCopyInode[i] >>= 1;
-	        }
-	        if(bitLoc >= 0)
-	        {
-		        break;
-	        }
-	    }
+	unsigned char *buf;
+	int block; //super region block in buf, -1 for none
+	int dirty;
+} map_cursor;
+
+static void map_open(map_cursor *c)
+{
+	c->buf = (unsigned char*)malloc(BLOCK_SIZE);
+	c->block = -1;
+	c->dirty = 0;
+}
+
+static void map_flush(map_cursor *c)
+{
+	if(c->dirty)
+	{
+		block_write(c->block, (char*)c->buf);
+	}
+	c->dirty = 0;
+}
+
+static void map_close(map_cursor *c)
+{
+	map_flush(c);
+	free(c->buf);
+}
+
+//the byte holding bit of the bitmap that starts off bytes into the super region
+static unsigned char *map_byte(map_cursor *c, int off, int bit)
+{
+	int byte = off + bit / 8;
+
+	if(byte / BLOCK_SIZE != c->block)
+	{
+		map_flush(c);
+		c->block = byte / BLOCK_SIZE;
+		if(block_read(c->block, (char*)c->buf) < 0)
+		{
+			memset(c->buf, 0, BLOCK_SIZE); //unreadable: everything in it looks taken
+		}
+	}
+	return c->buf + byte % BLOCK_SIZE;
+}
+
+//first free bit at or after start, wrapping round; -1 if there are none
+static int bitmap_find(map_cursor *c, int off, int count, int start)
+{
+	int i, b;
+
+	if(start < 0 || start >= count)
+	{
+		start = 0;
+	}
+
+	for(i = 0; i < count; i++)
+	{
+		b = (start + i) % count;
+		if(b % 8 == 0 && b + 8 <= count && *map_byte(c, off, b) == 0)//whole byte in use
+		{
+			i += 7;
+			continue;
+		}
+		if(*map_byte(c, off, b) & (0x80 >> (b % 8)))
+		{
+			return b;
+		}
+	}
+	return -1;
+}
+
+int bitmap_alloc(int off, int count, int start)
+{
+	map_cursor c;
+	int bit;
 
-		if (bitLoc < 0)//Out of space
+	map_open(&c);
+	bit = bitmap_find(&c, off, count, start);
+	if(bit >= 0)
+	{
+		*map_byte(&c, off, bit) &= ~(0x80 >> (bit % 8));
+		c.dirty = 1;
+	}
+	map_close(&c);
+	return bit;
+}
+
+static int data_next = 0; //where the next data block search starts
+
+int myBlockIndex()
+{
+		//log_msg("In myBlockIndex\n");
+		int bit = bitmap_alloc(layout.data_map_off, layout.data_count, data_next);
+
+		if (bit < 0)//Out of space
 		{
 			return -1;
 		}
 
-	    if (bitLoc == 0)
-	    {
-		    inodeMap[blockLoc] &= 0x7f;
-	    }
-	    else if (bitLoc == 1)
-	    {
-		    inodeMap[blockLoc] &= 0xbf;
-	    }
-	    else if (bitLoc == 2)
-	    {
-		    inodeMap[blockLoc] &= 0xdf;
-	    }
-	    else if (bitLoc == 3)
-	    {
-	        inodeMap[blockLoc] &= 0xef;
-	    }
-	    else if (bitLoc == 4)
-	    {
-            inodeMap[blockLoc] &= 0xf7;
-	    }
-	    else if (bitLoc == 5)
-	    {
-            inodeMap[blockLoc] &= 0xfb;
-	    }
-	    else if (bitLoc == 6)
-	    {
-            inodeMap[blockLoc] &= 0xfd;
-	    }
-	    else if (bitLoc == 7)
-	    {
-            inodeMap[blockLoc] &= 0xfe;
-	    }
+		data_next = bit + 1;
+		return bit + DATA_START;
+}
 
-        int inodeBlock = (blockLoc*8) + bitLoc + INODE_START;
+int myInodeIndex()
+{
+		//log_msg("[myInodeIndex] In myInodeIndex\n");
+		int bit = bitmap_alloc(layout.inode_map_off, INODE_COUNT, 0);
 
-		char insert_buffer[4095];
-        memcpy(insert_buffer, inodeMap, 64);
-        memcpy((insert_buffer + 64), dataMap, 4031);
+		if (bit < 0)//table's full, so carry on in the chunks
+		{
+			return inode_chunk_alloc();
+		}
 
-        for(i = 0; i < 8; i++)
-        {
-            block_write(i, insert_buffer + (BLOCK_SIZE * i));
-        }
-		
-		free(superBuff);
-		return inodeBlock;
+		return bit + layout.ino_base;
 }
 
-void flipBit(int blockNum)
+int myBlockRun(int goal, int n, int *got)
 {
-		log_msg("Flipping bit...");
-		char *superBuff = read_super();
-		char superBuffCopy[8*BLOCK_SIZE];
-		strcpy(superBuffCopy,superBuff);
-		char inodeMap[64];
-		char dataMap[4031];
-	    memcpy(inodeMap, superBuff, 64);
-	    memcpy(dataMap, (superBuff + 64), 4031);
-		char superCopyInode[64];
-	    char superCopyData[4031];
-	    memcpy(superCopyInode,inodeMap,64);
-		memcpy(superCopyData,dataMap,4031);
-
-		int bitLoc = -1;
-	    int blockLoc = -1;
-		int j,i,myBit,myIndex;
-		char freeBit,isInode;
-		if (blockNum < DATA_START)
-		{
-			log_msg("Flipping inode");
-			myBit = blockNum - INODE_START;
-
-			//modified ceil function
-			if(blockNum % 8 > 0)
-			{
-				myIndex = (blockNum/8)+1;
-			}
-			else
-			{
-				myIndex = blockNum/8;
-			}
+		map_cursor c;
+		unsigned char *p;
+		int bit;
 
-			myIndex -= 1;
+		//first free block at or after the goal, wrapping round to the start
+		map_open(&c);
+		bit = bitmap_find(&c, layout.data_map_off, layout.data_count, goal - DATA_START);
 
-			for(j = 7; j >= 0; j--)
-			{
-				freeBit = superCopyInode[myIndex] & 1;
-				if(!freeBit && ((myIndex*8)+j)==myBit)
-				{
-					bitLoc = j;
-					blockLoc = myIndex;
-					break;
-				}
-				superCopyInode[myIndex] >>= 1;
-			}
-			if (bitLoc == 0)
-			{
-				inodeMap[blockLoc] ^= 0x80;
-			}
-			else if (bitLoc == 1)
-			{
-				inodeMap[blockLoc] ^= 0x40;
-			}
-			else if (bitLoc == 2)
-			{
-				inodeMap[blockLoc] ^= 0x20;
-			}
-			else if (bitLoc == 3)
-			{
-			    inodeMap[blockLoc] ^= 0x10;
-			}
-			else if (bitLoc == 4)
-			{
-		        inodeMap[blockLoc] ^= 0x08;
-			}
-			else if (bitLoc == 5)
-			{
-		        inodeMap[blockLoc] ^= 0x04;
-			}
-			else if (bitLoc == 6)
+		if (bit < 0)//Out of space
+		{
+			map_close(&c);
+			return -1;
+		}
+
+		//and as many free ones after it as are wanted
+		for (*got = 0; *got < n && bit + *got < layout.data_count; (*got)++)
+		{
+			int b = bit + *got;
+			p = map_byte(&c, layout.data_map_off, b);
+			if (!(*p & (0x80 >> (b % 8))))
 			{
-		        inodeMap[blockLoc] ^= 0x02;
+				break;
 			}
-			else if (bitLoc == 7)
+			*p &= ~(0x80 >> (b % 8));
+			c.dirty = 1;
+		}
+
+		map_close(&c);
+		data_next = bit + *got;
+		return bit + DATA_START;
+}
+
+void freeRun(int blockNum, int n)
+{
+		map_cursor c;
+		int i, myBit;
+
+		map_open(&c);
+		for (i = 0; i < n; i++)
+		{
+			myBit = blockNum + i - DATA_START;
+			if (myBit >= 0 && myBit < layout.data_count)
 			{
-		        inodeMap[blockLoc] ^= 0x01;
+				*map_byte(&c, layout.data_map_off, myBit) |= 0x80 >> (myBit % 8);
+				c.dirty = 1;
 			}
 		}
-		else
+		map_close(&c);
+}
+
+void flipBit(int blockNum)
+{
+		log_msg("Flipping bit...");
+		map_cursor c;
+		int myBit = blockNum - DATA_START;
+
+		if (myBit >= 0 && myBit < layout.data_count)
 		{
-			myBit = blockNum - DATA_START;
-			log_msg("Flipping data");
+			map_open(&c);
+			*map_byte(&c, layout.data_map_off, myBit) ^= 0x80 >> (myBit % 8);
+			c.dirty = 1;
+			map_close(&c);
+		}
 
-			if(blockNum % 8 > 0)
-			{
-				myIndex = (blockNum/8)+1;
-			}
-			else
-			{
-				myIndex = blockNum/8;
-			}
+	log_msg("DONE flipping, returning\n");
+	return;
+}
 
-			myIndex -= 1;
+void freeInode(int ino)
+{
+		map_cursor c;
+		int myBit = ino - layout.ino_base;
 
-			for(j = 7; j >= 0; j--)
-			{
-				freeBit = superCopyData[myIndex] & 1;
-				if(!freeBit && ((myIndex*8)+j)==myBit)
-				{
-					bitLoc = j;
-					blockLoc = myIndex;
-					break;
-				}
-				superCopyData[myIndex] >>= 1;
-			}
-			if (bitLoc == 0)
-			{
-				dataMap[blockLoc] ^= 0x80;
-			}
-			else if (bitLoc == 1)
-			{
-				dataMap[blockLoc] ^= 0x40;
-			}
-			else if (bitLoc == 2)
-			{
-				dataMap[blockLoc] ^= 0x20;
-			}
-			else if (bitLoc == 3)
-			{
-			    dataMap[blockLoc] ^= 0x10;
-			}
-			else if (bitLoc == 4)
+		if (myBit >= 0 && myBit < INODE_COUNT)
+		{
+			map_open(&c);
+			*map_byte(&c, layout.inode_map_off, myBit) |= 0x80 >> (myBit % 8);
+			c.dirty = 1;
+			map_close(&c);
+		}
+		else if (myBit >= INODE_COUNT)
+		{
+			inode_chunk_free(ino);
+		}
+		inode_drop(ino);
+}
+
+/*
+ * Inode chunks (see INODE_CHUNK in sfs.h)
+ *
+ * The chunk map's inode is kept here rather than in the inode cache:
+ * finding a chunk inode's block goes through it, and that happens from
+ * inside the cache on a miss.  icache_lock covers it, ichunk_next and
+ * the chunk fields of the layout.
+ */
+static inode imap_node; //the chunk map, slot 0 of chunk 0
+static int ichunk_next = 0; //no chunk before this has a free inode
+
+//block of the chunk map holding chunk's record, and its offset there; 0 if it has none
+static int ichunk_rec(int chunk, int *offset)
+{
+	*offset = chunk * ICHUNK_REC % BLOCK_SIZE;
+	return file_block(imap_node, chunk * ICHUNK_REC / BLOCK_SIZE);
+}
+
+int inode_chunk_block(int n, int *offset)
+{
+	unsigned char *buf;
+	int chunk = n / INODE_CHUNK, slot = n % INODE_CHUNK;
+	int first, b, off;
+
+	if(chunk >= layout.ichunk_count)
+	{
+		return -1;
+	}
+
+	if(chunk == 0)
+	{
+		first = layout.ichunk_start; //where the chunk map itself is
+	}
+	else
+	{
+		b = ichunk_rec(chunk, &off);
+		if(b == 0 || (buf = (unsigned char*)malloc(BLOCK_SIZE)) == NULL)
+		{
+			return -1;
+		}
+		first = block_read(b, (char*)buf) < 0 ? -1 : (int)get_le32(buf + off);
+		free(buf);
+		if(first < 0)
+		{
+			return -1;
+		}
+	}
+
+	*offset = slot % layout.inodes_per_block * layout.inode_size;
+	return first + slot / layout.inodes_per_block;
+}
+
+void inode_chunk_init()
+{
+	pthread_mutex_lock(&icache_lock);
+	ichunk_next = 0;
+	if(layout.ichunk_count > 0)
+	{
+		inode_load(layout.ino_base + layout.inode_count, &imap_node, 1);
+		log_msg("Inode table grown by %d chunks of %d\n", layout.ichunk_count, INODE_CHUNK);
+	}
+	pthread_mutex_unlock(&icache_lock);
+}
+
+//blocks in a row for a new chunk, trying a few places; -1 if there's no room
+static int ichunk_blocks(int n)
+{
+	int b, got, tries, goal = DATA_START;
+
+	for(tries = 0; tries < 64; tries++)
+	{
+		b = myBlockRun(goal, n, &got);
+		if(b < 0)
+		{
+			return -1;
+		}
+		if(got == n)
+		{
+			return b;
+		}
+		freeRun(b, got);
+		goal = b + got + 1;
+	}
+	return -1;
+}
+
+//put a new chunk on the end of the map; returns its number or -1
+static int ichunk_add()
+{
+	int n = (INODE_CHUNK + layout.inodes_per_block - 1) / layout.inodes_per_block;
+	int chunk = layout.ichunk_count, mapBlocks = (chunk * ICHUNK_REC) / BLOCK_SIZE;
+	int first, b, off, i;
+	unsigned char *buf;
+	int *blocks;
+
+	if(layout.version < 4)
+	{
+		return -1; //no room in the header to find the chunks again
+	}
+
+	if((first = ichunk_blocks(n)) < 0)
+	{
+		return -1;
+	}
+
+	//empty slots, so nothing stale ever decodes as an inode
+	buf = (unsigned char*)calloc(n, BLOCK_SIZE);
+	blocks = (int*)malloc(n * sizeof(int));
+	for(i = 0; i < n; i++)
+	{
+		blocks[i] = first + i;
+	}
+	block_writev(blocks, n, (char*)buf);
+	free(blocks);
+
+	if(chunk == 0)
+	{
+		memset(&imap_node, 0, sizeof(imap_node));
+		imap_node.info.st_ino = layout.ino_base + layout.inode_count;
+		imap_node.info.st_mode = S_IFREG | S_IRUSR | S_IWUSR;
+		imap_node.info.st_nlink = 1;
+		imap_node.info.st_blksize = BLOCK_SIZE;
+		imap_node.flags = INODE_FL_EXTENTS;
+		layout.ichunk_start = first;
+		layout.ichunk_count = 1; //so the map inode can be found
+	}
+
+	//the record may need a new block on the end of the map
+	if(chunk * ICHUNK_REC % BLOCK_SIZE == 0)
+	{
+		if(file_map(&imap_node, mapBlocks + 1) < mapBlocks + 1)
+		{
+			freeRun(first, n);
+			layout.ichunk_count = chunk;
+			free(buf);
+			return -1;
+		}
+		block_write(file_block(imap_node, mapBlocks), (char*)buf);
+	}
+
+	b = ichunk_rec(chunk, &off);
+	if(block_read(b, (char*)buf) < 0)
+	{
+		freeRun(first, n);
+		layout.ichunk_count = chunk;
+		free(buf);
+		return -1;
+	}
+	put_le32(buf + off, first);
+	put_le32(buf + off + 4, chunk == 0 ? INODE_CHUNK - 1 : INODE_CHUNK);
+	memset(buf + off + 8, 0xff, INODE_CHUNK / 8);
+	if(chunk == 0)
+	{
+		buf[off + 8] = 0x7f; //the map's own inode
+	}
+	block_write(b, (char*)buf);
+	free(buf);
+
+	imap_node.info.st_size = (chunk + 1) * ICHUNK_REC;
+	imap_node.info.st_blocks = mapBlocks + 1;
+	layout.ichunk_count = chunk + 1;
+	inode_store(&imap_node);
+
+	//and the header, so the chunk is there next mount
+	buf = (unsigned char*)malloc(BLOCK_SIZE);
+	if(block_read(0, (char*)buf) >= 0)
+	{
+		write_header(buf);
+		block_write(0, (char*)buf);
+	}
+	free(buf);
+
+	log_msg("Inode table grown to %d chunks\n", layout.ichunk_count);
+	return chunk;
+}
+
+int inode_chunk_alloc()
+{
+	unsigned char *buf = (unsigned char*)malloc(BLOCK_SIZE);
+	unsigned char *map;
+	int chunk, b, off, cur = 0, bit, ino = -1;
+
+	pthread_mutex_lock(&icache_lock);
+	while(ino < 0)
+	{
+		for(chunk = ichunk_next; chunk < layout.ichunk_count; chunk++)
+		{
+			b = ichunk_rec(chunk, &off);
+			if(b == 0)
 			{
-		        dataMap[blockLoc] ^= 0x08;
+				continue;
 			}
-			else if (bitLoc == 5)
+			if(b != cur)
 			{
-		        dataMap[blockLoc] ^= 0x04;
+				if(block_read(b, (char*)buf) < 0)
+				{
+					cur = 0;
+					continue;
+				}
+				cur = b;
 			}
-			else if (bitLoc == 6)
+			if(get_le32(buf + off + 4) == 0)
 			{
-		        dataMap[blockLoc] ^= 0x02;
+				continue; //full
 			}
-			else if (bitLoc == 7)
+
+			map = buf + off + 8;
+			for(bit = 0; bit < INODE_CHUNK && !(map[bit / 8] & (0x80 >> (bit % 8))); bit++);
+			if(bit == INODE_CHUNK)
 			{
-		        dataMap[blockLoc] ^= 0x01;
+				put_le32(buf + off + 4, 0); //count was off
+				block_write(b, (char*)buf);
+				continue;
 			}
+			map[bit / 8] &= ~(0x80 >> (bit % 8));
+			put_le32(buf + off + 4, get_le32(buf + off + 4) - 1);
+			block_write(b, (char*)buf);
+			ino = layout.ino_base + layout.inode_count + chunk * INODE_CHUNK + bit;
+			break;
 		}
+		ichunk_next = chunk;
 
+		if(ino < 0 && ichunk_add() < 0)
+		{
+			break; //out of space
+		}
+		cur = 0; //the add rewrote a map block
 
+	}
+	pthread_mutex_unlock(&icache_lock);
 
+	free(buf);
+	return ino;
+}
 
-		char insert_buffer[4095];
-        memcpy(insert_buffer, inodeMap, 64);
-        memcpy((insert_buffer + 64), dataMap, 4031);
+void inode_chunk_free(int ino)
+{
+	unsigned char *buf;
+	int n = ino - layout.ino_base - layout.inode_count;
+	int chunk = n / INODE_CHUNK, bit = n % INODE_CHUNK, b, off;
 
-        for(i = 0; i < 8; i++)
-        {
-            block_write(i, insert_buffer + (BLOCK_SIZE * i));
-        }
-		
-	log_msg("DONE flipping, returning\n");
-	free(superBuff);
-	return;
+	pthread_mutex_lock(&icache_lock);
+	if(n > 0 && chunk < layout.ichunk_count && (b = ichunk_rec(chunk, &off)) != 0)
+	{
+		buf = (unsigned char*)malloc(BLOCK_SIZE);
+		if(block_read(b, (char*)buf) >= 0 && !(buf[off + 8 + bit / 8] & (0x80 >> (bit % 8))))
+		{
+			buf[off + 8 + bit / 8] |= 0x80 >> (bit % 8);
+			put_le32(buf + off + 4, get_le32(buf + off + 4) + 1);
+			block_write(b, (char*)buf);
+			if(chunk < ichunk_next)
+			{
+				ichunk_next = chunk;
+			}
+		}
+		free(buf);
+	}
+	pthread_mutex_unlock(&icache_lock);
 }
 
-void removeSubDir(char *fullPath,inode start)
-{
-	inode dirNode = get_inode(fullPath,start,0);
-	char *myFiles = get_buffer(dirNode);
-	char *myStartToMyFiles = myFiles;
-
-	char *token = strtok(myFiles, "\n");
-	int nodeNumber,dataNumber,myBlockUseNum,retStat,index;
-	char *fileName;
-	mode_t myMode;
-	inode currInode;
-	char *fullPathCopy = (char*)malloc(strlen(fullPath)+1);
-	char *copy = fullPathCopy;
-
-	while (token != NULL)
-	{
-			strcpy(fullPathCopy,fullPath);
-			fileName = strstr(token, "\t");
-			fileName[0] = '\0';
-			fileName++;
-			fullPathCopy = realloc(fullPathCopy,strlen(fileName)+strlen(fullPathCopy)+2);
-			copy = fullPathCopy;
-			strcat(fullPathCopy,"/");
-			strcat(fullPathCopy,fileName);
-			currInode = get_inode(fullPathCopy,start,0);
-			myMode = currInode.info.st_mode;
-			myMode &= S_IFDIR;
-			nodeNumber = atoi(token);
-
-			if (myMode == S_IFDIR)
+void removeSubDir(const inode *dirNode)
+{
+	//on the heap, as this recurses once per level of nesting
+	char *blk = (char*)malloc(BLOCK_SIZE);
+	inode *currInode = (inode*)malloc(sizeof(inode));
+	int b, off, nodeNumber;
+	dir_entry *d;
+
+	//dirNode goes too, so its own entries are left as they are
+	for(b = 0; blk != NULL && currInode != NULL && b < dirNode->info.st_size / BLOCK_SIZE && dir_block(*dirNode, b, blk) == 0; b++)
+	{
+		for(off = 0; (d = dirent_next(blk, &off)) != NULL; )
+		{
+			nodeNumber = le32toh(d->ino);
+			if(nodeNumber == 0 || (ino_t)nodeNumber == dirNode->info.st_ino)
 			{
-				if(currInode.info.st_ino != dirNode.info.st_ino)
-				{
-					removeSubDir(fullPathCopy,start);
-					flipBit(nodeNumber);
-				
-					if(currInode.info.st_size % BLOCK_SIZE > 0)
-					{
-						myBlockUseNum = (currInode.info.st_size/BLOCK_SIZE)+1;
-					}
-					else
-					{
-						myBlockUseNum = currInode.info.st_size/BLOCK_SIZE;
-					}
-
-					for(index=0;index<myBlockUseNum;index++)
-					{
-						flipBit(currInode.direct[index]);
-					}
-
-					writeToDirectory(fullPathCopy, MY_DELETE);
-					//log_msg("[removeSubDir] nested directory removed\n");
-				}
+				continue; //unused, or "."
 			}
-			else
+
+			*currInode = read_from_file(nodeNumber);
+			if(d->type == DT_DIR)
 			{
-				retStat = sfs_unlink(fullPathCopy);
-				//log_msg("[removeSubDir] file just ulinked. retStat:%d\n",retStat);
+				removeSubDir(currInode);
+				dentry_purge(nodeNumber);
+				dir_room_purge(nodeNumber);
+				//log_msg("[removeSubDir] nested directory removed\n");
 			}
-
-			//log_msg("[removeSubDir] Is Lance right...\n");
-			free(copy);
-			//log_msg("[removeSubDir] ...Lance was right\n");
-			token = strtok(NULL, "\n");
+			file_unmap(currInode);
+			freeInode(nodeNumber);
+		}
 	}
-	
-	////log_msg("[removeSubDir] freeing before exit\n");
-	//free(copy);
-	//log_msg("[removeSubDir] freeing again before exit\n");
-	free(myStartToMyFiles);
-	//log_msg("[removeSubDir] exit\n");
+
+	free(blk);
+	free(currInode);
 }
 
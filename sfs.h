@@ -1,36 +1,247 @@
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <sys/stat.h>
 #include <strings.h>
 #include <math.h>
 
-#define SYSTEM_SIZE (16 * 1024 * 1024)
+#define SYSTEM_SIZE (16 * 1024 * 1024) //default size of a new image, --size=N
+#define IMAGE_BLOCKS_MIN 64 //smallest image --size= makes, in blocks
 #define BUFF_SIZE (16 * 1024)
-#define INODE_COUNT 512
-#define BLOCK_COUNT (SYSTEM_SIZE/512)
-#define INODE_START 8
-#define DATA_START 520
+#define INODE_COUNT_DEFAULT 512
+#define INODE_SIZE 256 //default bytes per inode in the inode table (a disk_inode plus room to grow)
+#define INODE_SIZE_MAX 1024 //largest inode slot --inode-size= takes
+#define INODE_CACHE_DEFAULT 1024 //inodes kept in memory by the inode cache
+#define DENTRY_CACHE_DEFAULT 4096 //name lookups kept in memory by the dentry cache
+#define DENTRY_NAME_MAX 55 //longest name the dentry cache holds
+#define RELATIME_INTERVAL (24*60*60) //seconds after which --relatime updates atime anyway
+#define LAZYTIME_EXPIRE (12*60*60) //seconds --lazytime may hold back a timestamp before the flusher writes it
+#define INODE_COUNT (layout.inode_count)
+#define BLOCK_COUNT (layout.block_count)
+#define INODE_START (layout.inode_start)
+#define DATA_START (layout.data_start)
+#define ROOT_INO (layout.ino_base) //root directory's inode, the first in the table (8 on old images)
 #define ROOT_PATH "/tmp/laf224/mountdir"
 #define MY_DELETE 0
 #define MY_APPEND 1
 
+#define SFS_MAGIC 0x31534653 //"SFS1"
+#define SFS_VERSION 6 //1: inodes stored as text, 2: binary inodes (disk_inode), 3: several inodes per block, 4: inode size in the header, 5: 32-bit block pointers, 6: binary directory entries
+#define SFS_HEADER_SIZE 128 //bytes at the start of block 0 holding the header (64 before version 4)
+
+/*
+ * Directory entries.  A directory is whole blocks of dir_entry records,
+ * little-endian, one after another: the entry's inode number (0 for an
+ * unused record), the record's length, the name's length, the file type
+ * (a DT_* value, from the mode) and the name, unterminated, then padding
+ * to a multiple of 4 bytes.  Records never cross a block, and the last in
+ * a block takes up the rest of it, so a record can be longer than its
+ * name needs; a new entry goes in the first such slack big enough for
+ * it, or in a new block, and a removed one is merged into the record
+ * before it (or, first in a block, just marked unused).  Records never
+ * move once written.  A 64K record length is stored as 0.
+ *
+ * Images before version 6 held a "%d\t%s\n" line of text per entry;
+ * migrate_dirs converts them at mount.
+ */
+typedef struct __attribute__((packed)) dir_entry
+{
+	uint32_t ino;
+	uint16_t rec_len;
+	uint8_t name_len;
+	uint8_t type;
+	char name[];
+} dir_entry;
+#define DIRENT_HEADER 8
+#define DIRENT_LEN(n) ((DIRENT_HEADER + (n) + 3) & ~3) //bytes a record with an n byte name needs
+#define DIRENT_NAME_MAX 255
+
+#define RA_MIN_BYTES (128 * 1024) //readahead window when a sequential stream is first seen, at least one FUSE read
+#define RA_MAX_BYTES (2 * 1024 * 1024) //the window doubles on every sequential read up to this
+
+
+/*
+ * Regular files map their data with extents: runs of contiguous blocks,
+ * each a (logical start, physical start, length) triple.  The first
+ * INODE_EXTENTS sit in the inode.  Past that they move into an extent
+ * tree: the inode's entries then point at tree blocks, which hold
+ * EXTENT_PER_BLOCK entries after a small header, down to leaf blocks of
+ * extents.  ext_depth is the number of levels of blocks below the inode.
+ * Other inodes use direct[]/indirect[]; in a directory, ext[] may map
+ * its hashed index instead (INODE_FL_INDEX).
+ *
+ * A regular file small enough to fit in its inode slot has
+ * INODE_FL_INLINE instead and no blocks at all: its bytes are stored in
+ * the slot over map through ext[] (skipping flags) and on into the
+ * space after the record.  It moves out to extents the first time it
+ * outgrows that.
+ */
+#define INODE_FL_EXTENTS 0x1 //data mapped by ext[] rather than direct[]
+#define INODE_FL_INLINE 0x2 //data held in inline_data[], no blocks
+#define INODE_FL_INDEX 0x4 //directory with a hashed index, mapped by ext[] (see dir_index_find)
+#define INODE_FL_DIRENT 0x8 //directory of dir_entry records rather than text lines (see migrate_dirs)
+#define INODE_INLINE_MAX (INODE_SIZE_MAX - 76) //slot less the 72 bytes before map and the flags word
+#define INODE_INLINE ((layout.inode_size < INODE_SIZE_MAX ? layout.inode_size : INODE_SIZE_MAX) - 76) //inline bytes this image's slots hold
+#define INODE_EXTENTS 4
+#define EXTENT_MAGIC 0x5845 //"EX", first two bytes of every extent tree block
+#define EXTENT_HEADER 8 //magic, entries, depth, unused: little-endian 16-bit words
+#define EXTENT_SIZE 12 //logical, physical, length: little-endian 32-bit words
+#define EXTENT_PER_BLOCK ((BLOCK_SIZE - EXTENT_HEADER) / EXTENT_SIZE)
+
+/*
+ * Block-mapped inodes: the first DIRECT_COUNT file blocks are in
+ * direct[], the next PTRS_PER_BLOCK through the pointer block
+ * indirect[0], and the next PTRS_PER_BLOCK^2 through indirect[1], whose
+ * entries are pointer blocks themselves.  Block numbers in inodes and
+ * pointer blocks are 32 bits from version 5 and 16 bits before, which
+ * left room for 32 direct blocks in the inode rather than 15.
+ */
+#define INODE_DIRECT 32 //most direct[] entries of any version
+#define DIRECT_COUNT (layout.ptr_size == 4 ? 15 : 32)
+#define PTRS_PER_BLOCK (BLOCK_SIZE / layout.ptr_size) //little-endian block numbers
+
+typedef struct extent
+{
+	int logical; //first file block of the run
+	int physical; //first disk block; in an index entry, the tree block below
+	int length; //blocks in the run (0 in index entries)
+}extent;
 
 typedef struct inode
 {
-	struct stat info; //see stat struct man page
-	unsigned short direct[32];
-	unsigned short indirect[2];
+	struct stat info; //see stat struct man page; all read_attr decodes, the rest waits until the data is wanted
+	unsigned int direct[INODE_DIRECT];
+	unsigned int indirect[2]; //single, double indirect pointer blocks
+	int flags; //INODE_FL_*
+	int ext_count; //entries used in ext[]
+	int ext_depth;
+	extent ext[INODE_EXTENTS];
+	unsigned char inline_data[INODE_INLINE_MAX]; //first st_size bytes used with INODE_FL_INLINE
 }inode;
 
+/*
+ * An inode as stored in its inode table slot: fixed offsets, every field
+ * little-endian whatever the host.  magic tells it apart from the tab
+ * separated text inodes of version 0 and 1 images, which always start
+ * with a digit; version is bumped whenever the record changes (version 1
+ * records end at indirect[] and are still read).  Which half of map is
+ * used is up to the image (see DIRECT_COUNT), not the record.
+ *
+ * Everything stat() reports comes before map, so getattr and the last
+ * step of a lookup decode only those INODE_ATTR_BYTES; the block map,
+ * extents and inline data are decoded when the file's data is wanted.
+ */
+#define INODE_MAGIC 0x4e49 //"IN"
+#define INODE_VERSION 3 //3: INODE_FL_INLINE
+
+typedef struct __attribute__((packed)) disk_inode
+{
+	uint16_t magic;
+	uint16_t version;
+	uint32_t dev;
+	uint32_t ino;
+	uint32_t mode;
+	uint32_t nlink;
+	uint32_t uid;
+	uint32_t gid;
+	uint32_t rdev;
+	uint64_t size;
+	int64_t atime;
+	int64_t mtime;
+	int64_t ctime;
+	uint32_t blksize;
+	uint32_t blocks;
+	union
+	{
+		struct __attribute__((packed)) { uint16_t direct[32]; uint16_t indirect[2]; } p16; //images before version 5
+		struct __attribute__((packed)) { uint32_t direct[15]; uint32_t indirect[2]; } p32;
+	} map;
+	uint32_t flags;
+	uint16_t ext_count;
+	uint16_t ext_depth;
+	uint32_t ext[INODE_EXTENTS][3];
+}disk_inode;
+#define INODE_ATTR_BYTES offsetof(disk_inode, map) //magic through blocks
+
+
+/*
+ * Where everything lives on disk.  Filled in at mount from the header at
+ * the start of block 0 (all little-endian 32-bit words, in this order),
+ * or from the fixed layout of images made before the header existed
+ * (version 0: 512 byte blocks, bitmaps in blocks 0-7 with no header,
+ * inodes at 8, data at 520).
+ *
+ * Blocks 0..super_blocks-1 hold the header and the two bitmaps.  In a
+ * bitmap a 1 bit means free, and bits run from the high bit of each byte.
+ * The optional checksum area comes next, then the inode table, then data.
+ *
+ * Inode number ino is entry ino - ino_base of the table, which packs
+ * inodes_per_block inode_size byte entries into each block (inode_size
+ * isn't stored before version 4: it is INODE_SIZE on version 3 images and
+ * the whole block before that).  Before version 3
+ * every inode had a block to itself and its number was that block's
+ * (ino_base is inode_start); from version 3 inodes count from 1.
+ *
+ * Once that table is full, inodes come from chunks of INODE_CHUNK taken
+ * from the data region as they're needed, numbered on from the end of
+ * the table.  Chunk 0 starts at block ichunk_start, and its first inode
+ * is the chunk map: a file of ICHUNK_REC byte records, one per chunk,
+ * holding the chunk's first block, its free inode count and a bitmap of
+ * its free inodes.  Only images with the version 4 header have room to
+ * say where chunk 0 is; older ones keep their fixed table.
+ */
+#define INODE_CHUNK 64 //inodes added to the table at a time
+#define ICHUNK_REC 16 //chunk map record: first block, free count (little-endian 32-bit), bitmap
+typedef struct sfs_layout
+{
+	int magic;
+	int version;
+	int block_size;
+	int block_count; //blocks in the image
+	int super_blocks;
+	int inode_start; //first block of the inode table
+	int inode_count;
+	int data_start; //first block of the data region
+	int data_count;
+	int inode_map_off; //byte offsets of the bitmaps in the super region
+	int data_map_off;
+	int csum_start; //block checksum area (see block_csum_init), csum_blocks is 0 without one
+	int csum_blocks;
+	int stripe_members; //image files the disk is striped over (0 or 1: a single file)
+	int stripe_width; //blocks per stripe unit
+	int inodes_per_block;
+	int inode_size; //bytes per inode table entry, from version 4
+	int ichunk_start; //first block of inode chunk 0, 0 until the table first grows
+	int ichunk_count; //inode chunks in use
+
+	//worked out from the above, not stored
+	int ptr_size; //bytes per block number in inodes and pointer blocks
+	int inode_blocks; //blocks the inode table takes up
+	int ino_base; //number of the first inode
+}sfs_layout;
 
+extern sfs_layout layout;
 
-typedef struct super
+/*
+ * Per open file readahead state, hung off fi->fh.  A read that starts
+ * where the previous one stopped is sequential and doubles the window;
+ * anything else resets it.  ahead is the first file block not yet handed
+ * to block_readahead().
+ */
+typedef struct readahead
 {
-	unsigned char inode_bitmap[64];
-	unsigned char data_bitmap[4031];
-}super;
+	off_t next; //offset the next sequential read would start at
+	int window; //blocks to keep in flight ahead of the reader, RA_MIN_BYTES to RA_MAX_BYTES worth
+	int ahead;
+}readahead;
 
-super superBlock;
+//What open and create hang off fi->fh
+typedef struct open_file
+{
+	int ino; //pinned in the inode cache until release
+	readahead ra;
+}open_file;
 
 void setMetadata(); //initialize metadata for first use of filesystem
 
@@ -38,22 +249,110 @@ inode get_inode(char*, inode, int); //given a file path and starting inode (dire
 
 void write_to_file(inode); //write inode to file in inode region
 
+void write_times(inode); //write_to_file for a change to the timestamps alone; held in memory with --lazytime
+
 inode read_from_file(int); //read inode from file given an index to inode region
 
-char* get_buffer(inode); //given an inode, return its data section contents as string
+void read_attr(int, struct stat*); //just an inode's stat fields, leaving its block map on disk if it isn't cached
+
+int get_attr(char*, struct stat*); //stat fields of the file at a path; 0 or -ENOENT
+
+/*
+ * read_from_file and write_to_file go through an inode cache: an LRU of
+ * up to --inode-cache=N inodes.  Writes only mark the cached copy dirty;
+ * it reaches the inode table when it is evicted, on fsync, at unmount, or
+ * when the block flusher finds it has been dirty for --dirty-expire, in
+ * the same pass as the blocks it points to.  Pinned inodes (the root, and
+ * files while they are open) are never evicted, so that last is what
+ * bounds them.  With --lazytime, write_times marks an entry as having
+ * timestamps to write rather than dirty, and those reach the table once
+ * the flusher finds them LAZYTIME_EXPIRE old; any write_to_file of the
+ * same inode takes them along.
+ */
+int inode_cache_init(int); //size the cache, before the first inode is read
+
+void inode_pin(int); //keep an inode cached until a matching inode_unpin
+
+void inode_unpin(int);
+
+void inode_drop(int); //forget a freed inode without writing it back
+
+int dentry_cache_init(int); //size the dentry cache (see dir_find), before the first lookup
+
+void dentry_purge(int); //forget the cached names of a directory that is going away
+
+void dir_room_purge(int); //forget the free space noted for a directory that is going away
+
+int inode_sync(int); //write every dirty cached inode to the inode table, and those with held-back
+               //timestamps if the argument is set; returns how many were written
+
+void inode_writeback(int); //flusher hook: write cached inodes dirty for the given ms, and timestamps held LAZYTIME_EXPIRE
+
+void migrate_inodes(); //rewrite the text inodes of an older image in the binary format
+
+void migrate_dirs(); //rewrite the text directories of an older image as dir_entry records
+
+int read_range(inode, char*, off_t, size_t);//copies a byte range of a file's data into a buffer; -EIO if a block can't be read
+int write_range(inode*, const char*, off_t, size_t);//copies a buffer into a byte range of a file's data, mapping blocks as needed
+int zero_range(inode*, off_t, off_t);//writes zeroes over a byte range of a file's data, mapping blocks as needed
+
+int file_block(inode, int);//disk block holding the given block of a file, 0 if there is none
+
+int file_blocks(inode, int, int, int*);//disk blocks of a run of file blocks; returns how many are mapped
+
+int file_map(inode*, int);//map file blocks 0..n-1, allocating what's missing; returns how many are mapped
+
+void file_unmap(inode*);//free all of a file's data blocks (and extent tree blocks)
+
+void file_readahead(readahead*, inode, off_t, size_t);//spots sequential reads and prefetches ahead of them
+
+int format_layout(int, int, int, int, long long); //work out the layout of a new filesystem: block size, checksums or not, inode count, inode size and image bytes (0 for the defaults); -1 if they don't fit
+
+int read_layout(char*); //fill in the layout from block 0; returns the block size to use
+
+void write_header(unsigned char*); //encode the layout into the first SFS_HEADER_SIZE bytes of a buffer
 
 char* read_super();//reads super block
 
-void writeToDirectory(char*, int); //updates data region for a directory inode
+void write_super(char*);//writes super block (all of its blocks in one go)
+
+void writeToDirectory(char*, int, mode_t, int); //adds a name as an inode of some mode to parentNode, or removes the entry at a path
+
+int dir_index_find(inode, const char*); //inode number of a name through a directory's index; -1 not there, -2 no index
+void dir_index_rebuild(int); //index a directory whose index was dropped
 
-int loopWrite(char*, inode*);//Writes a string using block_write...looping may be required
+void dirent_set(dir_entry*, int, int, const char*, int, mode_t); //fill in a directory entry record: length, inode, name and its length, mode
+
+dir_entry *dirent_next(char*, int*); //record at an offset in a directory block, moving the offset past it; NULL at the end
+
+int dir_block(inode, int, char*); //read a block of a directory
+
+int loopWrite(const char*, size_t, inode*);//moves the given bytes of an inline file out to extents
 
 int myBlockIndex();//Grabs block index of next free data region block
 
+int myBlockRun(int, int, int*);//Claims up to n contiguous free data blocks, starting the search at a goal block
+
+void freeRun(int, int);//Marks a run of data blocks free
+
 int myInodeIndex();//Grabs block index of next free inode region block
 
-void flipBit(int);//Flips bit on bitmap; will work for either inode or data
+void flipBit(int);//Flips a data block's bit on the bitmap
+
+void freeInode(int);//Marks an inode free in the bitmap
+
+int inode_block(int, int*);//block holding an inode, and the byte offset of it there
+
+int inode_chunk_block(int, int*);//the same for the nth inode past the fixed table; -1 if there's no such chunk
+
+int inode_chunk_alloc();//Claims an inode from the chunks, adding a chunk when they're all full
+
+void inode_chunk_free(int);//Marks a chunk inode free
+
+void inode_chunk_init();//Loads the chunk map at mount
+
+int bitmap_alloc(int, int, int);//Claims the first free bit at or after a start bit of the bitmap at a super region offset, wrapping round
 
-void removeSubDir(char*,inode);//Recursviely removes all 
+void removeSubDir(const inode*);//Recursviely removes all 
 
 
@@ -26,7 +26,8 @@
 int main()
 {
 	printf("%d\n", sizeof(inode));
-	printf("%d\n", sizeof(super));
+	printf("%d\n", sizeof(sfs_layout));
+	printf("%d\n", sizeof(disk_inode));
 	printf("Max-->%d\n", PATH_MAX);
 	return 0;
 }